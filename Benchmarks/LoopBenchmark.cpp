@@ -0,0 +1,878 @@
+/*
+  ==============================================================================
+
+    Headless microbenchmarks for the header-only DSP classes.
+
+    Builds without JUCE so it can run on a plain Linux box. Each result is
+    printed as one JSON object per line so runs can be diffed or loaded into
+    a script to catch regressions. A few correctness checks run first, and
+    any that fails makes the run exit non-zero before a number is printed.
+
+  ==============================================================================
+*/
+
+#include "../Source/CopyLoop.h"
+#include "../Source/Overdub.h"
+#include "../Source/LoopHistory.h"
+#include "../Source/DirtyRanges.h"
+#include "../Source/LoopArchive.h"
+#include "../Source/LoopReaders.h"
+#include "../Source/TransportCursor.h"
+#include "../Source/ScratchArena.h"
+#include "../Source/LevelMeter.h"
+#include "../Source/MixWorkers.h"
+#include "../Source/LoopMixer.h"
+#include "../Source/LoopMemory.h"
+#include "../Source/SampleFormat.h"
+#include "../Source/TimeStretch.h"
+#include "../Source/Resample.h"
+#include "../Source/Constants.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr double SAMPLE_RATE = 48000.0;
+constexpr int BLOCK_SIZES[] = { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+constexpr double TEMPOS[] = { 60.0, 120.0, 174.0 };
+constexpr int LOOP_COUNTS[] = { 1, defaultLoopCount, 16, maxLoops };
+constexpr int MAX_LOOPS = maxLoops;   // largest entry in LOOP_COUNTS
+constexpr int LOOP_BEATS = defaultLoopBars * beatsPerBar;
+constexpr int CHANNELS = 2;
+constexpr size_t HISTORY_BUDGET = (size_t)64 << 20;
+constexpr int CHUNK_SIZE = 256;   // LooperAudioProcessor::chunkSize
+constexpr int MIX_HELPERS = 3;
+constexpr int FADE_LENGTHS[] = { DEFAULT_FADE_SAMPLES, 4800 };
+
+struct Options {
+    std::string filter;
+    double minSeconds = 0.02;
+    int repeats = 5;
+    bool checkOnly = false;
+};
+
+struct Result {
+    const char* bench;
+    int blockSize;
+    size_t samplesPerBeat;
+    int loops;
+    int channels;
+    double nsPerSample;
+    double bytesPerSample;
+    int fadeLength = DEFAULT_FADE_SAMPLES;
+};
+
+void printResult(const Result& r) {
+    std::printf(
+        "{\"bench\":\"%s\",\"block\":%d,\"samplesPerBeat\":%zu,\"loops\":%d,\"channels\":%d,\"fade\":%d,\"ns_per_sample\":%.4f,\"bytes_per_sample\":%.2f}\n",
+        r.bench, r.blockSize, r.samplesPerBeat, r.loops, r.channels, r.fadeLength, r.nsPerSample, r.bytesPerSample
+    );
+    std::fflush(stdout);
+}
+
+/*
+* Runs body repeatedly until at least minSeconds have passed, and returns the best
+* time per block over several repeats in nanoseconds.
+* @param options Benchmark timing options.
+* @param body Callable taking the block index, so callers can advance a playhead.
+*/
+template <typename F>
+double timeBlocks(const Options& options, F&& body) {
+    using clock = std::chrono::steady_clock;
+
+    long blocks = 0;
+    auto start = clock::now();
+    do {
+        body(blocks++);
+    } while (std::chrono::duration<double>(clock::now() - start).count() < options.minSeconds);
+
+    double best = 1e300;
+    for (int r = 0; r < options.repeats; r++) {
+        auto t0 = clock::now();
+        for (long i = 0; i < blocks; i++) {
+            body(i);
+        }
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - t0).count() / blocks;
+        if (ns < best) best = ns;
+    }
+
+    return best;
+}
+
+size_t samplesPerBeatFor(double bpm) {
+    return (size_t)ceil(SAMPLE_RATE * 60.0 / bpm);
+}
+
+void fillNoise(Loop<float>& loop, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+    for (int channel = 0; channel < loop.getNumChannels(); channel++) {
+        float* data = loop.getChannel(channel);
+        for (size_t i = 0; i < loop.getSize(); i++) {
+            data[i] = dist(rng);
+        }
+    }
+}
+
+// Planar multichannel buffer, handed to the DSP classes as an array of channel pointers.
+struct ChannelBuffer {
+    ChannelBuffer(int blockSize, float value = 0.f) : samples(blockSize * CHANNELS, value) {
+        for (int channel = 0; channel < CHANNELS; channel++) {
+            pointers[channel] = samples.data() + channel * blockSize;
+        }
+    }
+
+    std::vector<float> samples;
+    float* pointers[CHANNELS];
+};
+
+/*
+* Thin harness around LoopMixer, the processor's mix path, driven the way LooperAudioProcessor drives it:
+* the block in chunks with the gains ramped across it, a take recorded into the copy loop, meters
+* published once. Only the JUCE pieces and undo history are left out.
+*/
+struct MixHarness {
+    MixHarness(int loopCount, size_t samplesPerBeat, int blockSize) :
+        loopCount(loopCount), nSamples(blockSize), loops(new Loop<float>[loopCount])
+    {
+        cursor.setTempo(SAMPLE_RATE, 60.0 * SAMPLE_RATE / samplesPerBeat, LOOP_BEATS);
+        for (int i = 0; i < loopCount; i++) {
+            loops[i].setLength(cursor.getSamplesPerBeat(), LOOP_BEATS, CHANNELS, 0.f);
+            fillNoise(loops[i], i + 1);
+        }
+        nextLoop.setLength(cursor.getSamplesPerBeat(), LOOP_BEATS, CHANNELS, 0.f);
+        nextLoop.setupCopy(loops.get());
+
+        loopVolumes.assign(loopCount, 0.8f);
+        otherVolumes.assign(loopCount, 1.f);
+        loopGains.assign(loopCount, 1.f);
+        targetGains.assign(loopCount, 1.f);
+        chunkGains.assign(loopCount, 1.f);
+    }
+
+    static float decibelsToGain(float decibels, float minusInfinityDb) {
+        return decibels > minusInfinityDb ? std::pow(10.f, decibels * 0.05f) : 0.f;
+    }
+
+    // The processor's block loop: fixed-size chunks, gains ramped across the block, meters published once.
+    void processBlock(size_t currentSample, float* const* channels) {
+        cursor.moveTo(currentSample);
+        for (int i = 0; i < loopCount; i++) {
+            float decibles = (loopVolumes[i] - 1) * -minLoopDb;
+            targetGains[i] = decibelsToGain(decibles, minLoopDb);
+        }
+
+        bool metering = levelMeter.isActive();
+        MixKernel::Levels levels[MAX_LOOPS + 1];
+        float* chunkChannels[CHANNELS];
+
+        for (int offset = 0; offset < nSamples; offset += CHUNK_SIZE) {
+            int count = std::min(CHUNK_SIZE, nSamples - offset);
+            LoopMixer::rampChunk(loopGains.data(), targetGains.data(), loopCount, count, nSamples - offset, chunkGains.data());
+            for (int channel = 0; channel < CHANNELS; channel++) {
+                chunkChannels[channel] = channels[channel] + offset;
+            }
+            readWriteLoops(offset, chunkChannels, count, metering ? levels : nullptr);
+            std::copy(chunkGains.begin(), chunkGains.end(), loopGains.begin());
+        }
+
+        if (metering) {
+            for (int j = 0; j < loopCount; j++) {
+                if (j != recordingIndex) levelMeter.publish(j, levels[j], nSamples * CHANNELS);
+            }
+            levelMeter.publish(MAX_LOOPS, levels[MAX_LOOPS], nSamples * CHANNELS);
+        }
+
+        // swap so every block ramps, which is the worst case for the kernel
+        std::swap(loopVolumes, otherVolumes);
+    }
+
+    void readWriteLoops(int offset, float* const* channels, int count, MixKernel::Levels* levels) {
+        float inputGain = 1.f;
+        float inputTarget = 1.f;
+
+        if (recordingIndex != -1) {
+            nextLoop.writeBuffer(channels, cursor.at(offset), count);
+            inputGain += loopGains[recordingIndex];
+            inputTarget += chunkGains[recordingIndex];
+        }
+
+        LoopMixer::Chunk chunk { channels, CHANNELS, count, loopCount, loopGains.data(), chunkGains.data(), levels };
+        LoopMixer::mix(workers, chunk, inputGain, inputTarget, recordingIndex,
+            [&](int j) -> const Loop<float>& { return loops[j]; },
+            [&](const Loop<float>&) { return cursor.at(offset); });
+    }
+
+    const int loopCount;
+    const int nSamples;
+    int recordingIndex = -1;
+    TransportCursor cursor;
+    std::unique_ptr<Loop<float>[]> loops;
+    CopyLoop<float> nextLoop;
+    std::vector<float> loopVolumes;
+    std::vector<float> otherVolumes;
+    std::vector<float> loopGains;
+    std::vector<float> targetGains;
+    std::vector<float> chunkGains;
+    LevelMeter<MAX_LOOPS + 1> levelMeter;
+    MixWorkers workers;
+};
+
+// Start every sweep just before the loop end so the first blocks hit the crossfade and wraparound paths.
+size_t playheadFor(long block, int blockSize, size_t loopSize) {
+    size_t start = loopSize - DEFAULT_FADE_SAMPLES - blockSize / 2;
+    return start + (size_t)block * blockSize;
+}
+
+void benchReadBuffer(const Options& options, int blockSize, size_t samplesPerBeat) {
+    Loop<float> loop;
+    loop.setLength((double)samplesPerBeat, LOOP_BEATS, CHANNELS, 0.f);
+    fillNoise(loop, 1);
+    ChannelBuffer dest(blockSize);
+
+    double ns = timeBlocks(options, [&](long block) {
+        loop.readBuffer(dest.pointers, loop.getPosition(playheadFor(block, blockSize, loop.getSize())), blockSize);
+    });
+    printResult({ "Loop::readBuffer", blockSize, samplesPerBeat, 1, CHANNELS, ns / (blockSize * CHANNELS), 2.0 * sizeof(float) });
+}
+
+void benchReadBufferWrap(const Options& options, int blockSize, size_t samplesPerBeat) {
+    Loop<float> loop;
+    loop.setLength((double)samplesPerBeat, LOOP_BEATS, CHANNELS, 0.f);
+    fillNoise(loop, 1);
+    ChannelBuffer dest(blockSize);
+
+    // every block straddles the loop end, so each call splits, wraps and crossfades
+    size_t loopSize = loop.getSize();
+    size_t playhead = loopSize - blockSize / 2;
+    double ns = timeBlocks(options, [&](long block) {
+        loop.readBuffer(dest.pointers, loop.getPosition(playhead + (size_t)(block % 64) * loopSize), blockSize);
+    });
+    printResult({ "Loop::readBuffer/wrap", blockSize, samplesPerBeat, 1, CHANNELS, ns / (blockSize * CHANNELS), 3.0 * sizeof(float) });
+}
+
+void benchFade(const Options& options, int blockSize, size_t samplesPerBeat, int fadeLength, FadeCurve curve) {
+    Loop<float> loop;
+    loop.setLength((double)samplesPerBeat, LOOP_BEATS, CHANNELS, 0.f);
+    loop.setFade(FadeTable::get(fadeLength, curve));
+    fillNoise(loop, 1);
+    ChannelBuffer dest(blockSize);
+
+    // keep every block inside the fade region, wrapping when the block reaches the loop end
+    size_t loopSize = loop.getSize();
+    size_t fadeStart = loopSize - std::min((size_t)fadeLength, loopSize);
+    size_t span = std::max((size_t)1, (loopSize - fadeStart) / blockSize);
+    double ns = timeBlocks(options, [&](long block) {
+        loop.mixInto(dest.pointers, loop.getPosition(fadeStart + (size_t)(block % span) * blockSize), blockSize, 0.5f, 0.6f);
+    });
+
+    const char* name = curve == FadeCurve::equalPower ? "Loop::mixInto/fade-equalPower" : "Loop::mixInto/fade-linear";
+    printResult({ name, blockSize, samplesPerBeat, 1, CHANNELS, ns / (blockSize * CHANNELS), 6.0 * sizeof(float), fadeLength });
+}
+
+// Mixing a loop kept in a smaller format, which reads fewer bytes from loop memory per value.
+void benchStorage(const Options& options, int blockSize, size_t samplesPerBeat, SampleFormat format, const char* name) {
+    LoopMemory memory;
+    size_t capacity = samplesPerBeat * LOOP_BEATS;
+    const auto& storage = memory.allocate(capacity, MAX_FADE_SAMPLES, CHANNELS, 1, format, false);
+    Loop<float> loop;
+    loop.setStorage(storage.getData(0), storage.getPreLoop(0), storage.capacity, CHANNELS, storage.format);
+    loop.resize((double)samplesPerBeat, LOOP_BEATS);
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+    std::vector<float> noise(loop.getSize());
+    for (int channel = 0; channel < CHANNELS; channel++) {
+        for (float& value : noise) value = dist(rng);
+        loop.write(channel, 0, noise.size(), noise.data());
+    }
+    loop.copyPreLoop(loop.getSize());
+    ChannelBuffer dest(blockSize);
+
+    double ns = timeBlocks(options, [&](long block) {
+        loop.mixInto(dest.pointers, loop.getPosition(playheadFor(block, blockSize, loop.getSize())), blockSize, 0.5f, 0.6f);
+    });
+    double bytes = SampleConversion::bytesPerValue(format) + 2.0 * sizeof(float);
+    printResult({ name, blockSize, samplesPerBeat, 1, CHANNELS, ns / (blockSize * CHANNELS), bytes });
+}
+
+void benchSegments(const Options& options, int blockSize, size_t samplesPerBeat) {
+    Loop<float> loop;
+    loop.setLength((double)samplesPerBeat, LOOP_BEATS, CHANNELS, 0.f);
+
+    size_t loopSize = loop.getSize();
+    volatile size_t sink = 0;
+    double ns = timeBlocks(options, [&](long block) {
+        sink = sink + loop.getSegments(loop.getPosition(playheadFor(block, blockSize, loopSize)), blockSize).fadeCount;
+    });
+    printResult({ "Loop::getSegments", blockSize, samplesPerBeat, 1, CHANNELS, ns / (blockSize * CHANNELS), 0.0 });
+}
+
+void benchWriteBuffer(const Options& options, int blockSize, size_t samplesPerBeat) {
+    Loop<float> target;
+    target.setLength((double)samplesPerBeat, LOOP_BEATS, CHANNELS, 0.f);
+    CopyLoop<float> copy;
+    copy.setLength((double)samplesPerBeat, LOOP_BEATS, CHANNELS, 0.f);
+    copy.setupCopy(&target);
+    ChannelBuffer input(blockSize, 0.25f);
+
+    double ns = timeBlocks(options, [&](long block) {
+        copy.writeBuffer(input.pointers, copy.getPosition(playheadFor(block, blockSize, copy.getSize())), blockSize);
+    });
+    printResult({ "CopyLoop::writeBuffer", blockSize, samplesPerBeat, 1, CHANNELS, ns / (blockSize * CHANNELS), 2.0 * sizeof(float) });
+}
+
+// Layering onto a loop in place, with feedback, instead of recording into a second loop.
+void benchOverdub(const Options& options, int blockSize, size_t samplesPerBeat) {
+    Loop<float> target;
+    target.setLength((double)samplesPerBeat, LOOP_BEATS, CHANNELS, 0.25f);
+    Overdub<float> overdub;
+    overdub.start(&target);
+    ChannelBuffer input(blockSize, 0.25f);
+
+    double ns = timeBlocks(options, [&](long block) {
+        overdub.writeBuffer(input.pointers, target.getPosition(playheadFor(block, blockSize, target.getSize())), blockSize, 0.9f);
+    });
+    printResult({ "Overdub::writeBuffer", blockSize, samplesPerBeat, 1, CHANNELS, ns / (blockSize * CHANNELS), 3.0 * sizeof(float) });
+}
+
+// The same, saving each page for undo before a pass first layers onto it, with old passes evicted in the background.
+void benchOverdubHistory(const Options& options, int blockSize, size_t samplesPerBeat) {
+    Loop<float> target;
+    target.setLength((double)samplesPerBeat, LOOP_BEATS, CHANNELS, 0.25f);
+    LoopHistory history;
+    history.prepare(HISTORY_BUDGET, CHANNELS, target.getSize(), SampleFormat::float32);
+    Overdub<float> overdub;
+    overdub.start(&target);
+    ChannelBuffer input(blockSize, 0.25f);
+
+    double ns = timeBlocks(options, [&](long block) {
+        LoopPosition position = target.getPosition(playheadFor(block, blockSize, target.getSize()));
+        history.beforeOverdub(&target, 0, position, blockSize);
+        overdub.writeBuffer(input.pointers, position, blockSize, 0.9f);
+        history.afterOverdub(target);
+    });
+    printResult({ "Overdub::writeBuffer/history", blockSize, samplesPerBeat, 1, CHANNELS, ns / (blockSize * CHANNELS), 3.0 * sizeof(float) });
+}
+
+// Taking a block's worth of scratch channels twice and giving it all back, as a block of audio would.
+void benchScratchArena(const Options& options, int blockSize) {
+    ScratchArena arena;
+    arena.allocate(2 * (ScratchArena::bytesFor<float*>(CHANNELS) + CHANNELS * ScratchArena::bytesFor<float>(blockSize)));
+
+    double ns = timeBlocks(options, [&](long) {
+        float** a = arena.getChannels<float>(CHANNELS, blockSize);
+        float** b = arena.getChannels<float>(CHANNELS, blockSize);
+        a[0][0] = b[1][0];
+        arena.reset();
+    });
+    printResult({ "ScratchArena::get", blockSize, 0, 1, CHANNELS, ns / (blockSize * CHANNELS), 0.0 });
+}
+
+// What the processor does on a tempo change, alternating between two tempos: every loop plus the copy loop.
+void benchTempoChange(const Options& options, size_t samplesPerBeat, bool slab) {
+    const int loopCount = defaultLoopCount + 1;
+    size_t tempos[2] = { samplesPerBeat, samplesPerBeat + samplesPerBeat / 10 };
+    size_t capacity = (size_t)std::ceil((double)tempos[1] * LOOP_BEATS);
+
+    LoopMemory memory;
+    std::unique_ptr<Loop<float>[]> loops(new Loop<float>[loopCount]);
+    if (slab) {
+        const auto& storage = memory.allocate(capacity, MAX_FADE_SAMPLES, CHANNELS, loopCount, SampleFormat::float32, false);
+        for (int i = 0; i < loopCount; i++) {
+            loops[i].setStorage(storage.getData(i), storage.getPreLoop(i), storage.capacity, CHANNELS);
+        }
+    }
+
+    double ns = timeBlocks(options, [&](long block) {
+        for (int i = 0; i < loopCount; i++) {
+            if (slab) {
+                loops[i].resize((double)tempos[block & 1], LOOP_BEATS);
+            } else {
+                loops[i].setLength((double)tempos[block & 1], LOOP_BEATS, CHANNELS, 0.f);
+            }
+        }
+    });
+
+    // block is 0 as this isn't per block; ns_per_sample is the cost of one change spread over the loop memory
+    double values = (double)samplesPerBeat * LOOP_BEATS * CHANNELS * loopCount;
+    printResult({ slab ? "setupLoops/slab" : "setupLoops/setLength", 0, samplesPerBeat, loopCount, CHANNELS, ns / values, slab ? 0.0 : (double)sizeof(float) });
+}
+
+// Background stretch of one channel of a loop to a 10% slower tempo: finding the grains and rendering them.
+void benchStretch(const Options& options, size_t samplesPerBeat) {
+    Loop<float> loop;
+    loop.setLength((double)samplesPerBeat, LOOP_BEATS, 1, 0.f);
+    fillNoise(loop, 11);
+    size_t length = (size_t)std::ceil((double)(samplesPerBeat + samplesPerBeat / 10) * LOOP_BEATS);
+    std::vector<float> out(length);
+
+    double ns = timeBlocks(options, [&](long) {
+        auto plan = TimeStretch::plan(loop.getChannel(0), loop.getSize(), length);
+        TimeStretch::render(plan, loop.getChannel(0), out.data());
+    });
+
+    // block is 0 as this runs once per tempo change, off the audio thread; ns_per_sample is per output value
+    printResult({ "TimeStretch", 0, samplesPerBeat, 1, 1, ns / length, 0.0 });
+}
+
+// Resampling one channel of a loop when the host goes from 48 kHz to 44.1 kHz, as prepareToPlay does.
+void benchResample(const Options& options, size_t samplesPerBeat) {
+    Loop<float> loop;
+    loop.setLength((double)samplesPerBeat, LOOP_BEATS, 1, 0.f);
+    fillNoise(loop, 13);
+    double ratio = 44100.0 / SAMPLE_RATE;
+    size_t length = (size_t)std::ceil(samplesPerBeat * ratio * LOOP_BEATS);
+    std::vector<float> out(length);
+    Resample::Filter filter = Resample::design(ratio);
+
+    double ns = timeBlocks(options, [&](long) {
+        Resample::render(filter, loop.getChannel(0), loop.getSize(), out.data(), length, 0, length);
+    });
+
+    // block is 0 as this runs once per sample rate change, off the audio thread; ns_per_sample is per output value
+    printResult({ "Resample", 0, samplesPerBeat, 1, 1, ns / length, 0.0 });
+}
+
+// Encoding one channel of a loop for the plugin state, off the audio thread, and decoding it again on load.
+// The loop is half tones, half silence, like a take that stops short. bytes_per_sample is the encoded size.
+void benchArchive(const Options& options, size_t samplesPerBeat, bool decode) {
+    Loop<float> loop;
+    loop.setLength((double)samplesPerBeat, LOOP_BEATS, 1, 0.f);
+    float* data = loop.getChannel(0);
+    for (size_t i = 0; i < loop.getSize() / 2; i++) {
+        data[i] = 0.3f * std::sin(0.031f * i) + 0.1f * std::sin(0.0071f * i);
+    }
+
+    std::vector<uint8_t> encoded;
+    LoopArchive::encodeStream(data, loop.getSize(), encoded);
+    std::vector<float> out(loop.getSize());
+
+    double ns = timeBlocks(options, [&](long) {
+        if (decode) {
+            LoopArchive::decodeStream({ encoded.data(), encoded.data() + encoded.size() }, out.data(), out.size());
+        } else {
+            encoded.clear();
+            LoopArchive::encodeStream(data, loop.getSize(), encoded);
+        }
+    });
+
+    printResult({ decode ? "LoopArchive::decode" : "LoopArchive::encode", 0, samplesPerBeat, 1, 1, ns / loop.getSize(), (double)encoded.size() / loop.getSize() });
+}
+
+// Converting a block of stored values back to floats and mixing them in at a ramping gain, in one pass.
+void benchSampleFormat(const Options& options, int blockSize, SampleFormat format, const char* name) {
+    std::vector<float> values(blockSize);
+    for (int i = 0; i < blockSize; i++) values[i] = 0.5f * std::sin(0.031f * i);
+    std::vector<uint8_t> stored(blockSize * SampleConversion::bytesPerValue(format));
+    SampleConversion::encode(format, values.data(), stored.data(), blockSize);
+    std::vector<float> out(blockSize, 0.f);
+
+    double ns = timeBlocks(options, [&](long) {
+        SampleConversion::decodeAdd(format, stored.data(), out.data(), blockSize, 0.5f, 0.25f / blockSize);
+    });
+
+    // the stored values are read, the output read and written
+    double bytes = SampleConversion::bytesPerValue(format) + 2.0 * sizeof(float);
+    printResult({ name, blockSize, 0, 1, 1, ns / blockSize, bytes });
+}
+
+void benchMix(const Options& options, int blockSize, size_t samplesPerBeat, int loopCount, bool recording, bool metering, int helpers = 0) {
+    MixHarness harness(loopCount, samplesPerBeat, blockSize);
+    harness.workers.start(helpers, CHANNELS, CHUNK_SIZE);
+    harness.recordingIndex = recording ? 0 : -1;
+    if (metering) harness.levelMeter.addViewer();
+    ChannelBuffer input(blockSize, 0.25f);
+    ChannelBuffer channels(blockSize);
+
+    size_t loopSize = harness.loops[0].getSize();
+    double ns = timeBlocks(options, [&](long block) {
+        // the host hands over a fresh input buffer every block
+        channels.samples = input.samples;
+        harness.processBlock(playheadFor(block, blockSize, loopSize), channels.pointers);
+    });
+
+    // the input is copied in, then the channel is read and written once per loop and every loop is read once;
+    // metering rides along in the same pass so it adds no traffic
+    double bytes = sizeof(float) * (2.0 + 3.0 * loopCount);
+    const char* name = helpers > 0 ? "readWriteLoops/parallel" : metering ? "readWriteLoops/metered" : recording ? "readWriteLoops/recording" : "readWriteLoops";
+    printResult({ name, blockSize, samplesPerBeat, loopCount, CHANNELS, ns / (blockSize * CHANNELS), bytes });
+}
+
+/*
+* Correctness checks, run before the benchmarks so a fast number can't hide a wrong result. The codec is
+* checked bit for bit, since a bug there corrupts saved projects, along with the history and the dirty
+* ranges overdubbing relies on. Each failure is printed to stderr and makes the run exit non-zero.
+*/
+int failures = 0;
+
+void expect(bool condition, const char* what) {
+    if (condition) return;
+    std::fprintf(stderr, "check failed: %s\n", what);
+    failures++;
+}
+
+float fromBits(uint32_t bits) {
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+bool sameBits(const float* a, const float* b, size_t count) {
+    return count == 0 || std::memcmp(a, b, count * sizeof(float)) == 0;
+}
+
+// Decode a stream into count values, with guard values after them that must come through untouched.
+bool decodeGuarded(const std::vector<uint8_t>& encoded, size_t length, size_t count, std::vector<float>& out) {
+    const uint32_t guard = 0x7fc0dead;
+    out.assign(count + 64, fromBits(guard));
+    bool decoded = LoopArchive::decodeStream({ encoded.data(), encoded.data() + length }, out.data(), count);
+    bool intact = true;
+    for (size_t i = count; i < out.size(); i++) {
+        intact = intact && std::memcmp(&out[i], &guard, sizeof(guard)) == 0;
+    }
+    expect(intact, "LoopArchive::decodeStream writes past the values it was given");
+    out.resize(count);
+    return decoded;
+}
+
+void checkRoundTrip(const std::vector<float>& values, const char* what) {
+    std::vector<uint8_t> encoded;
+    LoopArchive::encodeStream(values.data(), values.size(), encoded);
+    std::vector<float> decoded;
+    expect(decodeGuarded(encoded, encoded.size(), values.size(), decoded) && sameBits(values.data(), decoded.data(), values.size()), what);
+
+    // a stream holding more values than asked for is malformed, not cut short
+    uint32_t last = 0;
+    if (!values.empty()) std::memcpy(&last, &values.back(), sizeof(last));
+    if (last != 0) expect(!decodeGuarded(encoded, encoded.size(), values.size() - 1, decoded), "LoopArchive::decodeStream accepts too many values");
+}
+
+void checkArchiveCodec() {
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+    auto noise = [&](std::vector<float>& values, size_t count) {
+        for (size_t i = 0; i < count; i++) values.push_back(dist(rng));
+    };
+
+    checkRoundTrip({}, "LoopArchive round trip: empty");
+    checkRoundTrip(std::vector<float>(1000, 0.f), "LoopArchive round trip: silence");
+
+    // gaps of zeros either side of the shortest that ends a run, between, before and after audio
+    for (size_t gap = 1; gap <= 40; gap++) {
+        std::vector<float> values(gap, 0.f);
+        noise(values, 37);
+        values.insert(values.end(), gap, 0.f);
+        noise(values, 1);
+        values.insert(values.end(), gap, 0.f);
+        noise(values, 50);
+        values.insert(values.end(), gap, 0.f);
+        checkRoundTrip(values, "LoopArchive round trip: zero runs");
+    }
+
+    // values whose bits are far from what the predictor expects, and ones that aren't plain numbers
+    const uint32_t special[] = {
+        0x80000000, 0x7fc00000, 0xffc00000, 0x7fa00001, 0xffbfffff, 0x7f800000, 0xff800000,
+        0x00000001, 0x80000001, 0x007fffff, 0x807fffff, 0x00800000, 0x7f7fffff, 0xff7fffff,
+    };
+    std::vector<float> values;
+    for (int repeat = 0; repeat < 3; repeat++) {
+        for (uint32_t bits : special) {
+            values.push_back(fromBits(bits));
+            values.push_back(0.f);
+            values.push_back(fromBits(bits ^ 0x80000000));
+        }
+    }
+    checkRoundTrip(values, "LoopArchive round trip: -0.0, NaN, infinities and denormals");
+    checkRoundTrip(std::vector<float>(100, -0.f), "LoopArchive round trip: -0.0 only");
+
+    values.clear();
+    for (int i = 0; i < 20000; i++) values.push_back(fromBits(rng()));
+    checkRoundTrip(values, "LoopArchive round trip: random bits");
+
+    // cut short or corrupted streams must decode to false or to something, never past the values
+    values.clear();
+    noise(values, 300);
+    values.insert(values.end(), 40, 0.f);
+    noise(values, 300);
+    std::vector<uint8_t> encoded;
+    LoopArchive::encodeStream(values.data(), values.size(), encoded);
+    std::vector<float> decoded;
+    for (size_t length = 0; length < encoded.size(); length++) {
+        decodeGuarded(encoded, length, values.size(), decoded);
+    }
+    std::vector<uint8_t> corrupted;
+    for (int trial = 0; trial < 2000; trial++) {
+        corrupted = encoded;
+        for (int flip = 0; flip < 4; flip++) corrupted[rng() % corrupted.size()] ^= (uint8_t)(1 << (rng() % 8));
+        decodeGuarded(corrupted, corrupted.size(), values.size(), decoded);
+    }
+    for (int trial = 0; trial < 2000; trial++) {
+        corrupted.resize(rng() % 64);
+        for (uint8_t& byte : corrupted) byte = (uint8_t)rng();
+        decodeGuarded(corrupted, corrupted.size(), values.size(), decoded);
+    }
+
+    // gap or length past the end, an empty run, or more than 8 bytes for a value
+    expect(!decodeGuarded({ 0x90, 0x4e, 0x01, 0x00 }, 4, 100, decoded), "LoopArchive::decodeStream accepts a gap past the end");
+    expect(!decodeGuarded({ 0x00, 0xe5, 0x00 }, 3, 100, decoded), "LoopArchive::decodeStream accepts a run past the end");
+    expect(!decodeGuarded({ 0x00, 0x00 }, 2, 100, decoded), "LoopArchive::decodeStream accepts an empty run");
+    expect(!decodeGuarded({ 0x00, 0x01, 0x09, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, 12, 100, decoded), "LoopArchive::decodeStream accepts a 9 byte value");
+}
+
+// A whole snapshot through the archive's own thread and back, then every way of cutting it short.
+void checkArchiveSnapshot() {
+    const int loopCount = 2;
+    const double samplesPerBeat = 1000.5;
+    size_t capacity = (size_t)std::ceil(samplesPerBeat * LOOP_BEATS);
+    auto makeLoops = [&](std::vector<float>& memory, Loop<float>* loops) {
+        memory.assign(loopCount * (capacity + MAX_FADE_SAMPLES) * CHANNELS, 0.f);
+        for (int i = 0; i < loopCount; i++) {
+            float* data = memory.data() + i * (capacity + MAX_FADE_SAMPLES) * CHANNELS;
+            loops[i].setStorage(data, data + capacity * CHANNELS, capacity, CHANNELS);
+            loops[i].resize(samplesPerBeat, LOOP_BEATS);
+        }
+    };
+
+    std::vector<float> memory;
+    Loop<float> loops[loopCount];
+    makeLoops(memory, loops);
+    std::mt19937 rng(11);
+    std::vector<float> values(capacity + MAX_FADE_SAMPLES);
+    for (int channel = 0; channel < CHANNELS; channel++) {
+        for (size_t i = 0; i < values.size(); i++) values[i] = i % 1000 < 400 ? 0.f : fromBits(rng());
+        values[5] = -0.f;
+        loops[0].write(channel, 0, capacity, values.data());
+        loops[0].writePreLoop(channel, 0, MAX_FADE_SAMPLES, values.data() + capacity);
+    }
+    loops[0].setSilent(false);
+
+    LoopReaders readers;
+    std::vector<uint8_t> snapshot;
+    {
+        LoopArchive archive(readers, loops);
+        archive.setLoopCount(loopCount);
+        archive.takeCommitted(0);
+        archive.takeCommitted(1);
+        for (int wait = 0; wait < 500 && !archive.isUpToDate(); wait++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        expect(archive.isUpToDate(), "LoopArchive never encoded the loops");
+        snapshot = archive.getSnapshot();
+    }
+
+    std::vector<float> restoredMemory;
+    Loop<float> restored[loopCount];
+    std::vector<float> expected(std::max(capacity, (size_t)MAX_FADE_SAMPLES)), actual(expected.size());
+    auto matches = [&](int loop) {
+        for (int channel = 0; channel < CHANNELS; channel++) {
+            loops[loop].read(channel, 0, capacity, expected.data());
+            restored[loop].read(channel, 0, capacity, actual.data());
+            if (!sameBits(expected.data(), actual.data(), capacity)) return false;
+            loops[loop].readPreLoop(channel, 0, MAX_FADE_SAMPLES, expected.data());
+            restored[loop].readPreLoop(channel, 0, MAX_FADE_SAMPLES, actual.data());
+            if (!sameBits(expected.data(), actual.data(), MAX_FADE_SAMPLES)) return false;
+        }
+        return true;
+    };
+
+    makeLoops(restoredMemory, restored);
+    double restoredTempo = LoopArchive::restore(snapshot.data(), snapshot.size(), restored, loopCount, LOOP_BEATS);
+    expect(restoredTempo == samplesPerBeat && !restored[0].isSilent() && restored[1].isSilent() && matches(0),
+        "LoopArchive snapshot round trip");
+
+    // a loop that comes back from a snapshot cut short must be the loop that was saved
+    size_t step = std::max<size_t>(1, snapshot.size() / 400);
+    for (size_t length = 0; length < snapshot.size(); length += length < 64 || snapshot.size() - length < 64 ? 1 : step) {
+        makeLoops(restoredMemory, restored);
+        LoopArchive::restore(snapshot.data(), length, restored, loopCount, LOOP_BEATS);
+        expect(restored[0].isSilent() || matches(0), "LoopArchive::restore of a truncated snapshot brings back wrong audio");
+    }
+}
+
+// Undoing an overdub pass must bring back exactly what the loop held before it, and redo what it held after.
+void checkHistory() {
+    // the processor's loops live in loop memory, which is what lets undo mark them silent again
+    size_t capacity = (size_t)std::ceil(1000.0 * LOOP_BEATS);
+    std::vector<float> memory(2 * (capacity + MAX_FADE_SAMPLES) * CHANNELS, 0.f);
+    Loop<float> loop;
+    CopyLoop<float> copy;
+    loop.setStorage(memory.data(), memory.data() + capacity * CHANNELS, capacity, CHANNELS);
+    copy.setStorage(memory.data() + (capacity + MAX_FADE_SAMPLES) * CHANNELS,
+        memory.data() + (2 * capacity + MAX_FADE_SAMPLES) * CHANNELS, capacity, CHANNELS);
+    loop.resize(1000.0, LOOP_BEATS);
+    copy.resize(1000.0, LOOP_BEATS);
+    copy.setupCopy(&loop);
+    fillNoise(loop, 3);
+    loop.setSilent(false);
+    LoopHistory history;
+    history.prepare(HISTORY_BUDGET, CHANNELS, loop.getSize(), SampleFormat::float32);
+    Overdub<float> overdub;
+    overdub.start(&loop);
+
+    auto contents = [&] {
+        std::vector<float> values(loop.getSize() * CHANNELS);
+        for (int channel = 0; channel < CHANNELS; channel++) loop.read(channel, 0, loop.getSize(), values.data() + channel * loop.getSize());
+        return values;
+    };
+
+    // two passes, the second over part of the first and across the loop end
+    const int blockSize = 300;
+    ChannelBuffer input(blockSize, 0.125f);
+    std::vector<float> states[3] = { contents() };
+    size_t passes[2][2] = { { 100, loop.getSize() / 2 }, { loop.getSize() / 3, loop.getSize() + 500 } };
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t sample = passes[pass][0]; sample < passes[pass][1]; ) {
+            LoopPosition position = loop.getPosition(sample % loop.getSize());
+            int count = (int)std::min<size_t>(blockSize, passes[pass][1] - sample);
+            sample += count;
+            history.beforeOverdub(&loop, 0, position, count);
+            overdub.writeBuffer(input.pointers, position, count, 0.5f);
+            history.afterOverdub(loop);
+        }
+        history.endStep();
+        states[pass + 1] = contents();
+    }
+
+    while (history.undo(&loop, copy) != -1) {}
+    expect(contents() == states[0], "LoopHistory undo doesn't restore the loop");
+    while (contents() != states[1] && history.redo(&loop, copy) != -1) {}
+    expect(contents() == states[1], "LoopHistory redo doesn't bring back the first pass");
+    while (history.redo(&loop, copy) != -1) {}
+    expect(contents() == states[2], "LoopHistory redo doesn't bring back the second pass");
+}
+
+// Joining ranges when the list is full must only ever report values that weren't written.
+void checkDirtyRanges() {
+    std::mt19937 rng(5);
+    for (int trial = 0; trial < 200; trial++) {
+        const size_t length = 2000;
+        std::vector<char> written(length, 0), cleared(length, 0);
+        DirtyRanges ranges;
+        for (int add = 0; add < 40; add++) {
+            size_t start = rng() % length;
+            size_t end = std::min(length, start + 1 + rng() % 50);
+            ranges.add(start, end, [&](size_t from, size_t to) {
+                for (size_t i = from; i < to; i++) {
+                    expect(!written[i], "DirtyRanges reports a written value as joined");
+                    cleared[i] = 1;
+                }
+            });
+            std::fill(written.begin() + start, written.begin() + end, 1);
+        }
+        for (size_t i = 0; i < length; i++) {
+            bool covered = ranges.covers(i, i + 1);
+            if (covered != (written[i] || cleared[i])) {
+                expect(false, "DirtyRanges covers a value that was neither written nor joined");
+                break;
+            }
+        }
+    }
+}
+
+void runChecks() {
+    checkArchiveCodec();
+    checkArchiveSnapshot();
+    checkHistory();
+    checkDirtyRanges();
+}
+
+bool selected(const Options& options, const char* name) {
+    return options.filter.empty() || std::strstr(name, options.filter.c_str()) != nullptr;
+}
+
+void usage(const char* program) {
+    std::fprintf(stderr,
+        "usage: %s [--filter NAME] [--min-time SECONDS] [--repeats N] [--quick] [--check]\n"
+        "Runs the correctness checks first and exits non-zero if any fails; --check runs only those.\n"
+        "Prints one JSON object per line: bench, block, samplesPerBeat, loops, channels, fade, ns_per_sample, bytes_per_sample.\n"
+        "ns_per_sample and bytes_per_sample are per sample of one channel.\n",
+        program
+    );
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            options.minSeconds = std::atof(argv[++i]);
+        } else if (arg == "--repeats" && i + 1 < argc) {
+            options.repeats = std::atoi(argv[++i]);
+        } else if (arg == "--quick") {
+            options.minSeconds = 0.002;
+            options.repeats = 1;
+        } else if (arg == "--check") {
+            options.checkOnly = true;
+        } else {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    runChecks();
+    if (failures > 0) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    if (options.checkOnly) return 0;
+
+    for (double bpm : TEMPOS) {
+        if (selected(options, "setupLoops/setLength")) benchTempoChange(options, samplesPerBeatFor(bpm), false);
+        if (selected(options, "setupLoops/slab")) benchTempoChange(options, samplesPerBeatFor(bpm), true);
+        if (selected(options, "TimeStretch")) benchStretch(options, samplesPerBeatFor(bpm));
+        if (selected(options, "Resample")) benchResample(options, samplesPerBeatFor(bpm));
+        if (selected(options, "LoopArchive::encode")) benchArchive(options, samplesPerBeatFor(bpm), false);
+        if (selected(options, "LoopArchive::decode")) benchArchive(options, samplesPerBeatFor(bpm), true);
+    }
+
+    for (int blockSize : BLOCK_SIZES) {
+        if (selected(options, "ScratchArena::get")) benchScratchArena(options, blockSize);
+        if (selected(options, "SampleConversion::decodeAdd/float32")) benchSampleFormat(options, blockSize, SampleFormat::float32, "SampleConversion::decodeAdd/float32");
+        if (selected(options, "SampleConversion::decodeAdd/int24")) benchSampleFormat(options, blockSize, SampleFormat::int24, "SampleConversion::decodeAdd/int24");
+        if (selected(options, "SampleConversion::decodeAdd/int16")) benchSampleFormat(options, blockSize, SampleFormat::int16, "SampleConversion::decodeAdd/int16");
+        if (selected(options, "SampleConversion::decodeAdd/half")) benchSampleFormat(options, blockSize, SampleFormat::half, "SampleConversion::decodeAdd/half");
+
+        for (double bpm : TEMPOS) {
+            size_t samplesPerBeat = samplesPerBeatFor(bpm);
+
+            if (selected(options, "Loop::readBuffer")) benchReadBuffer(options, blockSize, samplesPerBeat);
+            if (selected(options, "Loop::readBuffer/wrap")) benchReadBufferWrap(options, blockSize, samplesPerBeat);
+            if (selected(options, "Loop::getSegments")) benchSegments(options, blockSize, samplesPerBeat);
+            if (selected(options, "Loop::mixInto/float32")) benchStorage(options, blockSize, samplesPerBeat, SampleFormat::float32, "Loop::mixInto/float32");
+            if (selected(options, "Loop::mixInto/int16")) benchStorage(options, blockSize, samplesPerBeat, SampleFormat::int16, "Loop::mixInto/int16");
+            if (selected(options, "Loop::mixInto/half")) benchStorage(options, blockSize, samplesPerBeat, SampleFormat::half, "Loop::mixInto/half");
+            if (selected(options, "CopyLoop::writeBuffer")) benchWriteBuffer(options, blockSize, samplesPerBeat);
+            if (selected(options, "Overdub::writeBuffer")) benchOverdub(options, blockSize, samplesPerBeat);
+            if (selected(options, "Overdub::writeBuffer/history")) benchOverdubHistory(options, blockSize, samplesPerBeat);
+
+            for (int fadeLength : FADE_LENGTHS) {
+                if (selected(options, "Loop::mixInto/fade-linear")) benchFade(options, blockSize, samplesPerBeat, fadeLength, FadeCurve::linear);
+                if (selected(options, "Loop::mixInto/fade-equalPower")) benchFade(options, blockSize, samplesPerBeat, fadeLength, FadeCurve::equalPower);
+            }
+
+            for (int loopCount : LOOP_COUNTS) {
+                if (selected(options, "readWriteLoops")) benchMix(options, blockSize, samplesPerBeat, loopCount, false, false);
+                if (selected(options, "readWriteLoops/recording")) benchMix(options, blockSize, samplesPerBeat, loopCount, true, false);
+                if (selected(options, "readWriteLoops/metered")) benchMix(options, blockSize, samplesPerBeat, loopCount, false, true);
+                if (loopCount >= LoopMixer::parallelLoopThreshold && selected(options, "readWriteLoops/parallel")) {
+                    benchMix(options, blockSize, samplesPerBeat, loopCount, false, false, MIX_HELPERS);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
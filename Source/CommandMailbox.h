@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/*
+* Bounded multi-producer, single-consumer queue of small commands, laid out as plain data so it can live
+* in shared memory and be used from several processes at once. Popping is wait-free: one load, one copy
+* and two stores, so the consumer can run on the audio thread. Pushing is lock-free and fails rather than
+* blocks when the queue is full; failed pushes are counted so the consumer can tell it missed something.
+* Commands that do get in come out exactly once and in the order their pushes claimed positions.
+*
+* Command must be trivially copyable.
+*/
+template<typename Command, uint32_t Capacity>
+class CommandMailbox {
+public:
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	static_assert(std::atomic<uint32_t>::is_always_lock_free, "Shared memory needs address-free atomics");
+
+	// Empty the queue. Only call this while nothing else can be using it, e.g. right after claiming it.
+	void reset() {
+		for (uint32_t i = 0; i < Capacity; i++) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		enqueuePosition.store(0, std::memory_order_relaxed);
+		dequeuePosition.store(0, std::memory_order_relaxed);
+		dropped.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	/*
+	* Add a command. Safe from any number of threads and processes at once.
+	* @return False if the queue was full and the command was dropped.
+	*/
+	bool push(Command command) {
+		uint32_t position = enqueuePosition.load(std::memory_order_relaxed);
+		Cell* cell;
+
+		for (;;) {
+			cell = &cells[position & (Capacity - 1)];
+			uint32_t sequence = cell->sequence.load(std::memory_order_acquire);
+			int32_t difference = (int32_t)(sequence - position);
+
+			if (difference == 0) {
+				if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+			} else if (difference < 0) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			} else {
+				position = enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->command = command;
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	/*
+	* Take the oldest command. Consumer thread only.
+	* @param command Filled in if a command was waiting.
+	* @return False if the queue was empty.
+	*/
+	bool pop(Command& command) {
+		uint32_t position = dequeuePosition.load(std::memory_order_relaxed);
+		Cell& cell = cells[position & (Capacity - 1)];
+		if ((int32_t)(cell.sequence.load(std::memory_order_acquire) - (position + 1)) < 0) return false;
+
+		command = cell.command;
+		cell.sequence.store(position + Capacity, std::memory_order_release);
+		dequeuePosition.store(position + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Total commands dropped because the queue was full. Compare against an earlier value to spot new drops.
+	uint32_t getDroppedCount() const {
+		return dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Cell {
+		std::atomic<uint32_t> sequence;
+		Command command;
+	};
+
+	Cell cells[Capacity];
+	std::atomic<uint32_t> enqueuePosition;
+	std::atomic<uint32_t> dequeuePosition;
+	std::atomic<uint32_t> dropped;
+};
\ No newline at end of file
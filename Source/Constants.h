@@ -1,5 +1,9 @@
 #pragma once
 
-constexpr int nLoops = 6;
-constexpr int loopLenInBeats = 8;
-constexpr float minLoopDb = -30.f;
\ No newline at end of file
+constexpr int maxLoops = 64;            // most loops an instance can be set up with
+constexpr int defaultLoopCount = 6;
+constexpr int beatsPerBar = 4;
+constexpr int maxLoopBars = 64;
+constexpr int defaultLoopBars = 2;
+constexpr float minLoopDb = -30.f;
+constexpr int maxChannels = 8;
\ No newline at end of file
@@ -9,32 +9,53 @@ public:
 
 	/*
 	* Based on current position of the playhead, copy the given buffer to the corresponding position in the loop.
-	* @param buffer Buffer of values to copy.
-	* @param currentSample Location of the playhead in samples.
-	* @param bufferSize Number of values to copy.
+	* @param buffer One pointer per channel of values to copy.
+	* @param position Location of the playhead within the loop.
+	* @param bufferSize Number of values to copy per channel.
+	* @return Whether this block finished a take and swapped it into the target loop.
 	*/
-	void writeBuffer(const T* buffer, size_t currentSample, int bufferSize) {
-		assert(bufferSize <= getSize());
-		size_t loopSample = getLoopSample(currentSample, bufferSize);
+	bool writeBuffer(const T* const* buffer, LoopPosition position, int bufferSize) {
+		size_t count = (size_t)bufferSize;
+		assert(count <= position.length && position.length <= this->getSize());
+		size_t loopSample = position.sample;
+		int numChannels = this->getNumChannels();
+		bool committed = false;
 
-		// copy to the end of loop from buffer
-		size_t samplesToEnd = getSize() - loopSample;
-		copyAll(buffer, loopSample, samplesToEnd > bufferSize ? bufferSize : samplesToEnd);
+		// copy to the end of this pass of the loop from buffer
+		size_t samplesToEnd = position.length - loopSample;
+		for (int channel = 0; channel < numChannels; channel++) {
+			this->copyAll(channel, buffer[channel], loopSample, std::min(count, samplesToEnd));
+		}
 
-		if (bufferSize >= samplesToEnd) {	// if we copied to or over the loop border
+		if (count >= samplesToEnd) {	// if we copied to or over the loop border
 			if (startedCopy) {	// if we had already started, swap in
-				swapData(*copyTarget);
+				this->swapData(*copyTarget);
+				committed = true;
 			} else {
 				startedCopy = true;
 			}
 
-			copyPreLoop();
+			this->copyPreLoop(position.length);
 		}
 
 		// copy remaining to start of loop if needed
-		if (bufferSize > samplesToEnd) {
-			copyAll(buffer + samplesToEnd, 0, bufferSize - samplesToEnd);
+		if (count > samplesToEnd) {
+			for (int channel = 0; channel < numChannels; channel++) {
+				this->copyAll(channel, buffer[channel] + samplesToEnd, 0, count - samplesToEnd);
+			}
 		}
+
+		return committed;
+	}
+
+	// Whether writing this block would commit the take, see writeBuffer.
+	bool willCommit(LoopPosition position, int bufferSize) const {
+		return startedCopy && (size_t)bufferSize >= position.length - position.sample;
+	}
+
+	// Trade audio with a loop, e.g. to swap back the take a commit replaced.
+	void exchange(Loop<T>& loop) {
+		this->swapData(loop);
 	}
 
 	void setupCopy(Loop<T>* copyTarget) {
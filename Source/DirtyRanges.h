@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+/*
+* The parts of a loop written since the last clear, as a short sorted list of disjoint [start, end) ranges.
+* Touching ranges are merged as they're added, so a take written front to back stays one or two ranges
+* however long it runs. Fixed size and allocation free, for the audio thread.
+*/
+class DirtyRanges {
+public:
+	static constexpr int maxRanges = 8;
+
+	struct Range {
+		size_t start;
+		size_t end;
+	};
+
+	void clear() {
+		count = 0;
+	}
+
+	bool isEmpty() const {
+		return count == 0;
+	}
+
+	/*
+	* Mark [start, end) as written. If the list is full, the two ranges with the smallest gap are joined,
+	* which marks that gap as written too.
+	* @param joined Called as joined(from, to) for each piece of such a gap outside [start, end), so those
+	* values can be made to match what the caller assumes of written ones, e.g. by clearing them.
+	*/
+	template<typename Joined>
+	void add(size_t start, size_t end, Joined&& joined) {
+		if (start >= end) return;
+
+		// find the ranges the new one touches and fold them into it
+		int first = 0;
+		while (first < count && ranges[first].end < start) first++;
+		int last = first;
+		while (last < count && ranges[last].start <= end) {
+			start = std::min(start, ranges[last].start);
+			end = std::max(end, ranges[last].end);
+			last++;
+		}
+
+		int removed = last - first;
+		if (removed == 0 && count == maxRanges) {
+			joinClosest(start, end, joined);
+			add(start, end, joined);
+			return;
+		}
+
+		std::move(ranges + last, ranges + count, ranges + first + 1);
+		ranges[first] = { start, end };
+		count += 1 - removed;
+	}
+
+	void add(size_t start, size_t end) {
+		add(start, end, [](size_t, size_t) {});
+	}
+
+	// Whether every value in [start, end) has been written.
+	bool covers(size_t start, size_t end) const {
+		if (start >= end) return true;
+		for (int i = 0; i < count; i++) {
+			if (ranges[i].start <= start && end <= ranges[i].end) return true;
+		}
+		return false;
+	}
+
+	/*
+	* Walk [start, end) in order as alternating clean and written pieces.
+	* @param piece Called as piece(from, to, written) for each non-empty piece.
+	*/
+	template<typename Piece>
+	void split(size_t start, size_t end, Piece&& piece) const {
+		for (int i = 0; i < count && start < end; i++) {
+			if (ranges[i].end <= start) continue;
+			if (ranges[i].start >= end) break;
+			if (ranges[i].start > start) piece(start, ranges[i].start, false);
+			size_t to = std::min(end, ranges[i].end);
+			piece(std::max(start, ranges[i].start), to, true);
+			start = to;
+		}
+		if (start < end) piece(start, end, false);
+	}
+
+	int size() const {
+		return count;
+	}
+
+	const Range& operator[](int index) const {
+		assert(index >= 0 && index < count);
+		return ranges[index];
+	}
+
+private:
+	// Join the two ranges with the smallest gap, reporting the parts of the gap outside [start, end).
+	template<typename Joined>
+	void joinClosest(size_t start, size_t end, Joined& joined) {
+		int closest = 0;
+		for (int i = 1; i < count - 1; i++) {
+			if (ranges[i + 1].start - ranges[i].end < ranges[closest + 1].start - ranges[closest].end) closest = i;
+		}
+		size_t gapStart = ranges[closest].end;
+		size_t gapEnd = ranges[closest + 1].start;
+		if (gapStart < std::min(gapEnd, start)) joined(gapStart, std::min(gapEnd, start));
+		if (std::max(gapStart, end) < gapEnd) joined(std::max(gapStart, end), gapEnd);
+		ranges[closest].end = ranges[closest + 1].end;
+		std::move(ranges + closest + 2, ranges + count, ranges + closest + 1);
+		count--;
+	}
+
+	Range ranges[maxRanges];
+	int count = 0;
+};
\ No newline at end of file
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+enum class FadeCurve {
+	linear,
+	equalPower
+};
+
+/*
+* Precomputed gains for the crossfade at the end of a loop. fadeOut weights the loop's own tail and
+* fadeIn weights the audio recorded just before the loop started, so the wrap back to the start is seamless.
+* Tables are built once per length and curve and live for the rest of the process, so the audio thread
+* can hold a pointer to one without any ownership bookkeeping.
+*/
+class FadeTable {
+public:
+	/*
+	* Get the shared table for a fade. Builds it on first use, so call this off the audio thread.
+	* @param length Number of samples in the fade.
+	* @param curve Shape of the fade.
+	*/
+	static const FadeTable& get(int length, FadeCurve curve) {
+		static std::mutex lock;
+		static std::map<std::pair<int, FadeCurve>, std::unique_ptr<FadeTable>> tables;
+
+		std::lock_guard<std::mutex> guard(lock);
+		auto& table = tables[{ length, curve }];
+		if (table == nullptr) {
+			table.reset(new FadeTable(length, curve));
+		}
+
+		return *table;
+	}
+
+	int getLength() const {
+		return (int)fadeOut.size();
+	}
+
+	FadeCurve getCurve() const {
+		return curve;
+	}
+
+	const float* getFadeOut() const {
+		return fadeOut.data();
+	}
+
+	const float* getFadeIn() const {
+		return fadeIn.data();
+	}
+
+private:
+	FadeTable(int length, FadeCurve curve) : fadeOut(length), fadeIn(length), curve(curve) {
+		const double halfPi = 1.5707963267948966;
+
+		for (int i = 0; i < length; i++) {
+			double fadePercent = (double)i / length;
+
+			if (curve == FadeCurve::equalPower) {
+				fadeOut[i] = (float)std::cos(fadePercent * halfPi);
+				fadeIn[i] = (float)std::sin(fadePercent * halfPi);
+			} else {
+				fadeOut[i] = (float)(1 - fadePercent);
+				fadeIn[i] = (float)fadePercent;
+			}
+		}
+	}
+
+	std::vector<float> fadeOut;
+	std::vector<float> fadeIn;
+	const FadeCurve curve;
+};
\ No newline at end of file
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+
+#include "MixKernel.h"
+
+/*
+* Levels measured on the audio thread, one meter per loop plus one for the input. The values belong to
+* the audio thread, which copies them into the snapshot it publishes for the editor.
+* Metering only runs while something is watching; the editor registers itself for as long as it is open.
+*/
+template<int NumMeters>
+class LevelMeter {
+public:
+	void addViewer() {
+		viewers.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void removeViewer() {
+		viewers.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// Whether the audio thread should bother metering this block. Safe to call from any thread.
+	bool isActive() const {
+		return viewers.load(std::memory_order_relaxed) > 0;
+	}
+
+	/*
+	* Store the levels gathered over one block.
+	* @param index Meter to update.
+	* @param levels Levels accumulated across every channel of the block.
+	* @param numValues Number of values that went into levels, used to turn the sum into a mean.
+	*/
+	void publish(int index, const MixKernel::Levels& levels, int numValues) {
+		float meanSquared = numValues > 0 ? levels.sumOfSquares / numValues : 0.f;
+		rms[index] = std::sqrt(meanSquared);
+		peak[index] = levels.peak;
+	}
+
+	void clear(int index) {
+		rms[index] = 0.f;
+		peak[index] = 0.f;
+	}
+
+	float getRMS(int index) const {
+		return rms[index];
+	}
+
+	float getPeak(int index) const {
+		return peak[index];
+	}
+
+private:
+	float rms[NumMeters] {};
+	float peak[NumMeters] {};
+	std::atomic<int> viewers { 0 };
+};
\ No newline at end of file
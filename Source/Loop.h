@@ -2,146 +2,558 @@
 
 #include <cassert>
 #include <cstring>
+#include <cmath>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
 
-constexpr int FADE_SAMPLES = 200;
+#include "MixKernel.h"
+#include "FadeTable.h"
+#include "SampleFormat.h"
 
+constexpr int DEFAULT_FADE_SAMPLES = 200;
+constexpr int MAX_FADE_SAMPLES = 16384;
+
+/*
+* Where the playhead is within a loop: the index of the next value to play and the length of the current
+* pass. A pass can be a sample shorter than the loop's size when the loop isn't a whole number of samples
+* long, see TransportCursor.
+*/
+struct LoopPosition {
+	size_t sample;
+	size_t length;
+};
+
+/*
+* A loop of audio with any number of channels. All channels live in one allocation, stored planar:
+* channel c starts at c * size. Every operation works out the playhead once and applies it to all channels.
+* The pre loop buffer always keeps MAX_FADE_SAMPLES of lead-in per channel, so the crossfade length can
+* change at any time without reallocating.
+* A loop either owns its memory (setLength) or points into memory owned elsewhere (setStorage, borrow).
+* Memory from setStorage can hold its values in a smaller SampleFormat, which halves what the mix reads for
+* int16 or half; the loop converts as it plays and records. Pointer access through getChannel and
+* getPreLoop is only for float32 loops, anything else goes through read and write.
+*/
 template<typename T>
 class Loop {
 public:
-	Loop<T>() : data(nullptr), size(0), samplesPerBeat(0), beatsPerLoop(0) {
-		preLoop = new T[FADE_SAMPLES];
-	}
+	Loop<T>() : data(nullptr), preLoop(nullptr), size(0), capacity(0), numChannels(0), samplesPerBeat(0), beatsPerLoop(0),
+		ownsData(true), silent(false), format(SampleFormat::float32), valueBytes(sizeof(T)), fade(&FadeTable::get(DEFAULT_FADE_SAMPLES, FadeCurve::linear)) {}
 
 	~Loop<T>() {
+		if (!ownsData) return;
 		delete[] data;
 		delete[] preLoop;
 	}
 
-	T& operator[](size_t x) {
-		assert(x >= 0 && x < size);
-		return data[x];
+	T* getChannel(int channel) {
+		assert(channel >= 0 && channel < numChannels);
+		assert(format == SampleFormat::float32);
+		return data + channel * size;
+	}
+
+	const T* getChannel(int channel) const {
+		assert(channel >= 0 && channel < numChannels);
+		assert(format == SampleFormat::float32);
+		return data + channel * size;
+	}
+
+	// How the loop keeps its values, see setStorage.
+	SampleFormat getFormat() const {
+		return format;
+	}
+
+	// Where the loop's memory starts, e.g. to tell which slab slot it's in.
+	const void* getStorage() const {
+		return data;
+	}
+
+	/*
+	* Copy values out of one channel, converting them from the loop's format.
+	* @param index Location within the loop of the first value.
+	* @param dest Room for count values.
+	*/
+	void read(int channel, size_t index, size_t count, T* dest) const {
+		assert(index + count <= size);
+		SampleConversion::decode(format, valueAt(data, channel * size + index), dest, count);
+	}
+
+	// Copy values into one channel, converting them to the loop's format.
+	void write(int channel, size_t index, size_t count, const T* src) {
+		assert(index + count <= size);
+		SampleConversion::encode(format, src, valueAt(data, channel * size + index), count);
+	}
+
+	// Like read, for a channel's pre loop buffer, which is MAX_FADE_SAMPLES long.
+	void readPreLoop(int channel, size_t index, size_t count, T* dest) const {
+		assert(index + count <= MAX_FADE_SAMPLES);
+		SampleConversion::decode(format, valueAt(preLoop, channel * MAX_FADE_SAMPLES + index), dest, count);
+	}
+
+	// Like write, for a channel's pre loop buffer.
+	void writePreLoop(int channel, size_t index, size_t count, const T* src) {
+		assert(index + count <= MAX_FADE_SAMPLES);
+		SampleConversion::encode(format, src, valueAt(preLoop, channel * MAX_FADE_SAMPLES + index), count);
 	}
 
-	T operator[](size_t x) const {
-		assert(x >= 0 && x < size);
-		return data[x];
+	/*
+	* A whole channel as values, for work off the audio thread that wants the channel in one piece.
+	* @param scratch Holds the converted channel unless the loop is float32, in which case it's untouched.
+	* @return The loop's own memory for float32 loops, otherwise scratch.
+	*/
+	const T* readChannel(int channel, std::vector<T>& scratch) const {
+		if (format == SampleFormat::float32) return getChannel(channel);
+		scratch.resize(size);
+		read(channel, 0, size, scratch.data());
+		return scratch.data();
 	}
-	
+
+	/*
+	* The regions of loop memory that line up with one block, so callers can work on the loop in place.
+	* The first span runs from the playhead towards the end of the loop and the second continues from the
+	* start of the loop after a wrap. The last fadeCount values of the first span still need to be
+	* crossfaded with the lead-in from preLoop, weighted by fadeOut and fadeIn. The pointers are only for
+	* float32 loops.
+	*/
+	struct Segments {
+		const Loop<T>* loop;
+		size_t start;			// loop index of the first value in the block
+		size_t firstCount;		// values before the wrap, including the crossfade
+		size_t secondCount;		// values after the wrap, starting at loop index 0
+		size_t fadeOffset;		// offset within the block where the crossfade starts
+		size_t fadeCount;		// values in the crossfade, always the tail of the first span
+		size_t preLoopOffset;	// index into a channel's pre loop buffer that lines up with fadeOffset
+		const float* fadeOut;	// gains for the loop's own values, starting at fadeOffset
+		const float* fadeIn;	// gains for the lead-in values, starting at fadeOffset
+
+		const T* first(int channel) const {
+			return loop->getChannel(channel) + start;
+		}
+
+		const T* second(int channel) const {
+			return loop->getChannel(channel);
+		}
+
+		const T* preLoop(int channel) const {
+			return loop->preLoop + channel * MAX_FADE_SAMPLES + preLoopOffset;
+		}
+
+		// values at the start of the first span that need no crossfade
+		size_t plainCount() const {
+			return firstCount - fadeCount;
+		}
+	};
+
+	/*
+	* Work out which parts of the loop line up with a block, without copying anything.
+	* @param position Location of the playhead within the loop.
+	* @param bufferSize Number of values in the block.
+	*/
+	Segments getSegments(LoopPosition position, int bufferSize) const {
+		assert(bufferSize <= position.length && position.length <= size);
+		size_t loopSample = position.sample;
+		size_t firstCount = std::min(position.length - loopSample, (size_t)bufferSize);
+
+		const FadeTable* table = fade.load(std::memory_order_acquire);
+		size_t fadeLength = std::min((size_t)table->getLength(), position.length);
+		size_t fadeStart = position.length - fadeLength;
+		size_t plainEnd = std::min(loopSample + firstCount, std::max(fadeStart, loopSample));
+		size_t fadeIndex = plainEnd - std::min(plainEnd, fadeStart);
+
+		Segments segments;
+		segments.loop = this;
+		segments.start = loopSample;
+		segments.firstCount = firstCount;
+		segments.secondCount = bufferSize - firstCount;
+		segments.fadeOffset = plainEnd - loopSample;
+		segments.fadeCount = loopSample + firstCount - plainEnd;
+		segments.preLoopOffset = MAX_FADE_SAMPLES - fadeLength + fadeIndex;
+		segments.fadeOut = table->getFadeOut() + fadeIndex;
+		segments.fadeIn = table->getFadeIn() + fadeIndex;
+		return segments;
+	}
+
 	/*
 	* Based on the current position of the playhead, copy the corresponding region of the loop into a buffer.
-	* @param dest Pointer of the buffer to copy into.
-	* @param currentSample Location of the playhead in samples.
-	* @param bufferSize Number of values to copy.
-	*/
-	void readBuffer(T* dest, size_t currentSample, int bufferSize) const {
-		assert(bufferSize <= size);
-		size_t loopSample = getLoopSample(currentSample, bufferSize);
-		
-		// copy to the end of loop into buffer
-		size_t samplesToEnd = size - loopSample;
-		if (samplesToEnd > bufferSize) samplesToEnd = bufferSize;
-		readAll(dest, loopSample, samplesToEnd);
-
-		// copy remaining from start of loop if needed
-		if (bufferSize > samplesToEnd) {
-			readAll(dest + samplesToEnd, 0, bufferSize - samplesToEnd);
+	* @param dest One pointer per channel of the buffer to copy into.
+	* @param position Location of the playhead within the loop.
+	* @param bufferSize Number of values to copy per channel.
+	*/
+	void readBuffer(T* const* dest, LoopPosition position, int bufferSize) const {
+		if (silent) {
+			for (int channel = 0; channel < numChannels; channel++) {
+				std::fill_n(dest[channel], bufferSize, (T)0);
+			}
+			return;
 		}
 
-		auto fadeStart = size - FADE_SAMPLES;
-		if (loopSample + bufferSize <= fadeStart) return;
+		Segments segments = getSegments(position, bufferSize);
 
-		size_t start = std::max(fadeStart, loopSample);
-		int count = std::min(bufferSize, (int)(size - start));
+		for (int channel = 0; channel < numChannels; channel++) {
+			T* out = dest[channel];
+			read(channel, segments.start, segments.firstCount, out);
+			read(channel, 0, segments.secondCount, out + segments.firstCount);
+			if (segments.fadeCount == 0) continue;
 
-		for (size_t i = start; i < start + count; i++) {
-			size_t fadeIndex = i - fadeStart;
-			size_t destIndex = i - loopSample;
-			float fadePercent = ((float)fadeIndex) / FADE_SAMPLES;
-			dest[destIndex] = dest[destIndex] * (1 - fadePercent) + preLoop[fadeIndex] * fadePercent;
+			T* faded = out + segments.fadeOffset;
+			if (format == SampleFormat::float32) {
+				MixKernel::crossfade(faded, faded, segments.preLoop(channel), segments.fadeOut, segments.fadeIn, segments.fadeCount);
+				continue;
+			}
+			T lead[decodeChunk];
+			for (size_t done = 0; done < segments.fadeCount; done += decodeChunk) {
+				size_t count = std::min(decodeChunk, segments.fadeCount - done);
+				readPreLoop(channel, segments.preLoopOffset + done, count, lead);
+				MixKernel::crossfade(faded + done, faded + done, lead, segments.fadeOut + done, segments.fadeIn + done, count);
+			}
 		}
 	}
 
+	/*
+	* Based on the current position of the playhead, add the corresponding region of the loop into a buffer,
+	* reading straight from loop memory. The gain ramps linearly from startGain to endGain over the buffer.
+	* @param dest One pointer per channel of the buffer to add into.
+	* @param position Location of the playhead within the loop.
+	* @param bufferSize Number of values to add per channel.
+	* @param startGain Gain applied to the first value.
+	* @param endGain Gain the ramp reaches at the end of the buffer.
+	* @param levels If not null, the loop's own output (before gain) is metered into this in the same pass.
+	*/
+	void mixInto(T* const* dest, LoopPosition position, int bufferSize, T startGain, T endGain, MixKernel::Levels* levels = nullptr) const {
+		if (silent) return;
+
+		if (format != SampleFormat::float32) {
+			if (levels != nullptr) {
+				mixDecoded<true>(dest, position, bufferSize, startGain, endGain, levels);
+			} else {
+				mixDecoded<false>(dest, position, bufferSize, startGain, endGain, levels);
+			}
+		} else if (levels != nullptr) {
+			mixInto<true>(dest, position, bufferSize, startGain, endGain, levels);
+		} else {
+			mixInto<false>(dest, position, bufferSize, startGain, endGain, levels);
+		}
+	}
+
+	/*
+	* Where the playhead is within this loop at its own tempo, for loops that aren't at the transport's,
+	* such as one followed from another instance. Loop k starts at floor(k * samplesPerBeat * beatsPerLoop).
+	* @param currentSample Location of the playhead in samples.
+	*/
+	LoopPosition getPosition(size_t currentSample) const {
+		double loopLength = samplesPerBeat * beatsPerLoop;
+		double loopsFromStart = floor(currentSample / loopLength);
+		size_t loopStart = floor(loopsFromStart * loopLength);
+		size_t nextStart = floor((loopsFromStart + 1) * loopLength);
+		size_t length = std::min(nextStart - loopStart, size);
+		return { std::min(currentSample - loopStart, length - 1), length };
+	}
+
 	void fill(T value) {
-		std::fill_n(data, size, value);
-		std::fill_n(preLoop, FADE_SAMPLES, value);
+		if (format == SampleFormat::float32) {
+			std::fill_n(data, size * numChannels, value);
+			std::fill_n(preLoop, MAX_FADE_SAMPLES * numChannels, value);
+			return;
+		}
+		T values[decodeChunk];
+		std::fill_n(values, decodeChunk, value);
+		auto fillValues = [&](uint8_t* into, size_t count) {
+			for (size_t done = 0; done < count; done += decodeChunk) {
+				SampleConversion::encode(format, values, into + done * valueBytes, std::min(decodeChunk, count - done));
+			}
+		};
+		fillValues(valueAt(data, 0), size * numChannels);
+		fillValues(valueAt(preLoop, 0), MAX_FADE_SAMPLES * numChannels);
 	}
 
 	size_t getSize() const {
 		return size;
 	}
 
+	double getSamplesPerBeat() const {
+		return samplesPerBeat;
+	}
+
+	int getBeatsPerLoop() const {
+		return beatsPerLoop;
+	}
+
+	// The whole pre loop buffer of a channel, MAX_FADE_SAMPLES long, with the lead-in at its end.
+	T* getPreLoop(int channel) {
+		assert(channel >= 0 && channel < numChannels);
+		assert(format == SampleFormat::float32);
+		return preLoop + channel * MAX_FADE_SAMPLES;
+	}
+
+	const T* getPreLoop(int channel) const {
+		assert(channel >= 0 && channel < numChannels);
+		assert(format == SampleFormat::float32);
+		return preLoop + channel * MAX_FADE_SAMPLES;
+	}
+
+	int getNumChannels() const {
+		return numChannels;
+	}
+
+	// Whether the loop has no take yet and plays silence, see resize.
+	bool isSilent() const {
+		return silent;
+	}
+
+	/*
+	* Mark a loop that uses setStorage as holding a take, after its memory was filled from outside, e.g.
+	* by time stretching, or as empty again.
+	*/
+	void setSilent(bool silent) {
+		assert(!ownsData);
+		this->silent = silent;
+	}
+
 	/*
-	* Set the length of the loop and fill it with the given value.
+	* Set the crossfade used at the end of the loop. Safe to call while the audio thread is reading,
+	* the table is swapped atomically and tables are never freed.
+	* @param table Fade table from FadeTable::get, at most MAX_FADE_SAMPLES long.
+	*/
+	void setFade(const FadeTable& table) {
+		assert(table.getLength() <= MAX_FADE_SAMPLES);
+		fade.store(&table, std::memory_order_release);
+	}
+
+	const FadeTable& getFade() const {
+		return *fade.load(std::memory_order_acquire);
+	}
+
+	/*
+	* Set the length and channel count of the loop and fill it with the given value.
 	* @param samplesPerBeat Number of samples per beat.
 	* @param beatsPerLoop Number of beats per loop.
+	* @param numChannels Number of audio channels to store.
 	* @param value The value to fill the loop with.
 	*/
-	void setLength(double samplesPerBeat, int beatsPerLoop, T value) {
+	void setLength(double samplesPerBeat, int beatsPerLoop, int numChannels, T value) {
+		assert(ownsData);
 		this->samplesPerBeat = samplesPerBeat;
 		this->beatsPerLoop = beatsPerLoop;
 		size = ceil(samplesPerBeat * beatsPerLoop);
-		
+		capacity = size;
+
+		if (numChannels != this->numChannels) {
+			this->numChannels = numChannels;
+			delete[] preLoop;
+			preLoop = new T[MAX_FADE_SAMPLES * numChannels];
+		}
+
 		delete[] data;
-		data = new T[size];
+		data = new T[size * numChannels];
 
 		fill(value);
 	}
 
-protected:
 	/*
-	* Copy the given elements to the loop.
-	* @param elements Elements to copy.
-	* @param index Location within the loop to copy to.
-	* @param count Number of values to copy.
+	* Play audio that lives somewhere else, such as a shared memory region, instead of owning a copy.
+	* The memory must use the same layout as a loop's own: planar data followed by a planar pre loop buffer
+	* of MAX_FADE_SAMPLES per channel. It must outlive the loop, and the loop can't be resized or written.
+	* @param data size * numChannels values.
+	* @param preLoop MAX_FADE_SAMPLES * numChannels values.
 	*/
-	void copyAll(const T* elements, size_t index, size_t count) {
-		assert(index + count <= getSize());
-		assert(index >= 0);
+	void borrow(const T* data, const T* preLoop, double samplesPerBeat, int beatsPerLoop, int numChannels) {
+		assert(this->data == nullptr);
+		this->data = const_cast<T*>(data);
+		this->preLoop = const_cast<T*>(preLoop);
+		this->samplesPerBeat = samplesPerBeat;
+		this->beatsPerLoop = beatsPerLoop;
+		this->numChannels = numChannels;
+		size = ceil(samplesPerBeat * beatsPerLoop);
+		capacity = size;
+		ownsData = false;
+	}
 
-		std::memcpy(data + index, elements, sizeof(T) * count);
+	/*
+	* Play from memory owned elsewhere, such as a LoopMemory slab, so the length can change without
+	* allocating. The loop starts out silent; call resize to give it a length.
+	* @param data Room for capacity values per channel, aligned for T.
+	* @param preLoop MAX_FADE_SAMPLES values per channel, aligned for T.
+	* @param capacity Longest loop the memory can hold, in values per channel.
+	* @param numChannels Number of audio channels to store.
+	* @param format How the memory holds its values. Only float32 loops can be overdubbed, since layering
+	* pass after pass onto rounded values would add up their rounding.
+	*/
+	void setStorage(void* data, void* preLoop, size_t capacity, int numChannels, SampleFormat format = SampleFormat::float32) {
+		if (ownsData) {
+			delete[] this->data;
+			delete[] this->preLoop;
+		}
+		this->data = static_cast<T*>(data);
+		this->preLoop = static_cast<T*>(preLoop);
+		this->capacity = capacity;
+		this->numChannels = numChannels;
+		this->format = format;
+		valueBytes = SampleConversion::bytesPerValue(format);
+		size = 0;
+		ownsData = false;
+		silent = true;
+	}
+
+	/*
+	* Change the length of a loop that uses setStorage. Doesn't allocate or touch the audio, which is
+	* meaningless at the new length anyway: the loop plays silence until a new take is swapped in.
+	* Safe on the audio thread.
+	* @param samplesPerBeat Number of samples per beat.
+	* @param beatsPerLoop Number of beats per loop.
+	* @return False if the storage is too small for that length, leaving the loop unchanged.
+	*/
+	bool resize(double samplesPerBeat, int beatsPerLoop) {
+		assert(!ownsData);
+		size_t length = ceil(samplesPerBeat * beatsPerLoop);
+		if (length > capacity) return false;
+
+		this->samplesPerBeat = samplesPerBeat;
+		this->beatsPerLoop = beatsPerLoop;
+		size = length;
+		silent = true;
+		return true;
 	}
 
 	/*
 	* Copies the end of the the loop into the pre loop buffer for crossfade purposes.
+	* The longest possible fade is kept so the fade length can change later.
+	* @param end Length of the pass that just finished, where the lead-in ends.
 	*/
-	void copyPreLoop() {
-		auto fadeStart = size - FADE_SAMPLES;
-		std::memcpy(preLoop, data + fadeStart, sizeof(T) * FADE_SAMPLES);
+	void copyPreLoop(size_t end) {
+		size_t count = std::min(end, (size_t)MAX_FADE_SAMPLES);
+		for (int channel = 0; channel < numChannels; channel++) {
+			uint8_t* pre = valueAt(preLoop, channel * MAX_FADE_SAMPLES + MAX_FADE_SAMPLES - count);
+			std::memcpy(pre, valueAt(data, channel * size + end - count), valueBytes * count);
+		}
 	}
 
-	size_t getLoopSample(size_t currentSample, int bufferSize) const {
-		double currentBeat = ((double)currentSample) / samplesPerBeat;
-		double loopsFromStart = floor(currentBeat / beatsPerLoop);
-		size_t loopStartInSamples = floor(loopsFromStart * beatsPerLoop * samplesPerBeat);
-		return currentSample - loopStartInSamples;	// time within loop in sample units. 
-													// If currentSample is at the start of the loop, this value will be 0.
+protected:
+	/*
+	* Copy the given elements to one channel of the loop.
+	* @param channel Channel to copy into.
+	* @param elements Elements to copy.
+	* @param index Location within the loop to copy to.
+	* @param count Number of values to copy.
+	*/
+	void copyAll(int channel, const T* elements, size_t index, size_t count) {
+		assert(index + count <= getSize());
+		assert(index >= 0);
+
+		write(channel, index, count, elements);
 	}
 
 	void swapData(Loop<T>& other) {
 		assert(size == other.size);
+		assert(numChannels == other.numChannels);
+		assert(capacity == other.capacity);
+		assert(format == other.format);
 		std::swap(data, other.data);
 		std::swap(preLoop, other.preLoop);
+		other.silent = false;	// a finished take has been written end to end
 	}
 
 private:
 	T* data;
 	T* preLoop;
 	size_t size;
+	size_t capacity;
+	int numChannels;
 	double samplesPerBeat;
 	int beatsPerLoop;
+	bool ownsData;
+	bool silent;
+	SampleFormat format;
+	size_t valueBytes;
+	std::atomic<const FadeTable*> fade;
+
+	// values converted at a time where a kernel needs floats, small enough for the stack
+	static constexpr size_t decodeChunk = 256;
+
+	// The stored value at an index, counting from base in values of the loop's format.
+	uint8_t* valueAt(T* base, size_t index) const {
+		return reinterpret_cast<uint8_t*>(base) + index * valueBytes;
+	}
+
+	template<bool Metered>
+	void mixInto(T* const* dest, LoopPosition position, int bufferSize, T startGain, T endGain, MixKernel::Levels* levels) const {
+		Segments segments = getSegments(position, bufferSize);
+		T gainStep = (endGain - startGain) / bufferSize;
+
+		for (int channel = 0; channel < numChannels; channel++) {
+			const T* first = segments.first(channel);
+			T* out = dest[channel];
+
+			if constexpr (Metered) {
+				MixKernel::addWithRamp(out, first, segments.plainCount(), startGain, gainStep, *levels);
+				MixKernel::addCrossfadeWithRamp(
+					out + segments.fadeOffset, first + segments.plainCount(), segments.preLoop(channel),
+					segments.fadeOut, segments.fadeIn, segments.fadeCount,
+					startGain + segments.fadeOffset * gainStep, gainStep, *levels
+				);
+				MixKernel::addWithRamp(
+					out + segments.firstCount, segments.second(channel), segments.secondCount,
+					startGain + segments.firstCount * gainStep, gainStep, *levels
+				);
+			} else {
+				MixKernel::addWithRamp(out, first, segments.plainCount(), startGain, gainStep);
+				MixKernel::addCrossfadeWithRamp(
+					out + segments.fadeOffset, first + segments.plainCount(), segments.preLoop(channel),
+					segments.fadeOut, segments.fadeIn, segments.fadeCount,
+					startGain + segments.fadeOffset * gainStep, gainStep
+				);
+				MixKernel::addWithRamp(
+					out + segments.firstCount, segments.second(channel), segments.secondCount,
+					startGain + segments.firstCount * gainStep, gainStep
+				);
+			}
+		}
+	}
 
 	/*
-	* Copy a region of the loop into the given destination.
-	* @param dest Pointer to copy into.
-	* @param index Location within the loop to copy from.
-	* @param count Number of values to copy.
+	* mixInto for loops kept in a smaller format. The plain spans convert and add in one pass; the crossfade,
+	* and metering, which wants the values before gain, decode a piece at a time and use the float kernels.
 	*/
-	void readAll(T* dest, size_t index, size_t count) const {
-		assert(index + count <= size);
-		assert(index >= 0);
+	template<bool Metered>
+	void mixDecoded(T* const* dest, LoopPosition position, int bufferSize, T startGain, T endGain, MixKernel::Levels* levels) const {
+		Segments segments = getSegments(position, bufferSize);
+		T gainStep = (endGain - startGain) / bufferSize;
+		T values[decodeChunk];
+		T lead[decodeChunk];
 
-		std::memcpy(dest, data + index, sizeof(T) * count);
+		for (int channel = 0; channel < numChannels; channel++) {
+			T* out = dest[channel];
+			const uint8_t* stored = valueAt(data, channel * size);
+			const uint8_t* storedLead = valueAt(preLoop, channel * MAX_FADE_SAMPLES + segments.preLoopOffset);
+
+			auto addPlain = [&](size_t offset, size_t from, size_t count) {
+				if constexpr (Metered) {
+					for (size_t done = 0; done < count; done += decodeChunk) {
+						size_t n = std::min(decodeChunk, count - done);
+						SampleConversion::decode(format, stored + (from + done) * valueBytes, values, n);
+						MixKernel::addWithRamp(out + offset + done, values, n, startGain + (offset + done) * gainStep, gainStep, *levels);
+					}
+				} else {
+					SampleConversion::decodeAdd(format, stored + from * valueBytes, out + offset, count, startGain + offset * gainStep, gainStep);
+				}
+			};
+
+			addPlain(0, segments.start, segments.plainCount());
+			for (size_t done = 0; done < segments.fadeCount; done += decodeChunk) {
+				size_t n = std::min(decodeChunk, segments.fadeCount - done);
+				size_t offset = segments.fadeOffset + done;
+				SampleConversion::decode(format, stored + (segments.start + segments.plainCount() + done) * valueBytes, values, n);
+				SampleConversion::decode(format, storedLead + done * valueBytes, lead, n);
+				if constexpr (Metered) {
+					MixKernel::addCrossfadeWithRamp(out + offset, values, lead, segments.fadeOut + done, segments.fadeIn + done, n,
+						startGain + offset * gainStep, gainStep, *levels);
+				} else {
+					MixKernel::addCrossfadeWithRamp(out + offset, values, lead, segments.fadeOut + done, segments.fadeIn + done, n,
+						startGain + offset * gainStep, gainStep);
+				}
+			}
+			addPlain(segments.firstCount, 0, segments.secondCount);
+		}
 	}
 
 };
\ No newline at end of file
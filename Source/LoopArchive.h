@@ -0,0 +1,472 @@
+#pragma once
+
+#include "Loop.h"
+#include "LoopReaders.h"
+#include "ParallelFor.h"
+#include "Constants.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* Keeps the loop audio ready to go into the plugin state, and puts it back when a state is loaded.
+*
+* A host's save call shouldn't sit through encoding minutes of audio, so a background thread keeps an
+* encoded copy of every loop instead: once a take is committed it copies the loop out through LoopReaders,
+* encodes the copy and swaps it in. getSnapshot only joins the copies that are there, so a take committed
+* moments before a save may not be in it yet, as if it had landed just after.
+*
+* The codec is lossless. Each channel and each channel's lead-in is a stream of runs of audio between
+* stretches of exact zeros, which cost nothing, so silent loops and silent parts of loops take no space.
+* Within a run every value is predicted from the two before it, using the float's bits as an ordered
+* integer, and only the significant bytes of the miss are stored, with a 4 bit count per value. Numbers are
+* stored in the machine's byte order, which is little endian on everything the plugin builds for.
+*
+* Loading decodes every stream straight into the loops' own memory, spread over the cores.
+*/
+class LoopArchive {
+public:
+	/*
+	* @param readers Guards reading loops against them being resized.
+	* @param loops The instance's maxLoops loops, only read through readers.
+	*/
+	LoopArchive(LoopReaders& readers, const Loop<float>* loops) : readers(readers), source(loops) {
+		for (int i = 0; i < maxLoops; i++) {
+			commits[i].store(0, std::memory_order_relaxed);
+			encoded[i] = { 1 };	// silent
+		}
+		worker = std::thread([this] { run(); });
+	}
+
+	~LoopArchive() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+		}
+		wake.notify_one();
+		worker.join();
+	}
+
+	// Audio thread: a loop's audio changed, e.g. a take was committed or the loop was emptied.
+	void takeCommitted(int loopIndex) {
+		commits[loopIndex].fetch_add(1, std::memory_order_release);
+	}
+
+	// How many of the loops to keep. Message thread.
+	void setLoopCount(int count) {
+		loopCount.store(count, std::memory_order_relaxed);
+	}
+
+	// Any thread but the audio thread: the newest encoded copy of every loop, ready to save. Never encodes.
+	std::vector<uint8_t> getSnapshot() const {
+		std::lock_guard<std::mutex> guard(snapshotLock);
+		uint32_t count = (uint32_t)loopCount.load(std::memory_order_relaxed);
+		std::vector<uint8_t> out;
+		put(out, archiveMagic);
+		put(out, archiveVersion);
+		put(out, count);
+		for (uint32_t i = 0; i < count; i++) {
+			out.insert(out.end(), encoded[i].begin(), encoded[i].end());
+		}
+		return out;
+	}
+
+	/*
+	* Decode a snapshot into the loops' memory. Nothing else may touch the loops meanwhile: keep the audio
+	* thread out, and background readers off with LoopReaders::beginResize.
+	* Every one of the first loopCount loops is resized to the saved tempo. Loops that were saved silent, or
+	* don't match the current layout (channels, beats), stay silent.
+	* @param beatsPerLoop Length of the loops now, in beats.
+	* @return The samples per beat the loops were saved at, or 0 if there was nothing to restore, in which
+	* case the loops are left as they were.
+	*/
+	static double restore(const uint8_t* data, size_t bytes, Loop<float>* loops, int loopCount, int beatsPerLoop) {
+		Reader in { data, data + bytes };
+		uint32_t magic, version, count;
+		if (!in.get(magic) || magic != archiveMagic || !in.get(version) || version != archiveVersion || !in.get(count)) return 0;
+
+		std::vector<Entry> saved(std::min(count, (uint32_t)loopCount));
+		for (Entry& loop : saved) {
+			if (!parse(in, loop)) return 0;
+		}
+
+		// every loop plays at one tempo, so take it from the first that has audio
+		double samplesPerBeat = 0;
+		for (const Entry& loop : saved) {
+			if (loop.numChannels > 0 && (int)loop.beatsPerLoop == beatsPerLoop) {
+				samplesPerBeat = loop.samplesPerBeat;
+				break;
+			}
+		}
+		// the loops share one slab, so if the first fits they all do
+		if (samplesPerBeat <= 0 || !loops[0].resize(samplesPerBeat, beatsPerLoop)) return 0;
+
+		struct Job {
+			int loop;
+			int stream;
+		};
+		std::vector<Job> jobs;
+		for (int i = 0; i < loopCount; i++) {
+			loops[i].resize(samplesPerBeat, beatsPerLoop);
+			if (i >= (int)saved.size()) continue;
+			const Entry& loop = saved[i];
+			if (loop.numChannels != loops[i].getNumChannels() || (int)loop.beatsPerLoop != beatsPerLoop
+				|| loop.samplesPerBeat != samplesPerBeat || loop.size != loops[i].getSize()) continue;
+			for (int stream = 0; stream < 2 * loop.numChannels; stream++) {
+				jobs.push_back({ i, stream });
+			}
+		}
+
+		std::vector<char> decoded(jobs.size(), 0);
+		parallelFor((int)jobs.size(), [&](int j) {
+			Loop<float>& loop = loops[jobs[j].loop];
+			int channels = loop.getNumChannels();
+			int stream = jobs[j].stream;
+			Reader reader = saved[jobs[j].loop].streams[stream];
+			size_t count = stream < channels ? loop.getSize() : MAX_FADE_SAMPLES;
+			std::vector<float> values(count);
+			decoded[j] = decodeStream(reader, values.data(), count);
+			if (!decoded[j]) return;
+			if (stream < channels) {
+				loop.write(stream, 0, count, values.data());
+			} else {
+				loop.writePreLoop(stream - channels, 0, count, values.data());
+			}
+		});
+
+		// a loop with a stream that didn't decode stays silent
+		std::vector<char> complete(loopCount, 1);
+		for (size_t j = 0; j < jobs.size(); j++) {
+			if (!decoded[j]) complete[jobs[j].loop] = 0;
+		}
+		for (size_t j = 0; j < jobs.size(); j++) {
+			if (jobs[j].stream == 0 && complete[jobs[j].loop]) loops[jobs[j].loop].setSilent(false);
+		}
+		return samplesPerBeat;
+	}
+
+	// A loop decoded from its newest encoded copy, with its channels one after the other.
+	struct Copy {
+		int numChannels = 0;
+		double samplesPerBeat = 0;
+		size_t size = 0;
+		std::vector<float> data;
+
+		const float* getChannel(int channel) const {
+			return data.data() + channel * size;
+		}
+	};
+
+	/*
+	* Any thread but the audio thread: decode the newest copies of some loops, as of one moment. Never
+	* touches the loops themselves.
+	* @param copies Gets one entry per loop, with no channels for a silent loop.
+	*/
+	void getLoops(int first, int count, std::vector<Copy>& copies) const {
+		std::vector<std::vector<uint8_t>> entries(count);
+		{
+			std::lock_guard<std::mutex> guard(snapshotLock);
+			for (int i = 0; i < count; i++) entries[i] = encoded[first + i];
+		}
+
+		copies.assign(count, {});
+		for (int i = 0; i < count; i++) {
+			Reader in { entries[i].data(), entries[i].data() + entries[i].size() };
+			Entry entry;
+			if (!parse(in, entry) || entry.numChannels == 0) continue;
+
+			Copy& copy = copies[i];
+			copy.size = (size_t)entry.size;
+			copy.data.resize(copy.size * entry.numChannels);
+			bool decoded = true;
+			for (int channel = 0; channel < entry.numChannels; channel++) {
+				decoded = decoded && decodeStream(entry.streams[channel], copy.data.data() + channel * copy.size, copy.size);
+			}
+			if (!decoded) {
+				copy = {};
+				continue;
+			}
+			copy.numChannels = entry.numChannels;
+			copy.samplesPerBeat = entry.samplesPerBeat;
+		}
+	}
+
+	// Any thread: whether every take committed so far is in the encoded copies.
+	bool isUpToDate() const {
+		int count = loopCount.load(std::memory_order_relaxed);
+		for (int i = 0; i < count; i++) {
+			if (commits[i].load(std::memory_order_acquire) != encodedCommits[i].load(std::memory_order_acquire)) return false;
+		}
+		return true;
+	}
+
+	// Bounds-checked reading from encoded data.
+	struct Reader {
+		const uint8_t* at;
+		const uint8_t* end;
+
+		template<typename T>
+		bool get(T& value) {
+			if ((size_t)(end - at) < sizeof(T)) return false;
+			std::memcpy(&value, at, sizeof(T));
+			at += sizeof(T);
+			return true;
+		}
+
+		bool getVarint(uint64_t& value) {
+			value = 0;
+			for (int shift = 0; shift < 64 && at < end; shift += 7) {
+				uint8_t byte = *at++;
+				value |= (uint64_t)(byte & 0x7f) << shift;
+				if ((byte & 0x80) == 0) return true;
+			}
+			return false;
+		}
+	};
+
+	// Append count values to out as one stream.
+	static void encodeStream(const float* values, size_t count, std::vector<uint8_t>& out) {
+		size_t index = 0;
+		while (index < count) {
+			size_t start = index;
+			while (start < count && bitsOf(values[start]) == 0) start++;
+			if (start == count) break;	// zeros at the end are implied
+
+			// a run goes on until minGap zeros in a row
+			size_t end = start + 1;
+			size_t zeros = 0;
+			while (end < count) {
+				zeros = bitsOf(values[end]) == 0 ? zeros + 1 : 0;
+				end++;
+				if (zeros == minGap) {
+					end -= minGap;
+					break;
+				}
+			}
+
+			putVarint(out, start - index);
+			putVarint(out, end - start);
+			encodeRun(values + start, end - start, out);
+			index = end;
+		}
+	}
+
+	/*
+	* Decode a stream into count values.
+	* @return False if the stream is malformed or holds more than count values.
+	*/
+	static bool decodeStream(Reader in, float* values, size_t count) {
+		size_t index = 0;
+		while (in.at < in.end) {
+			uint64_t gap, length;
+			if (!in.getVarint(gap) || !in.getVarint(length) || length == 0) return false;
+			if (gap > count - index || length > count - index - gap) return false;
+			std::fill_n(values + index, gap, 0.f);
+			index += gap;
+			if (!decodeRun(in, values + index, length)) return false;
+			index += length;
+		}
+		std::fill_n(values + index, count - index, 0.f);
+		return true;
+	}
+
+private:
+	static constexpr uint32_t archiveMagic = 0x5241504c;	// "LPAR"
+	static constexpr uint32_t archiveVersion = 1;
+	static constexpr size_t minGap = 16;	// shorter stretches of zeros cost less left in the run
+
+	// One loop's part of a snapshot, parsed.
+	struct Entry {
+		int numChannels = 0;	// 0 for a silent loop
+		uint32_t beatsPerLoop = 0;
+		double samplesPerBeat = 0;
+		uint64_t size = 0;
+		Reader streams[2 * maxChannels];	// the channels, then their lead-ins
+	};
+
+	static bool parse(Reader& in, Entry& entry) {
+		uint8_t silent;
+		if (!in.get(silent)) return false;
+		if (silent) return true;
+
+		uint32_t numChannels;
+		if (!in.get(numChannels) || numChannels == 0 || numChannels > maxChannels || !in.get(entry.beatsPerLoop)
+			|| !in.get(entry.samplesPerBeat) || !in.get(entry.size)) return false;
+		entry.numChannels = (int)numChannels;
+		for (int stream = 0; stream < 2 * entry.numChannels; stream++) {
+			uint64_t length;
+			if (!in.get(length) || length > (uint64_t)(in.end - in.at)) return false;
+			entry.streams[stream] = { in.at, in.at + length };
+			in.at += length;
+		}
+		return true;
+	}
+
+	static uint32_t bitsOf(float value) {
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	// The float's bits as an integer that orders like the float does. Its own inverse.
+	static int32_t ordered(uint32_t bits) {
+		int32_t value = (int32_t)bits;
+		return value < 0 ? value ^ 0x7fffffff : value;
+	}
+
+	static void encodeRun(const float* values, size_t count, std::vector<uint8_t>& out) {
+		int64_t previous = 0;
+		int64_t before = 0;
+		for (size_t i = 0; i < count; i += 2) {
+			size_t control = out.size();
+			out.push_back(0);
+			for (size_t j = i; j < std::min(count, i + 2); j++) {
+				int64_t value = ordered(bitsOf(values[j]));
+				int64_t miss = value - (2 * previous - before);
+				uint64_t zigzag = ((uint64_t)miss << 1) ^ (uint64_t)(miss >> 63);
+
+				int bytes = 0;
+				while (bytes < 8 && (zigzag >> (8 * bytes)) != 0) bytes++;
+				out[control] |= (uint8_t)(bytes << (4 * (j - i)));
+				for (int b = 0; b < bytes; b++) out.push_back((uint8_t)(zigzag >> (8 * b)));
+
+				before = previous;
+				previous = value;
+			}
+		}
+	}
+
+	static bool decodeRun(Reader& in, float* values, size_t count) {
+		int64_t previous = 0;
+		int64_t before = 0;
+		for (size_t i = 0; i < count; i += 2) {
+			uint8_t control;
+			if (!in.get(control)) return false;
+			for (size_t j = i; j < std::min(count, i + 2); j++) {
+				int bytes = (control >> (4 * (j - i))) & 0xf;
+				if (bytes > 8 || (size_t)(in.end - in.at) < (size_t)bytes) return false;
+				uint64_t zigzag = 0;
+				for (int b = 0; b < bytes; b++) zigzag |= (uint64_t)*in.at++ << (8 * b);
+				int64_t miss = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+
+				// wraps rather than overflows on a corrupt stream; a valid one always lands on a 32 bit value
+				int64_t value = (int64_t)((uint64_t)miss + 2 * (uint64_t)previous - (uint64_t)before);
+				uint32_t bits = (uint32_t)ordered((uint32_t)value);
+				std::memcpy(values + j, &bits, sizeof(bits));
+
+				before = previous;
+				previous = value;
+			}
+		}
+		return true;
+	}
+
+	template<typename T>
+	static void put(std::vector<uint8_t>& out, T value) {
+		uint8_t bytes[sizeof(T)];
+		std::memcpy(bytes, &value, sizeof(T));
+		out.insert(out.end(), bytes, bytes + sizeof(T));
+	}
+
+	static void putVarint(std::vector<uint8_t>& out, uint64_t value) {
+		while (value >= 0x80) {
+			out.push_back((uint8_t)(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back((uint8_t)value);
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (running) {
+			wake.wait_for(guard, std::chrono::milliseconds(20));
+			if (!running) break;
+
+			int count = loopCount.load(std::memory_order_relaxed);
+			for (int i = 0; i < count; i++) {
+				uint32_t commit = commits[i].load(std::memory_order_acquire);
+				if (commit != encodedCommits[i].load(std::memory_order_relaxed) && encode(i, commit)) {
+					encodedCommits[i].store(commit, std::memory_order_release);
+				}
+			}
+		}
+	}
+
+	// Copy one loop out and encode it. Gives up if the loop changes underneath, the next tick retries.
+	bool encode(int loopIndex, uint32_t commit) {
+		const Loop<float>& loop = source[loopIndex];
+		bool silent = true;
+		int numChannels = 0;
+		int beatsPerLoop = 0;
+		double samplesPerBeat = 0;
+		size_t size = 0;
+
+		bool read = readers.read([&] {
+			silent = loop.isSilent() || loop.getSize() == 0;
+			if (silent) return;
+			numChannels = loop.getNumChannels();
+			beatsPerLoop = loop.getBeatsPerLoop();
+			samplesPerBeat = loop.getSamplesPerBeat();
+			size = loop.getSize();
+
+			copy.resize((size + MAX_FADE_SAMPLES) * numChannels);
+			for (int channel = 0; channel < numChannels; channel++) {
+				loop.read(channel, 0, size, copy.data() + channel * size);
+				loop.readPreLoop(channel, 0, MAX_FADE_SAMPLES, copy.data() + size * numChannels + channel * MAX_FADE_SAMPLES);
+			}
+		});
+
+		// another take landed while we were copying, so this copy may be torn
+		if (!read || commits[loopIndex].load(std::memory_order_acquire) != commit) return false;
+
+		std::vector<uint8_t> entry;
+		entry.push_back(silent ? 1 : 0);
+		if (!silent) {
+			put(entry, (uint32_t)numChannels);
+			put(entry, (uint32_t)beatsPerLoop);
+			put(entry, samplesPerBeat);
+			put(entry, (uint64_t)size);
+			for (int stream = 0; stream < 2 * numChannels; stream++) {
+				bool lead = stream >= numChannels;
+				const float* values = lead
+					? copy.data() + size * numChannels + (stream - numChannels) * MAX_FADE_SAMPLES
+					: copy.data() + stream * size;
+
+				// the stream's length goes in front of it once it's known
+				size_t lengthAt = entry.size();
+				put(entry, (uint64_t)0);
+				encodeStream(values, lead ? MAX_FADE_SAMPLES : size, entry);
+				uint64_t length = entry.size() - lengthAt - sizeof(uint64_t);
+				std::memcpy(entry.data() + lengthAt, &length, sizeof(length));
+			}
+		}
+
+		std::lock_guard<std::mutex> guard(snapshotLock);
+		encoded[loopIndex].swap(entry);
+		return true;
+	}
+
+	LoopReaders& readers;
+	const Loop<float>* const source;
+	std::atomic<int> loopCount { defaultLoopCount };
+	std::atomic<uint32_t> commits[maxLoops];
+
+	std::atomic<uint32_t> encodedCommits[maxLoops] = {};	// written by the background thread only
+
+	// background thread only
+	std::vector<float> copy;
+
+	mutable std::mutex snapshotLock;
+	std::vector<uint8_t> encoded[maxLoops];		// each loop's part of a snapshot, guarded by snapshotLock
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread worker;
+	bool running = true;
+};
\ No newline at end of file
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "LoopArchive.h"
+#include "Constants.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* Writes loops out to audio files on a thread of its own. The audio comes from LoopArchive's encoded copies,
+* which only ever hold whole committed takes, so the audio thread never copies a loop for an export and an
+* export never sees half a take. An export waits for the archive to catch up with the takes committed when
+* it was asked for, so the loops come out as they were at the end of the last pass.
+*/
+class LoopExporter {
+public:
+	enum class Mode {
+		loops,	// each loop in a file of its own, as recorded
+		stems,	// each loop in a file of its own, at its volume
+		mix		// the loops mixed down at their volumes into one file
+	};
+
+	enum class Format {
+		wav,	// 32 bit float
+		flac	// 24 bit
+	};
+
+	struct Request {
+		juce::File destination;	// the file for a mix or one loop, otherwise a folder to write Loop 1 and on into
+		int loopIndex = -1;		// -1 for every loop
+		int loopCount = 0;
+		Mode mode = Mode::loops;
+		Format format = Format::wav;
+		double sampleRate = 44100;
+		float gains[maxLoops];
+	};
+
+	LoopExporter(const LoopArchive& archive) : archive(archive) {
+		worker = std::thread([this] { run(); });
+	}
+
+	~LoopExporter() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+		}
+		wake.notify_one();
+		worker.join();
+	}
+
+	// Queue an export. Message thread.
+	void request(const Request& request) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			queue.push_back(request);
+			busy.store(true, std::memory_order_relaxed);
+		}
+		wake.notify_one();
+	}
+
+	// Whether an export is queued or being written.
+	bool isBusy() const {
+		return busy.load(std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr int archiveWaitMs = 2000;	// longest to wait for the archive before using what it has
+	static constexpr int blockSize = 1 << 16;	// values per channel handed to a writer at once
+
+	void run() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (running) {
+			if (queue.empty()) {
+				busy.store(false, std::memory_order_relaxed);
+				wake.wait(guard);
+				continue;
+			}
+			Request next = queue.front();
+			queue.pop_front();
+
+			guard.unlock();
+			write(next);
+			guard.lock();
+		}
+	}
+
+	void write(const Request& request) {
+		for (int waited = 0; !archive.isUpToDate() && waited < archiveWaitMs; waited += 10) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		int first = request.loopIndex == -1 ? 0 : request.loopIndex;
+		int count = request.loopIndex == -1 ? request.loopCount : 1;
+		std::vector<LoopArchive::Copy> copies;
+		archive.getLoops(first, count, copies);
+
+		if (request.mode == Mode::mix) {
+			LoopArchive::Copy mix = mixDown(copies, request.gains + first);
+			if (mix.numChannels > 0) writeFile(request.destination, mix, request);
+			return;
+		}
+
+		bool single = request.loopIndex != -1;
+		if (!single) request.destination.createDirectory();
+		for (int i = 0; i < count; i++) {
+			LoopArchive::Copy& copy = copies[i];
+			if (copy.numChannels == 0) continue;	// nothing recorded
+			if (request.mode == Mode::stems) {
+				for (float& value : copy.data) value *= request.gains[first + i];
+			}
+			juce::File file = single ? request.destination
+				: request.destination.getChildFile("Loop " + juce::String(first + i + 1) + extension(request.format));
+			writeFile(file, copy, request);
+		}
+	}
+
+	// Sum the loops at their gains, repeating shorter ones (still at an old tempo) to the longest.
+	static LoopArchive::Copy mixDown(const std::vector<LoopArchive::Copy>& copies, const float* gains) {
+		LoopArchive::Copy mix;
+		for (const auto& copy : copies) {
+			mix.numChannels = std::max(mix.numChannels, copy.numChannels);
+			mix.size = std::max(mix.size, copy.size);
+		}
+		mix.data.assign(mix.size * mix.numChannels, 0.f);
+
+		for (size_t i = 0; i < copies.size(); i++) {
+			const auto& copy = copies[i];
+			for (int channel = 0; channel < copy.numChannels; channel++) {
+				float* out = mix.data.data() + channel * mix.size;
+				for (size_t at = 0; at < mix.size; at += copy.size) {
+					size_t count = std::min(copy.size, mix.size - at);
+					juce::FloatVectorOperations::addWithMultiply(out + at, copy.getChannel(channel), gains[i], (int)count);
+				}
+			}
+		}
+		return mix;
+	}
+
+	static juce::String extension(Format format) {
+		return format == Format::flac ? ".flac" : ".wav";
+	}
+
+	static bool writeFile(const juce::File& file, const LoopArchive::Copy& copy, const Request& request) {
+		std::unique_ptr<juce::AudioFormat> format;
+		int bits = 32;
+		if (request.format == Format::flac) {
+			format = std::make_unique<juce::FlacAudioFormat>();
+			bits = 24;
+		} else {
+			format = std::make_unique<juce::WavAudioFormat>();
+		}
+
+		// a file output stream appends, so start from nothing
+		file.deleteFile();
+		std::unique_ptr<juce::OutputStream> stream = file.createOutputStream();
+		if (stream == nullptr) return false;
+		std::unique_ptr<juce::AudioFormatWriter> writer(
+			format->createWriterFor(stream.get(), request.sampleRate, (unsigned int)copy.numChannels, bits, {}, 0));
+		if (writer == nullptr) return false;
+		stream.release();	// the writer owns it now
+
+		const float* channels[maxChannels];
+		for (size_t at = 0; at < copy.size; at += blockSize) {
+			for (int channel = 0; channel < copy.numChannels; channel++) {
+				channels[channel] = copy.getChannel(channel) + at;
+			}
+			int count = (int)std::min<size_t>(blockSize, copy.size - at);
+			if (!writer->writeFromFloatArrays(channels, copy.numChannels, count)) return false;
+		}
+		return true;
+	}
+
+	const LoopArchive& archive;
+	std::atomic<bool> busy { false };
+
+	std::deque<Request> queue;	// guarded by lock
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread worker;
+	bool running = true;
+};
\ No newline at end of file
@@ -0,0 +1,465 @@
+#pragma once
+
+#include "CopyLoop.h"
+#include "SampleFormat.h"
+#include "Constants.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* Undo and redo for takes and overdub passes, kept a page at a time.
+*
+* A loop is split into pages of pageSize values per channel, with its lead-in counted as a few more pages.
+* Every take and every overdub pass is a step, and the first time a step is about to write over a page the
+* page is copied aside (copy on write), so a step only costs the pages it changed. Undoing a step swaps those
+* pages with the loop's, which leaves the step holding what it took out, ready to be redone. Loops stay in
+* one piece for playback; only the history is paged.
+*
+* A replaced take needs no copying at first: CopyLoop's swap leaves it in the copy loop, so undoing the
+* newest take just swaps it back. Its pages are copied aside as the next take records over the copy loop.
+*
+* Saved pages come from a pool set aside up front from a memory budget and are handed out in order, like a
+* ring, and the steps live in a ring of their own. A background thread evicts the oldest steps once either
+* runs low. The pool can keep pages in a smaller SampleFormat to fit more history into the same budget, in
+* which case undone and redone pages come back at that precision. Nothing on the audio thread allocates or
+* waits; if the pool does run out, the history before the current step is given up rather than left with a
+* gap.
+*
+* Steps only make sense for the loops they were recorded on, so anything that moves or resizes the loops
+* (a tempo change, new memory) must call clear.
+*/
+class LoopHistory {
+public:
+	static constexpr size_t pageSize = 4096;	// values per channel
+	static constexpr uint32_t maxSteps = 1024;
+	static_assert(MAX_FADE_SAMPLES % pageSize == 0, "the lead-in must be whole pages");
+
+	LoopHistory() {
+		worker = std::thread([this] { run(); });
+	}
+
+	~LoopHistory() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+		}
+		wake.notify_one();
+		worker.join();
+	}
+
+	/*
+	* Set aside the page pool and start an empty history. Allocates, so only call this while the audio thread
+	* isn't running, e.g. from prepareToPlay.
+	* @param budgetBytes Memory for saved pages. Too little for a single page turns the history off.
+	* @param numChannels Channels per loop.
+	* @param capacity Longest loop to keep history for, in values per channel.
+	* @param pageFormat How saved pages are stored. Anything smaller than float32 fits more history.
+	*/
+	void prepare(size_t budgetBytes, int numChannels, size_t capacity, SampleFormat pageFormat) {
+		std::lock_guard<std::mutex> guard(lock);
+		budget = budgetBytes;
+		channels = numChannels;
+		format = pageFormat;
+		channelBytes = pageSize * SampleConversion::bytesPerValue(format);
+		poolPages = budgetBytes / (channelBytes * numChannels);
+		pool.assign(poolPages * channelBytes * numChannels, 0);
+		swapped.assign(pageSize, 0.f);
+		staged.assign(pageSize, 0.f);
+		records.assign(poolPages, 0);
+		trackedPages = (capacity + pageSize - 1) / pageSize + MAX_FADE_SAMPLES / pageSize;
+		saved.assign((trackedPages + 63) / 64, 0);
+
+		head.store(0, std::memory_order_relaxed);
+		cursor.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+		floor.store(0, std::memory_order_relaxed);
+		recordHead.store(0, std::memory_order_relaxed);
+		recordTail.store(0, std::memory_order_relaxed);
+		open = false;
+	}
+
+	// The budget prepare was last called with.
+	size_t getBudget() const {
+		return budget;
+	}
+
+	// The page format prepare was last called with.
+	SampleFormat getFormat() const {
+		return format;
+	}
+
+	// Audio thread: give up every step, e.g. once the loops were moved or resized.
+	void clear() {
+		dropRedo();
+		floor.store(head.load(std::memory_order_relaxed), std::memory_order_release);
+		wake.notify_one();
+	}
+
+	// Audio thread: forget the steps that were undone, before something records over what they'd bring back.
+	void dropRedo() {
+		uint32_t c = cursor.load(std::memory_order_relaxed);
+		if (c == head.load(std::memory_order_relaxed)) return;
+		recordHead.store(steps[c % maxSteps].firstRecord, std::memory_order_relaxed);
+		head.store(c, std::memory_order_release);
+	}
+
+	// Audio thread: how many steps undo and redo could go through.
+	int getUndoSteps() const {
+		uint32_t oldest = std::max(floor.load(std::memory_order_relaxed), tail.load(std::memory_order_relaxed));
+		uint32_t c = cursor.load(std::memory_order_relaxed);
+		return c > oldest ? (int)(c - oldest) : 0;
+	}
+
+	int getRedoSteps() const {
+		uint32_t c = cursor.load(std::memory_order_relaxed);
+		if (c < floor.load(std::memory_order_relaxed)) return 0;
+		return (int)(head.load(std::memory_order_relaxed) - c);
+	}
+
+	// Audio thread: finish the overdub pass in progress, if any.
+	void endStep() {
+		if (!open) return;
+		steps[(head.load(std::memory_order_relaxed) - 1) % maxSteps].open = false;
+		open = false;
+	}
+
+	/*
+	* Audio thread: call before Overdub::writeBuffer with the same block. Saves the pages it's about to layer
+	* onto, and starts a new step wherever a pass begins.
+	* @param loops Every loop; loopIndex is the one being overdubbed.
+	*/
+	void beforeOverdub(Loop<float>* loops, int loopIndex, LoopPosition position, int count) {
+		Loop<float>& loop = loops[loopIndex];
+		if (!open) beginStep(loopIndex, loop.isSilent(), false);
+
+		size_t first = std::min(position.length - position.sample, (size_t)count);
+		saveLayer(loop, position.sample, position.sample + first, position.length);
+		if (position.sample + count < position.length) return;
+
+		// the pass ends in this block and the rest of it starts the next one
+		if (open) steps[(head.load(std::memory_order_relaxed) - 1) % maxSteps].silentAfter = loop.isSilent();
+		beginStep(loopIndex, loop.isSilent(), false);
+		saveLayer(loop, 0, count - first, position.length);
+	}
+
+	// Audio thread: call after Overdub::writeBuffer, to note whether the pass left the loop audible.
+	void afterOverdub(const Loop<float>& loop) {
+		if (open) steps[(head.load(std::memory_order_relaxed) - 1) % maxSteps].silentAfter = loop.isSilent();
+	}
+
+	/*
+	* Audio thread: call before CopyLoop::writeBuffer with the same block. Saves the pages of the take held
+	* in the copy loop that the block records over, and starts a step for the take the block commits, if any.
+	* @param loops Every loop; loopIndex is the one copy is recording for.
+	*/
+	void beforeCopy(Loop<float>* loops, int loopIndex, CopyLoop<float>& copy, LoopPosition position, int count) {
+		size_t first = std::min(position.length - position.sample, (size_t)count);
+		saveValues(inSlot(), copy, position.sample, position.sample + first);
+		if (position.sample + count < position.length) return;
+
+		if (copy.willCommit(position, count)) {
+			// the swap hands the copy loop the take being replaced, then the rest of the block records over
+			// its lead-in and start
+			Loop<float>& target = loops[loopIndex];
+			beginStep(loopIndex, target.isSilent(), true);
+			savePreLoop(inSlot(), target, 0, MAX_FADE_SAMPLES);
+			saveValues(inSlot(), target, 0, count - first);
+		} else {
+			savePreLoop(inSlot(), copy, 0, MAX_FADE_SAMPLES);
+			saveValues(inSlot(), copy, 0, count - first);
+		}
+	}
+
+	/*
+	* Audio thread: undo the newest step that's left, ideally at a loop boundary. Any recording must be
+	* stopped first.
+	* @param copy The copy loop, which may hold the take to swap back in.
+	* @return The loop that changed, or -1 if there was nothing to undo.
+	*/
+	int undo(Loop<float>* loops, CopyLoop<float>& copy) {
+		endStep();
+		uint32_t c = cursor.load(std::memory_order_relaxed);
+		if (c == 0 || c <= floor.load(std::memory_order_relaxed)) return -1;
+
+		// the background thread won't evict a step below cursor, and backs off if it sees this one going
+		uint32_t undone = c - 1;
+		cursor.store(undone, std::memory_order_seq_cst);
+		if (tail.load(std::memory_order_seq_cst) > undone) {
+			cursor.store(c, std::memory_order_relaxed);
+			return -1;
+		}
+
+		Step& step = steps[undone % maxSteps];
+		Loop<float>& loop = loops[step.loop];
+		if (step.inSlot) {
+			// put back what a later take recorded over, then swap the replaced take back in
+			for (uint64_t record = step.firstRecord; record != step.endRecord; record++) {
+				copyPage(record, copy, false);
+			}
+			recordHead.store(step.firstRecord, std::memory_order_relaxed);
+			step.endRecord = step.firstRecord;
+			std::fill(saved.begin(), saved.end(), 0);
+			copy.exchange(loop);
+		} else if (!step.wasSilent) {
+			swapPages(step, loop);
+		}
+		loop.setSilent(step.wasSilent);
+		return step.loop;
+	}
+
+	/*
+	* Audio thread: redo the last step undone, ideally at a loop boundary.
+	* @return The loop that changed, or -1 if there was nothing to redo.
+	*/
+	int redo(Loop<float>* loops, CopyLoop<float>& copy) {
+		endStep();
+		uint32_t c = cursor.load(std::memory_order_relaxed);
+		if (c == head.load(std::memory_order_relaxed) || c < floor.load(std::memory_order_relaxed)) return -1;
+
+		Step& step = steps[c % maxSteps];
+		Loop<float>& loop = loops[step.loop];
+		if (step.inSlot) {
+			copy.exchange(loop);
+		} else if (!step.wasSilent) {
+			swapPages(step, loop);
+		}
+		loop.setSilent(step.silentAfter);
+		cursor.store(c + 1, std::memory_order_seq_cst);
+		return step.loop;
+	}
+
+private:
+	struct Step {
+		uint64_t firstRecord;	// saved pages are records [firstRecord, endRecord)
+		uint64_t endRecord;
+		int loop;
+		bool wasSilent;		// the loop had no take before the step, so nothing needed saving
+		bool silentAfter;
+		bool inSlot;		// a replaced take, at least partly still in the copy loop
+		bool open;			// an overdub pass still recording
+	};
+
+	// Finish the open step and start another, which drops any that were undone.
+	void beginStep(int loop, bool wasSilent, bool inSlot) {
+		endStep();
+		dropRedo();
+
+		uint32_t h = head.load(std::memory_order_relaxed);
+		if (poolPages == 0 || h - tail.load(std::memory_order_acquire) >= maxSteps) {
+			// no room for the step, so the change can't be undone and neither can anything before it
+			clear();
+			return;
+		}
+
+		// the new take recorded over all of the copy loop, so the previous one is all in saved pages now
+		if (h > 0) steps[(h - 1) % maxSteps].inSlot = false;
+
+		uint64_t record = recordHead.load(std::memory_order_relaxed);
+		steps[h % maxSteps] = { record, record, loop, wasSilent, inSlot ? false : wasSilent, inSlot, !inSlot };
+		std::fill(saved.begin(), saved.end(), 0);
+		open = !inSlot;
+		head.store(h + 1, std::memory_order_release);
+		cursor.store(h + 1, std::memory_order_seq_cst);
+	}
+
+	// The newest step if it's an overdub pass still taking pages, else null.
+	Step* overdubbing() {
+		Step* step = newest();
+		return step != nullptr && step->open ? step : nullptr;
+	}
+
+	// The newest step if it's a replaced take still taking pages from the copy loop, else null.
+	Step* inSlot() {
+		Step* step = newest();
+		return step != nullptr && step->inSlot ? step : nullptr;
+	}
+
+	Step* newest() {
+		uint32_t h = head.load(std::memory_order_relaxed);
+		if (h == 0 || h <= floor.load(std::memory_order_relaxed) || cursor.load(std::memory_order_relaxed) != h) return nullptr;
+		Step* step = &steps[(h - 1) % maxSteps];
+		return step->wasSilent ? nullptr : step;
+	}
+
+	// Save what layering [from, to) of a pass length long writes over, including its part of the lead-in.
+	void saveLayer(Loop<float>& loop, size_t from, size_t to, size_t length) {
+		saveValues(overdubbing(), loop, from, to);
+
+		size_t tailStart = length - std::min(length, (size_t)MAX_FADE_SAMPLES);
+		size_t preFrom = std::max(from, tailStart);
+		if (preFrom < to) {
+			savePreLoop(overdubbing(), loop, MAX_FADE_SAMPLES - (length - preFrom), MAX_FADE_SAMPLES - (length - to));
+		}
+	}
+
+	void saveValues(Step* step, Loop<float>& memory, size_t from, size_t to) {
+		for (size_t page = from / pageSize; step != nullptr && page * pageSize < to; page++) {
+			if (!savePage(*step, memory, page)) return;
+		}
+	}
+
+	// Save the lead-in pages covering [from, to) of the pre loop buffer.
+	void savePreLoop(Step* step, Loop<float>& memory, size_t from, size_t to) {
+		size_t first = dataPages(memory);
+		for (size_t page = from / pageSize; step != nullptr && page * pageSize < to; page++) {
+			if (!savePage(*step, memory, first + page)) return;
+		}
+	}
+
+	bool savePage(Step& step, Loop<float>& memory, size_t page) {
+		if (page >= trackedPages) {
+			clear();	// only loops up to the capacity given to prepare are tracked
+			return false;
+		}
+		uint64_t bit = (uint64_t)1 << (page % 64);
+		if (saved[page / 64] & bit) return true;
+
+		uint64_t record = recordHead.load(std::memory_order_relaxed);
+		uint64_t used = record - recordTail.load(std::memory_order_acquire);
+		if (used >= poolPages) {
+			clear();
+			return false;
+		}
+
+		records[record % poolPages] = page;
+		copyPage(record, memory, true);
+		recordHead.store(record + 1, std::memory_order_relaxed);
+		step.endRecord = record + 1;
+		saved[page / 64] |= bit;
+
+		if (used + 1 > poolPages - poolPages / 4) wake.notify_one();
+		return true;
+	}
+
+	// Copy a saved page between the pool and memory, in either direction.
+	void copyPage(uint64_t record, Loop<float>& memory, bool toPool) {
+		uint8_t* page = pageAt(record);
+		Span span = locate(memory, records[record % poolPages]);
+		for (int channel = 0; channel < channels; channel++) {
+			if (toPool) {
+				readSpan(memory, channel, span, staged.data());
+				SampleConversion::encode(format, staged.data(), page + channel * channelBytes, span.count);
+			} else {
+				SampleConversion::decode(format, page + channel * channelBytes, staged.data(), span.count);
+				writeSpan(memory, channel, span, staged.data());
+			}
+		}
+	}
+
+	void swapPages(const Step& step, Loop<float>& loop) {
+		for (uint64_t record = step.firstRecord; record != step.endRecord; record++) {
+			uint8_t* page = pageAt(record);
+			Span span = locate(loop, records[record % poolPages]);
+			for (int channel = 0; channel < channels; channel++) {
+				uint8_t* stored = page + channel * channelBytes;
+				SampleConversion::decode(format, stored, swapped.data(), span.count);
+				readSpan(loop, channel, span, staged.data());
+				SampleConversion::encode(format, staged.data(), stored, span.count);
+				writeSpan(loop, channel, span, swapped.data());
+			}
+		}
+	}
+
+	uint8_t* pageAt(uint64_t record) {
+		return pool.data() + (record % poolPages) * channelBytes * channels;
+	}
+
+	static size_t dataPages(const Loop<float>& loop) {
+		return (loop.getSize() + pageSize - 1) / pageSize;
+	}
+
+	// Where a page lives in each channel, as values of the loop or of its pre loop buffer.
+	struct Span {
+		bool preLoop;
+		size_t index;
+		size_t count;
+	};
+
+	// The loop's pages come first, then the lead-in's.
+	static Span locate(const Loop<float>& loop, size_t page) {
+		size_t first = dataPages(loop);
+		if (page < first) return { false, page * pageSize, std::min(pageSize, loop.getSize() - page * pageSize) };
+		return { true, (page - first) * pageSize, pageSize };
+	}
+
+	// Loops can keep their values in a smaller format, so pages go through floats on their way in and out.
+	static void readSpan(const Loop<float>& loop, int channel, const Span& span, float* dest) {
+		if (span.preLoop) {
+			loop.readPreLoop(channel, span.index, span.count, dest);
+		} else {
+			loop.read(channel, span.index, span.count, dest);
+		}
+	}
+
+	static void writeSpan(Loop<float>& loop, int channel, const Span& span, const float* src) {
+		if (span.preLoop) {
+			loop.writePreLoop(channel, span.index, span.count, src);
+		} else {
+			loop.write(channel, span.index, span.count, src);
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (running) {
+			wake.wait_for(guard, std::chrono::milliseconds(20));
+			if (!running) break;
+			evict();
+		}
+	}
+
+	// Drop the oldest steps while they're below the floor or the pool or step ring is more than 3/4 full.
+	void evict() {
+		for (;;) {
+			uint32_t t = tail.load(std::memory_order_relaxed);
+			uint32_t h = head.load(std::memory_order_acquire);
+			if (t + 1 >= h) return;		// the newest step may still be taking pages
+
+			uint64_t used = recordHead.load(std::memory_order_relaxed) - recordTail.load(std::memory_order_relaxed);
+			bool stale = t < floor.load(std::memory_order_acquire);
+			bool crowded = used > poolPages - poolPages / 4 || h - t > maxSteps - maxSteps / 4;
+			if (!stale && !crowded) return;
+
+			// read before the step is let go, after which the audio thread may reuse its slot
+			uint64_t end = steps[t % maxSteps].endRecord;
+			tail.store(t + 1, std::memory_order_seq_cst);
+			if (cursor.load(std::memory_order_seq_cst) <= t) {
+				tail.store(t, std::memory_order_relaxed);	// it's being undone
+				return;
+			}
+			recordTail.store(end, std::memory_order_release);
+		}
+	}
+
+	size_t budget = 0;
+	int channels = 0;
+	size_t poolPages = 0;
+	size_t trackedPages = 0;
+	SampleFormat format = SampleFormat::float32;
+	size_t channelBytes = 0;			// one channel of a saved page
+	std::vector<uint8_t> pool;
+	std::vector<float> swapped;		// a page on its way out of the pool while another goes in
+	std::vector<float> staged;		// a page of the loop on its way into the pool
+	std::vector<size_t> records;		// which page of its loop each saved page is
+	std::vector<uint64_t> saved;		// pages the newest step has saved already, one bit each
+
+	Step steps[maxSteps];
+	std::atomic<uint32_t> head { 0 };	// one past the newest step; written by the audio thread
+	std::atomic<uint32_t> cursor { 0 };	// one past the last step not undone; audio thread
+	std::atomic<uint32_t> floor { 0 };	// steps below this were given up; audio thread
+	std::atomic<uint32_t> tail { 0 };	// oldest step not evicted; background thread
+	std::atomic<uint64_t> recordHead { 0 };	// audio thread
+	std::atomic<uint64_t> recordTail { 0 };	// background thread
+	bool open = false;	// the newest step is an overdub pass in progress; audio thread
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread worker;
+	bool running = true;
+};
\ No newline at end of file
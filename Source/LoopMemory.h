@@ -0,0 +1,784 @@
+#pragma once
+
+#include "Constants.h"
+#include "SampleFormat.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/file.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+/*
+* All the memory the loops play from, carved out of one 64 byte aligned slab. The slab is sized ahead of
+* time for the longest loop we expect, touched page by page so nothing faults in later, and optionally
+* locked into RAM. Loops then point into it, so a tempo change only moves their lengths around.
+*
+* If a tempo needs longer loops than the slab holds, a bigger slab is built on a background thread and
+* the audio thread switches to it once it's ready. The old slab is freed on that same thread, never on
+* the audio thread. Other background work, such as time stretching, can build a slab of its own with
+* create and hand it over the same way with adopt.
+*
+* With setBacking, slabs live in memory-mapped files instead, so long loops don't all have to stay in RAM.
+* The background thread then also acts as a pager: it keeps a window of every loop around the playhead
+* touched for writing and locked, and writes back what the playhead has left behind, so the OS can drop
+* those pages. The audio thread only ever works inside the window, apart from a transport jump, which can
+* fault until the next tick catches up. A file header records where each loop is and how long it is, so
+* if the host crashes the next allocate with the same path maps the file back in with the loops intact.
+*
+* Other processes can map a file backed slab read-only with view and play its loops as they're recorded,
+* finding each loop through its record in the header; see LoopSharer.
+*/
+class LoopMemory {
+public:
+	static constexpr size_t alignment = 64;
+
+	// What a loop file remembers about each loop, written by the audio thread through recordLoop.
+	struct LoopRecord {
+		uint32_t slot;	// which of the slab's loops holds its audio, as takes are swapped between them
+		uint32_t silent;
+		uint32_t beatsPerLoop;
+		uint32_t sequence;	// odd while the record is being written, see readRecord
+		double samplesPerBeat;
+	};
+
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t capacity;
+		uint64_t preLoopCapacity;
+		uint32_t numChannels;
+		uint32_t numLoops;
+		uint32_t format;	// a SampleFormat
+		uint64_t live;	// when the slab last became current, so a crash leaves the newest file to recover
+		LoopRecord loops[maxLoops];
+	};
+
+	/*
+	* Room for numLoops loops, each with capacity values plus MAX_FADE_SAMPLES-style lead-in per channel,
+	* stored in the slab's format. Offsets into the slab are in bytes.
+	*/
+	struct Slab {
+		uint8_t* memory = nullptr;
+		size_t bytes = 0;
+		size_t capacity = 0;		// values per channel each loop can hold
+		size_t preLoopCapacity = 0;	// lead-in values per channel
+		int numChannels = 0;
+		int numLoops = 0;
+		SampleFormat format = SampleFormat::float32;
+		uint32_t generation = 0;
+		bool locked = false;
+		std::string path;			// what setBacking was given when the slab was laid out, empty for the heap
+		uint64_t fileNumber = 0;	// the <n> in the file's name, see fileName
+		size_t readAhead = 0;
+
+		// file backed slabs only
+		FileHeader* header = nullptr;
+		bool recovered = false;		// mapped back in from a session that didn't shut down
+		std::filesystem::path fileName;
+		std::vector<char> resident;	// per pager block, whether the pager holds it in RAM
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#else
+		int file = -1;
+#endif
+
+		uint8_t* getData(int loop) const {
+			return memory + loop * stride();
+		}
+
+		uint8_t* getPreLoop(int loop) const {
+			return getData(loop) + roundUp(capacity * numChannels * valueBytes());
+		}
+
+		// Bytes from one loop to the next.
+		size_t stride() const {
+			return roundUp(capacity * numChannels * valueBytes()) + roundUp(preLoopCapacity * numChannels * valueBytes());
+		}
+
+		size_t valueBytes() const {
+			return SampleConversion::bytesPerValue(format);
+		}
+	};
+
+	~LoopMemory() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+		}
+		wake.notify_one();
+		if (worker.joinable()) worker.join();
+
+		free(current);
+		free(ready.exchange(nullptr));
+		for (auto& slot : retired) {
+			free(slot.exchange(nullptr));
+		}
+	}
+
+	/*
+	* Back the slabs allocate, grow and create build from now on with files, or put them on the heap again
+	* for an empty path. Takes effect on the next allocate. Not on the audio thread.
+	* @param path Where the files go: each slab gets a file named after the last part of the path, e.g.
+	* /tmp/instance becomes /tmp/instance-<n>.loops. The folder must exist.
+	* @param readAhead Values ahead of the playhead to keep in RAM.
+	*/
+	void setBacking(const std::string& path, size_t readAhead) {
+		std::lock_guard<std::mutex> guard(lock);
+		backingPath = path;
+		backingReadAhead = readAhead;
+	}
+
+	/*
+	* Replace the slab straight away. Allocates and frees inline, so only call this while the audio thread
+	* isn't running, e.g. from prepareToPlay. With a backing path, a file left by a crash with the same
+	* layout is mapped back in instead, and the slab is marked recovered.
+	* @param capacity Longest loop to make room for, in values per channel.
+	* @param preLoopCapacity Lead-in values per channel.
+	* @param numChannels Channels per loop.
+	* @param numLoops Number of loops to carve out.
+	* @param format How the loops keep their values.
+	* @param lockPages Try to lock the slab into RAM. Failing to (say, over the OS limit) isn't an error.
+	*/
+	const Slab& allocate(size_t capacity, size_t preLoopCapacity, int numChannels, int numLoops, SampleFormat format, bool lockPages) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (!worker.joinable()) worker = std::thread([this] { run(); });
+
+		free(ready.exchange(nullptr));
+		paged.store(nullptr, std::memory_order_relaxed);
+		free(current);
+		current = nullptr;
+
+		Slab layout;
+		layout.capacity = capacity;
+		layout.preLoopCapacity = preLoopCapacity;
+		layout.numChannels = numChannels;
+		layout.numLoops = numLoops;
+		layout.format = format;
+		layout.generation = config.generation + 1;
+		layout.locked = lockPages;
+		layout.path = backingPath;
+		layout.readAhead = backingReadAhead;
+		config = layout;
+		wanted.store(0, std::memory_order_relaxed);
+		if (!config.path.empty()) current = recover(config);
+		if (current == nullptr) current = build(config);
+		if (current->header != nullptr) liveCount = std::max(liveCount, current->header->live);
+		page(*current);
+		makeCurrent(current);
+		return *current;
+	}
+
+	// The slab loops are currently carved from. Audio thread, or while it isn't running.
+	const Slab* getCurrent() const {
+		return current;
+	}
+
+	/*
+	* Audio thread: make room for loops of the given length. Never allocates or waits.
+	* @return The new slab once a big enough one is ready. The caller must move every loop onto it before the
+	* next block; the old one is freed in the background. Null if the current slab fits or one isn't ready yet.
+	*/
+	const Slab* grow(size_t capacity) {
+		if (current == nullptr || capacity <= current->capacity) return nullptr;
+
+		Slab* bigger = ready.exchange(nullptr, std::memory_order_acquire);
+		if (bigger != nullptr && bigger->generation == current->generation && bigger->capacity >= capacity) {
+			// the pager must see the new slab before the old one can be freed
+			Slab* old = current;
+			makeCurrent(bigger);
+			retire(old);
+			return current;
+		}
+
+		if (bigger != nullptr) retire(bigger);
+		size_t previous = wanted.load(std::memory_order_relaxed);
+		if (capacity > previous) wanted.store(capacity, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	/*
+	* Background thread: build a slab laid out like the current one, with room for loops of at least the
+	* given length, for the caller to fill before handing it to adopt. Allocates, so never the audio thread.
+	*/
+	Slab* create(size_t capacity) {
+		Slab layout;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			layout = config;
+		}
+		layout.capacity = std::max(layout.capacity, capacity + capacity / 4);
+		return build(layout);
+	}
+
+	/*
+	* Audio thread: switch to a slab from create. The old one is freed in the background.
+	* @return False if allocate has replaced the slab since this one was made; it's freed in the background
+	* and the current slab stays.
+	*/
+	bool adopt(Slab* slab) {
+		if (current == nullptr || slab->generation != current->generation) {
+			retire(slab);
+			return false;
+		}
+		Slab* old = current;
+		makeCurrent(slab);
+		retire(old);
+		return true;
+	}
+
+	// Free a slab from create that never got adopted. Not on the audio thread.
+	void release(Slab* slab) {
+		free(slab);
+	}
+
+	/*
+	* Audio thread: where the playhead is, for the pager to keep the loops around it in RAM. Cheap enough
+	* for every block, and only matters for file backed slabs.
+	* @param sample, length The position in the current pass of the loop, for slots not recorded yet.
+	* @param transport The host position, for recorded loops, which keep their own length and tempo.
+	*/
+	void setPlayhead(size_t sample, size_t length, int64_t transport) {
+		playSample.store(sample, std::memory_order_relaxed);
+		playLength.store(length, std::memory_order_relaxed);
+		playTransport.store(transport, std::memory_order_relaxed);
+	}
+
+	/*
+	* Audio thread: note a loop in the file header, so it can be picked up again after a crash, and so other
+	* processes viewing the slab find a take as soon as it's swapped in. Does nothing for slabs on the heap,
+	* and only writes when something changed.
+	* @param data The loop's audio, somewhere in the current slab.
+	*/
+	void recordLoop(int index, const void* data, bool silent, double samplesPerBeat, int beatsPerLoop) {
+		if (current == nullptr || current->header == nullptr) return;
+		LoopRecord& record = current->header->loops[index];
+		uint32_t slot = (uint32_t)((static_cast<const uint8_t*>(data) - current->memory) / (ptrdiff_t)current->stride());
+		if (record.slot == slot && record.silent == (uint32_t)silent && record.beatsPerLoop == (uint32_t)beatsPerLoop
+			&& record.samplesPerBeat == samplesPerBeat) return;
+
+		// a sequence lock, so a reader in another process never acts on half a record
+		auto& sequence = *reinterpret_cast<std::atomic<uint32_t>*>(&record.sequence);
+		uint32_t writing = sequence.load(std::memory_order_relaxed) | 1;
+		sequence.store(writing, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		record.slot = slot;
+		record.silent = silent;
+		record.beatsPerLoop = beatsPerLoop;
+		record.samplesPerBeat = samplesPerBeat;
+		sequence.store(writing + 1, std::memory_order_release);
+	}
+
+	/*
+	* Audio thread: read one loop's record from a slab another process is writing, see view. Wait-free.
+	* @param seen The sequence of the record last read, updated whenever this returns true. Start it at 1,
+	* which no finished record has.
+	* @return Whether record holds a record that changed since seen. False if it's unchanged, or being
+	* written right now, in which case the next block tries again.
+	*/
+	static bool readRecord(const Slab& slab, int index, LoopRecord& record, uint32_t& seen) {
+		const LoopRecord& shared = slab.header->loops[index];
+		const auto& sequence = *reinterpret_cast<const std::atomic<uint32_t>*>(&shared.sequence);
+		uint32_t before = sequence.load(std::memory_order_acquire);
+		if (before == seen || (before & 1) != 0) return false;
+
+		record.slot = shared.slot;
+		record.silent = shared.silent;
+		record.beatsPerLoop = shared.beatsPerLoop;
+		record.samplesPerBeat = shared.samplesPerBeat;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (sequence.load(std::memory_order_relaxed) != before) return false;
+
+		record.sequence = before;
+		seen = before;
+		return true;
+	}
+
+	/*
+	* Map a slab that another instance keeps in a file, read-only, to play its loops without a copy. The
+	* memory stays valid for as long as the view is open, even once the owner moves on and removes the file.
+	* Maps and locks the slab into RAM, so never on the audio thread.
+	* @return Null if the file is gone or isn't a slab this build can read. Close it with closeView.
+	*/
+	static Slab* view(const std::filesystem::path& fileName) {
+		Slab* slab = new Slab();
+		FileHeader header {};
+#ifdef _WIN32
+		HANDLE file = CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			delete slab;
+			return nullptr;
+		}
+		DWORD read = 0;
+		LARGE_INTEGER size {};
+		bool readable = ReadFile(file, &header, sizeof(header), &read, nullptr) && read == sizeof(header) && GetFileSizeEx(file, &size);
+		HANDLE mapping = readable && describe(*slab, header, (uint64_t)size.QuadPart)
+			? CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+		void* base = mapping != nullptr ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, headerBytes + slab->bytes) : nullptr;
+		CloseHandle(file);	// the mapping keeps the file open
+		if (base == nullptr) {
+			if (mapping != nullptr) CloseHandle(mapping);
+			delete slab;
+			return nullptr;
+		}
+		slab->mapping = mapping;
+#else
+		int file = open(fileName.c_str(), O_RDONLY);
+		if (file < 0) {
+			delete slab;
+			return nullptr;
+		}
+		struct stat info;
+		bool readable = pread(file, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && fstat(file, &info) == 0;
+		void* base = readable && describe(*slab, header, (uint64_t)info.st_size)
+			? mmap(nullptr, headerBytes + slab->bytes, PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+		close(file);	// the mapping keeps the file open
+		if (base == MAP_FAILED) {
+			delete slab;
+			return nullptr;
+		}
+#endif
+		slab->header = static_cast<FileHeader*>(base);
+		slab->memory = static_cast<uint8_t*>(base) + headerBytes;
+		slab->fileName = fileName;
+
+		// the audio thread plays straight from it, so bring it all in now rather than fault there
+		lockRange(base, headerBytes + slab->bytes);
+		return slab;
+	}
+
+	// Close a slab from view. Not on the audio thread.
+	static void closeView(Slab* slab) {
+		if (slab == nullptr) return;
+#ifdef _WIN32
+		UnmapViewOfFile(slab->header);
+		CloseHandle(slab->mapping);
+#else
+		munmap(slab->header, headerBytes + slab->bytes);
+#endif
+		delete slab;
+	}
+
+	// The file a slab built with a backing path gets, see setBacking.
+	static std::filesystem::path fileName(const std::string& path, uint64_t number) {
+		return path + "-" + std::to_string(number) + ".loops";
+	}
+
+private:
+	static constexpr uint32_t fileMagic = 0x504f4f4c;	// "LOOP"
+	static constexpr uint32_t fileVersion = 3;
+	static constexpr size_t headerBytes = 1 << 16;	// the slab starts past this, on a page boundary everywhere
+	static constexpr size_t pagerBlock = 1 << 16;	// bytes the pager brings in or lets go of at once
+	static constexpr size_t touchStride = 4096;
+
+	static size_t roundUp(size_t bytes) {
+		return (bytes + alignment - 1) / alignment * alignment;
+	}
+
+	static Slab* build(const Slab& layout) {
+		Slab* slab = new Slab(layout);
+		slab->bytes = slab->stride() * slab->numLoops;
+		slab->header = nullptr;
+		slab->recovered = false;
+
+		// a file that can't be made (a full disk, a missing folder) leaves the slab on the heap
+		slab->fileNumber = layout.path.empty() ? 0 : nextFileNumber();
+		if (!layout.path.empty() && map(*slab, fileName(layout.path, slab->fileNumber), false)) {
+			FileHeader* header = slab->header;
+			header->magic = fileMagic;
+			header->version = fileVersion;
+			header->capacity = slab->capacity;
+			header->preLoopCapacity = slab->preLoopCapacity;
+			header->numChannels = (uint32_t)slab->numChannels;
+			header->numLoops = (uint32_t)slab->numLoops;
+			header->format = (uint32_t)slab->format;
+			header->live = 0;
+			std::memset(header->loops, 0, sizeof(header->loops));
+			return slab;
+		}
+		slab->path.clear();
+		slab->fileNumber = 0;
+		slab->memory = static_cast<uint8_t*>(::operator new(slab->bytes, std::align_val_t(alignment)));
+
+		// writing every page now means the audio thread never takes a page fault on first touch
+		std::memset(slab->memory, 0, slab->bytes);
+
+		if (layout.locked) {
+#ifdef _WIN32
+			slab->locked = VirtualLock(slab->memory, slab->bytes) != 0;
+#else
+			slab->locked = mlock(slab->memory, slab->bytes) == 0;
+#endif
+		}
+		return slab;
+	}
+
+	static void free(Slab* slab) {
+		if (slab == nullptr) return;
+		if (slab->header != nullptr) {
+			unmap(*slab);
+			std::error_code ignored;
+			std::filesystem::remove(slab->fileName, ignored);
+			delete slab;
+			return;
+		}
+		if (slab->locked) {
+#ifdef _WIN32
+			VirtualUnlock(slab->memory, slab->bytes);
+#else
+			munlock(slab->memory, slab->bytes);
+#endif
+		}
+		::operator delete(slab->memory, std::align_val_t(alignment));
+		delete slab;
+	}
+
+	// Each slab gets a file of its own, so one can be built while the last is still playing.
+	static uint64_t nextFileNumber() {
+		static std::atomic<uint64_t> count { (uint64_t)std::chrono::system_clock::now().time_since_epoch().count() };
+		return count.fetch_add(1);
+	}
+
+	// Lay a slab out as a file header describes it, for view. False if the file can't hold that.
+	static bool describe(Slab& slab, const FileHeader& header, uint64_t fileSize) {
+		if (header.magic != fileMagic || header.version != fileVersion || header.format > (uint32_t)SampleFormat::half) return false;
+		slab.format = (SampleFormat)header.format;
+		slab.capacity = (size_t)header.capacity;
+		slab.preLoopCapacity = (size_t)header.preLoopCapacity;
+		slab.numChannels = (int)header.numChannels;
+		slab.numLoops = (int)header.numLoops;
+		slab.bytes = slab.stride() * slab.numLoops;
+		return fileSize >= headerBytes + slab.bytes;
+	}
+
+	/*
+	* Map a loop file, made to fit slab.bytes or, if existing, as it is. The file is held exclusively, so
+	* another instance won't take it for one left by a crash, but others can still view it.
+	*/
+	static bool map(Slab& slab, const std::filesystem::path& fileName, bool existing) {
+		size_t total = headerBytes + slab.bytes;
+#ifdef _WIN32
+		HANDLE file = CreateFileW(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+			existing ? OPEN_EXISTING : CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		// the mapping grows the file to its size
+		HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)total >> 32), (DWORD)total, nullptr);
+		void* base = mapping != nullptr ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, total) : nullptr;
+		if (base == nullptr) {
+			if (mapping != nullptr) CloseHandle(mapping);
+			CloseHandle(file);
+			if (!existing) DeleteFileW(fileName.c_str());
+			return false;
+		}
+		slab.file = file;
+		slab.mapping = mapping;
+#else
+		int file = open(fileName.c_str(), existing ? O_RDWR : O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (file < 0) return false;
+		bool sized = flock(file, LOCK_EX | LOCK_NB) == 0;
+	#ifdef __linux__
+		// reserve the disk space now, rather than have a write to a hole fail later with a signal
+		if (sized && !existing) sized = posix_fallocate(file, 0, (off_t)total) == 0;
+	#else
+		if (sized && !existing) sized = ftruncate(file, (off_t)total) == 0;
+	#endif
+		void* base = sized ? mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+		if (base == MAP_FAILED) {
+			close(file);
+			if (!existing) unlink(fileName.c_str());
+			return false;
+		}
+		slab.file = file;
+#endif
+		slab.header = static_cast<FileHeader*>(base);
+		slab.memory = static_cast<uint8_t*>(base) + headerBytes;
+		slab.fileName = fileName;
+		slab.locked = false;
+		slab.resident.assign((slab.bytes + pagerBlock - 1) / pagerBlock, 0);
+
+		// the audio thread writes the header every block, so it stays in RAM for good
+		touch(reinterpret_cast<char*>(slab.header), headerBytes);
+		lockRange(slab.header, headerBytes);
+		return true;
+	}
+
+	static void unmap(Slab& slab) {
+#ifdef _WIN32
+		UnmapViewOfFile(slab.header);
+		CloseHandle(slab.mapping);
+		CloseHandle(slab.file);
+#else
+		munmap(slab.header, headerBytes + slab.bytes);
+		close(slab.file);
+#endif
+	}
+
+	/*
+	* Look for a file left by a session that didn't shut down, with room for the given layout. Files of
+	* that name nobody holds are all stale but the newest, so those are removed.
+	*/
+	static Slab* recover(const Slab& layout) {
+		namespace fs = std::filesystem;
+		fs::path base(layout.path);
+		std::string prefix = base.filename().string() + "-";
+		std::error_code error;
+		fs::path best;
+		FileHeader bestHeader {};
+
+		std::vector<fs::path> stale;
+		for (const auto& entry : fs::directory_iterator(base.parent_path(), error)) {
+			std::string name = entry.path().filename().string();
+			if (name.compare(0, prefix.size(), prefix) != 0 || entry.path().extension() != ".loops") continue;
+
+			FileHeader header;
+			if (!readHeader(entry.path(), header)) continue;	// held by a running instance
+			bool fits = header.magic == fileMagic && header.version == fileVersion
+				&& header.numChannels == (uint32_t)layout.numChannels && header.numLoops == (uint32_t)layout.numLoops
+				&& header.format == (uint32_t)layout.format
+				&& header.preLoopCapacity == layout.preLoopCapacity && header.capacity >= layout.capacity;
+			if (fits && header.live > bestHeader.live) {
+				if (!best.empty()) stale.push_back(best);
+				best = entry.path();
+				bestHeader = header;
+			} else {
+				stale.push_back(entry.path());
+			}
+		}
+		for (const auto& path : stale) fs::remove(path, error);
+		if (best.empty()) return nullptr;
+
+		Slab* slab = new Slab(layout);
+		slab->capacity = (size_t)bestHeader.capacity;
+		slab->bytes = slab->stride() * slab->numLoops;
+		if (fs::file_size(best, error) < headerBytes + slab->bytes || error || !map(*slab, best, true)) {
+			delete slab;
+			fs::remove(best, error);
+			return nullptr;
+		}
+		slab->recovered = true;
+		slab->fileNumber = std::strtoull(best.filename().string().c_str() + prefix.size(), nullptr, 10);
+		return slab;
+	}
+
+	// Read a loop file's header, if no one else holds the file.
+	static bool readHeader(const std::filesystem::path& fileName, FileHeader& header) {
+#ifdef _WIN32
+		HANDLE file = CreateFileW(fileName.c_str(), GENERIC_READ, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		DWORD read = 0;
+		bool complete = ReadFile(file, &header, sizeof(header), &read, nullptr) && read == sizeof(header);
+		CloseHandle(file);
+#else
+		int file = open(fileName.c_str(), O_RDONLY);
+		if (file < 0) return false;
+		if (flock(file, LOCK_SH | LOCK_NB) != 0) {
+			close(file);
+			return false;
+		}
+		bool complete = pread(file, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+		close(file);
+#endif
+		if (!complete) header = {};
+		return true;
+	}
+
+	/*
+	* Fault pages in for writing without changing them. The audio thread may be writing the same values,
+	* so each page gets an atomic add of zero rather than a plain store.
+	*/
+	static void touch(char* from, size_t bytes) {
+		for (size_t offset = 0; offset < bytes; offset += touchStride) {
+			reinterpret_cast<std::atomic<uint32_t>*>(from + offset)->fetch_add(0, std::memory_order_relaxed);
+		}
+	}
+
+	static void lockRange(void* from, size_t bytes) {
+#ifdef _WIN32
+		VirtualLock(from, bytes);
+#else
+		mlock(from, bytes);
+#endif
+	}
+
+	static void unlockRange(void* from, size_t bytes) {
+#ifdef _WIN32
+		VirtualUnlock(from, bytes);
+#else
+		munlock(from, bytes);
+#endif
+	}
+
+	// Start writing a range of the slab to disk without waiting for it, so the OS can drop the pages later.
+	static void writeBack(const Slab& slab, size_t offset, size_t bytes) {
+#ifdef _WIN32
+		FlushViewOfFile(slab.memory + offset, bytes);
+#elif defined(__linux__)
+		sync_file_range(slab.file, (off_t)(headerBytes + offset), (off_t)bytes, SYNC_FILE_RANGE_WRITE);
+#else
+		msync(slab.memory + offset, bytes, MS_ASYNC);
+#endif
+	}
+
+	// Audio thread, or while it isn't running: loops play from this slab from now on.
+	void makeCurrent(Slab* slab) {
+		current = slab;
+		if (slab->header != nullptr) slab->header->live = ++liveCount;
+		paged.store(slab, std::memory_order_release);
+	}
+
+	/*
+	* Bring in the window around the playhead in every loop of a file backed slab, and let go of the rest.
+	* Under lock, so the slab can't be freed meanwhile.
+	*/
+	void page(Slab& slab) {
+		if (slab.header == nullptr) return;
+		size_t playing = playSample.load(std::memory_order_relaxed);
+		size_t passLength = playLength.load(std::memory_order_relaxed);
+		if (passLength == 0 || passLength > slab.capacity) passLength = slab.capacity;
+		playing %= passLength;
+		double transport = (double)std::max<int64_t>(0, playTransport.load(std::memory_order_relaxed));
+
+		// slots not recorded yet are where the next take goes, at the cursor's length; recorded loops can be
+		// at another tempo, waiting to be stretched or followed, and are stored and played at their own
+		pagedSlots.assign(slab.numLoops, { playing, passLength });
+		for (int index = 0; index < maxLoops; index++) {
+			LoopRecord record;
+			uint32_t seen = 1;
+			if (!readRecord(slab, index, record, seen) || record.silent || record.slot >= (uint32_t)slab.numLoops) continue;
+			double loopLength = record.samplesPerBeat * record.beatsPerLoop;
+			size_t size = std::min((size_t)ceil(loopLength), slab.capacity);
+			if (size == 0) continue;
+			// as Loop::getPosition works it out
+			size_t loopStart = (size_t)floor(floor(transport / loopLength) * loopLength);
+			pagedSlots[record.slot] = { std::min((size_t)transport - loopStart, size - 1), size };
+		}
+
+		wantedBlocks.assign(slab.resident.size(), 0);
+		size_t valueBytes = slab.valueBytes();
+		char* base = reinterpret_cast<char*>(slab.memory);
+		auto want = [&](const uint8_t* from, size_t count) {
+			if (count == 0) return;
+			size_t offset = reinterpret_cast<const char*>(from) - base;
+			size_t last = (offset + count * valueBytes - 1) / pagerBlock;
+			std::fill(wantedBlocks.begin() + offset / pagerBlock, wantedBlocks.begin() + last + 1, 1);
+		};
+		// a little behind the playhead too, for a transport that wobbles back
+		size_t behind = pagerBlock / valueBytes;
+		for (int loop = 0; loop < slab.numLoops; loop++) {
+			size_t sample = pagedSlots[loop].sample;
+			size_t length = pagedSlots[loop].length;
+			size_t span = std::min(length, behind + slab.readAhead);
+			size_t start = (sample + length - behind % length) % length;
+			size_t first = std::min(span, length - start);
+			// channels are stored one after the other at the loop's length
+			for (int channel = 0; channel < slab.numChannels; channel++) {
+				const uint8_t* data = slab.getData(loop) + channel * length * valueBytes;
+				want(data + start * valueBytes, first);
+				want(data, span - first);
+			}
+			want(slab.getPreLoop(loop), slab.preLoopCapacity * slab.numChannels);
+		}
+
+		for (size_t block = 0; block < wantedBlocks.size(); block++) {
+			if (wantedBlocks[block] == slab.resident[block]) continue;
+			size_t offset = block * pagerBlock;
+			size_t bytes = std::min(pagerBlock, slab.bytes - offset);
+			if (wantedBlocks[block]) {
+				touch(base + offset, bytes);
+				lockRange(base + offset, bytes);
+			} else {
+				unlockRange(base + offset, bytes);
+				writeBack(slab, offset, bytes);
+			}
+			slab.resident[block] = wantedBlocks[block];
+		}
+	}
+
+	// Hand a slab to the background thread to free. Lock-free; there are only ever a couple in flight.
+	void retire(Slab* slab) {
+		for (;;) {
+			for (auto& slot : retired) {
+				Slab* empty = nullptr;
+				if (slot.compare_exchange_strong(empty, slab, std::memory_order_release)) return;
+			}
+			// every slot full would mean the background thread is stuck; spinning beats freeing here
+			std::this_thread::yield();
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (running) {
+			wake.wait_for(guard, std::chrono::milliseconds(20));
+			if (!running) break;
+
+			// read before draining, so a slab retired after this load is still caught below; makeCurrent
+			// publishes the new slab before the old one is retired, so one not retired yet stays alive
+			Slab* slab = paged.load(std::memory_order_acquire);
+			for (auto& slot : retired) {
+				Slab* old = slot.exchange(nullptr, std::memory_order_acquire);
+				if (old == slab) slab = nullptr;
+				free(old);
+			}
+
+			// only ever the slab the audio thread plays from, and only this thread frees it once retired
+			if (slab != nullptr) page(*slab);
+
+			size_t capacity = wanted.load(std::memory_order_relaxed);
+			if (capacity == 0 || ready.load(std::memory_order_relaxed) != nullptr) continue;
+
+			// leave a little headroom so a slow tempo ramp doesn't rebuild the slab on every step
+			Slab layout = config;
+			layout.capacity = capacity + capacity / 4;
+			Slab* bigger = build(layout);
+			page(*bigger);
+			wanted.store(0, std::memory_order_relaxed);
+			ready.store(bigger, std::memory_order_release);
+		}
+	}
+
+	Slab* current = nullptr;			// owned by the audio thread once it's running
+	std::atomic<Slab*> ready { nullptr };	// built by the background thread, waiting to be picked up
+	std::atomic<Slab*> retired[4] = {};
+	std::atomic<size_t> wanted { 0 };
+
+	std::atomic<Slab*> paged { nullptr };	// the current slab, for the pager
+	std::atomic<size_t> playSample { 0 };
+	std::atomic<size_t> playLength { 0 };
+	std::atomic<int64_t> playTransport { 0 };
+	uint64_t liveCount = 0;				// audio thread
+	std::vector<char> wantedBlocks;		// pager scratch
+	struct PagedSlot { size_t sample; size_t length; };
+	std::vector<PagedSlot> pagedSlots;	// pager scratch, where each slot plays
+
+	Slab config;	// layout of the slab allocate() last built, guarded by lock
+	std::string backingPath;			// guarded by lock
+	size_t backingReadAhead = 0;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread worker;
+	bool running = true;
+};
\ No newline at end of file
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "Loop.h"
+#include "MixKernel.h"
+#include "MixWorkers.h"
+#include <algorithm>
+
+/*
+* The mix at the heart of every block: the input scaled to its gain, and every loop that plays mixed on top
+* of it, one chunk at a time. LooperAudioProcessor does what's specific to the plugin around it, recording
+* and overdubbing, and the benchmarks drive this same code headless.
+*/
+namespace LoopMixer {
+
+	// below this many loops, waking the mix workers would cost more than it saves
+	static constexpr int parallelLoopThreshold = 16;
+	static constexpr int jobsPerThread = 2;	// a few more jobs than threads evens out loops that cost more
+
+	struct Chunk {
+		float* const* channels;		// the input on entry and the mix on return
+		int numChannels;
+		int count;
+		int loopCount;
+		const float* gains;			// each loop's gain at the start of the chunk
+		const float* targetGains;	// and at its end
+		MixKernel::Levels* levels;	// one per loop and the input's at maxLoops, or null to skip metering
+	};
+
+	/*
+	* Each chunk ramps its share of the way to the block's targets, so the block still ramps linearly.
+	* @param remaining Samples left in the block, this chunk's included.
+	*/
+	inline void rampChunk(const float* gains, const float* blockTargets, int loopCount, int count, int remaining, float* chunkTargets) {
+		for (int i = 0; i < loopCount; i++) {
+			chunkTargets[i] = gains[i] + (blockTargets[i] - gains[i]) * count / remaining;
+		}
+	}
+
+	namespace detail {
+
+		template<typename PlaybackLoop, typename PositionFor>
+		void mixRange(const Chunk& chunk, float* const* into, int from, int to, int skip, PlaybackLoop& playbackLoop, PositionFor& positionFor) {
+			for (int j = from; j < to; j++) {
+				if (skip == j) continue;
+				const Loop<float>& loop = playbackLoop(j);
+				if (loop.isSilent()) continue;
+				loop.mixInto(into, positionFor(loop), chunk.count, chunk.gains[j], chunk.targetGains[j],
+					chunk.levels != nullptr ? chunk.levels + j : nullptr);
+			}
+		}
+
+		// LoopCount is 0 for a count known only at runtime; the common ones get a loop with a fixed trip count
+		template<int LoopCount, typename PlaybackLoop, typename PositionFor>
+		void mixLoops(const Chunk& chunk, int skip, PlaybackLoop& playbackLoop, PositionFor& positionFor) {
+			mixRange(chunk, chunk.channels, 0, LoopCount > 0 ? LoopCount : chunk.loopCount, skip, playbackLoop, positionFor);
+		}
+
+	}
+
+	/*
+	* Scale the input to its gain and mix every loop but skip on top. Loops are split into contiguous groups
+	* shared with the mix workers once there are enough of them.
+	* @param inputGain The input's gain at the start of the chunk, and inputTarget at its end.
+	* @param skip The loop the input stands in for, or -1.
+	* @param playbackLoop Takes a loop index and returns the Loop<float> to play for it.
+	* @param positionFor Takes a Loop<float> and returns where it plays at the start of the chunk.
+	*/
+	template<typename PlaybackLoop, typename PositionFor>
+	void mix(MixWorkers& workers, const Chunk& chunk, float inputGain, float inputTarget, int skip,
+		PlaybackLoop&& playbackLoop, PositionFor&& positionFor) {
+		// levels are gathered by the same kernels that do the mixing, so metering costs no extra pass
+		MixKernel::Levels* inputLevels = chunk.levels != nullptr ? chunk.levels + maxLoops : nullptr;
+		float inputGainStep = (inputTarget - inputGain) / chunk.count;
+		for (int channel = 0; channel < chunk.numChannels; channel++) {
+			float* samples = chunk.channels[channel];
+			if (inputGain == 0.f && inputGainStep == 0.f) {
+				if (inputLevels != nullptr) MixKernel::measure(samples, chunk.count, *inputLevels);
+				std::fill_n(samples, chunk.count, 0.f);
+			} else if (inputGain != 1.f || inputGainStep != 0.f) {
+				if (inputLevels != nullptr) {
+					MixKernel::scaleWithRamp(samples, chunk.count, inputGain, inputGainStep, *inputLevels);
+				} else {
+					MixKernel::scaleWithRamp(samples, chunk.count, inputGain, inputGainStep);
+				}
+			} else if (inputLevels != nullptr) {
+				MixKernel::measure(samples, chunk.count, *inputLevels);
+			}
+		}
+
+		if (chunk.loopCount >= parallelLoopThreshold && workers.getHelperCount() > 0) {
+			const int jobs = std::min(chunk.loopCount, (workers.getHelperCount() + 1) * jobsPerThread);
+			auto mixGroup = [&](int job, float* const* into) {
+				detail::mixRange(chunk, into, job * chunk.loopCount / jobs, (job + 1) * chunk.loopCount / jobs, skip, playbackLoop, positionFor);
+			};
+			workers.run(jobs, chunk.channels, chunk.count, mixGroup);
+			return;
+		}
+
+		switch (chunk.loopCount) {
+			case defaultLoopCount: detail::mixLoops<defaultLoopCount>(chunk, skip, playbackLoop, positionFor); break;
+			case 16: detail::mixLoops<16>(chunk, skip, playbackLoop, positionFor); break;
+			case 32: detail::mixLoops<32>(chunk, skip, playbackLoop, positionFor); break;
+			case maxLoops: detail::mixLoops<maxLoops>(chunk, skip, playbackLoop, positionFor); break;
+			default: detail::mixLoops<0>(chunk, skip, playbackLoop, positionFor); break;
+		}
+	}
+
+}
\ No newline at end of file
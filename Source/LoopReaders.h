@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+/*
+* Lets background threads read the loops without the audio thread ever waiting on them to move or resize
+* the loops. A reader registers and then checks that no resize is in progress; a resize announces itself
+* and then checks that nobody is reading. Both sides use sequentially consistent atomics, so at least one
+* of them sees the other and backs off.
+*/
+class LoopReaders {
+public:
+	/*
+	* Ask to reallocate or resize the loops. A background thread may be reading them, so this fails instead
+	* of waiting unless told to; the audio thread simply tries again next block.
+	* Every successful call must be matched with endResize.
+	*/
+	bool beginResize(bool wait = false) {
+		for (;;) {
+			resizing.store(true, std::memory_order_seq_cst);
+			if (readers.load(std::memory_order_seq_cst) == 0) return true;
+			resizing.store(false, std::memory_order_seq_cst);
+			if (!wait) return false;
+			std::this_thread::yield();
+		}
+	}
+
+	void endResize() {
+		resizing.store(false, std::memory_order_seq_cst);
+	}
+
+	/*
+	* Background threads: call read() while the loops are guaranteed to stay where they are.
+	* @return False, without calling read, if a resize is in progress. Try again later.
+	*/
+	template<typename Read>
+	bool read(Read&& read) {
+		readers.fetch_add(1, std::memory_order_seq_cst);
+		if (resizing.load(std::memory_order_seq_cst)) {
+			readers.fetch_sub(1, std::memory_order_seq_cst);
+			return false;
+		}
+		read();
+		readers.fetch_sub(1, std::memory_order_seq_cst);
+		return true;
+	}
+
+private:
+	std::atomic<int> readers { 0 };
+	std::atomic<bool> resizing { false };
+};
\ No newline at end of file
@@ -0,0 +1,279 @@
+#pragma once
+
+#include "Loop.h"
+#include "LoopMemory.h"
+#include "LoopSyncer.h"
+#include "Constants.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class ShareMode {
+	off,		// play this instance's own loops
+	share,		// publish this instance's loops for others to play
+	follow		// play the loops another instance is sharing instead of our own
+};
+
+/*
+* Lets linked instances play one copy of the loop audio instead of each keeping their own.
+*
+* A sharing instance keeps its loop memory where other processes can map it: prepareToPlay backs its slabs
+* with files under getSharedPath, which is in RAM where the OS has such a folder. Takes are recorded straight
+* into the slab, and the pointer swap that commits one is published through that loop's record in the slab's
+* header, which LoopMemory::recordLoop writes in the same block. Nothing is copied. The instance announces
+* which slab it plays from through LoopSyncer.
+*
+* A following instance keeps no loop memory of its own. Its background thread maps the announced slab
+* read-only and hands it to the audio thread with one atomic store. At the start of every block, the audio
+* thread reads each loop's record and points a Loop at wherever the take now is, so a new take plays as
+* soon as it's committed. Nothing on the audio thread allocates, maps or waits.
+*
+* The OS counts the mappings of a slab, so it stays in memory for as long as any instance plays from it,
+* even once the sharer has moved on and removed its file. Files that a sharing process left behind when it
+* crashed are removed the next time any instance starts sharing or following.
+*/
+class LoopSharer {
+public:
+	/*
+	* @param syncer Used to announce and find shared slabs.
+	* @param loops The instance's own maxLoops loops. Followed loops use their fades.
+	*/
+	LoopSharer(LoopSyncer& syncer, const Loop<float>* loops) : syncer(syncer), source(loops),
+		sharedPath((sharedFolder() / (filePrefix + std::to_string(LoopSyncer::currentProcessId()))).string()) {
+		worker = std::thread([this] { run(); });
+	}
+
+	~LoopSharer() {
+		{
+			std::lock_guard<std::mutex> guard(wakeLock);
+			running = false;
+		}
+		wake.notify_one();
+		worker.join();
+	}
+
+	/*
+	* Message thread. Following starts and stops straight away, but a sharing instance's loop memory only
+	* moves on the next prepareToPlay, see getSharedPath.
+	*/
+	void setMode(ShareMode mode) {
+		this->mode.store(mode, std::memory_order_relaxed);
+		wake.notify_one();
+	}
+
+	ShareMode getMode() const {
+		return mode.load(std::memory_order_relaxed);
+	}
+
+	// Where a sharing instance's slabs go, for LoopMemory::setBacking.
+	const std::string& getSharedPath() const {
+		return sharedPath;
+	}
+
+	/*
+	* Audio thread, or while it isn't running: the loops now live in this slab. It's announced to other
+	* instances while sharing, as long as it's one of the shared files.
+	*/
+	void setSlab(const LoopMemory::Slab& slab) {
+		bool shared = slab.header != nullptr && slab.path == sharedPath;
+		ownSlab.store(shared ? slab.fileNumber : 0, std::memory_order_release);
+	}
+
+	/*
+	* Audio thread: pick up the slab being followed, and any takes committed to it since the last block.
+	* Call before getPlaybackLoop.
+	* @param loopCount How many loops will be played.
+	*/
+	void beginBlock(int loopCount) {
+		playing = latest.load(std::memory_order_acquire);
+		if (playing == nullptr) return;
+
+		for (int i = 0; i < loopCount; i++) {
+			playing->update(i, source[i].getFade());
+		}
+	}
+
+	/*
+	* Audio thread: the loop to play for an index. That's the followed take when following one with a
+	* matching channel count, and the instance's own loop otherwise.
+	*/
+	const Loop<float>& getPlaybackLoop(int loopIndex, const Loop<float>& own) const {
+		if (playing == nullptr) return own;
+		const Loop<float>& other = playing->loops[loopIndex];
+		if (other.isSilent() || other.getNumChannels() != own.getNumChannels()) return own;
+		return other;
+	}
+
+	// Audio thread: call once the block is done with anything getPlaybackLoop returned.
+	void endBlock() {
+		audioEpoch.fetch_add(1, std::memory_order_release);
+	}
+
+private:
+	static constexpr const char* filePrefix = "LooperShare-";
+
+	// A sharing instance's slab, mapped read-only, with a loop pointed at each take in it.
+	struct Followed {
+		LoopMemory::Slab* slab = nullptr;
+		uint32_t pid = 0;
+		uint64_t fileNumber = 0;
+		Loop<float> loops[maxLoops];
+		uint32_t seen[maxLoops];	// sequence of each loop's record as last read
+
+		Followed() {
+			for (int i = 0; i < maxLoops; i++) {
+				loops[i].setStorage(nullptr, nullptr, 0, 0);	// silent until a record says otherwise
+				seen[i] = 1;
+			}
+		}
+
+		~Followed() {
+			LoopMemory::closeView(slab);
+		}
+
+		// Audio thread: point a loop at the take its record now describes.
+		void update(int index, const FadeTable& fade) {
+			Loop<float>& loop = loops[index];
+			loop.setFade(fade);
+
+			LoopMemory::LoopRecord record;
+			if (!LoopMemory::readRecord(*slab, index, record, seen[index])) return;
+
+			bool playable = record.slot < (uint32_t)slab->numLoops && !record.silent && record.beatsPerLoop > 0
+				&& record.samplesPerBeat > 0;
+			if (!playable) {
+				loop.setSilent(true);
+				return;
+			}
+			loop.setStorage(slab->getData(record.slot), slab->getPreLoop(record.slot), slab->capacity, slab->numChannels,
+				slab->format);
+			loop.setSilent(!loop.resize(record.samplesPerBeat, (int)record.beatsPerLoop));
+		}
+	};
+
+	struct Retired {
+		std::unique_ptr<Followed> followed;
+		uint64_t epoch;
+	};
+
+	// Somewhere files live in RAM, where the OS has such a place, so shared loops never go to disk.
+	static std::filesystem::path sharedFolder() {
+		std::error_code error;
+#ifdef __linux__
+		if (std::filesystem::is_directory("/dev/shm", error)) return "/dev/shm";
+#endif
+		return std::filesystem::temp_directory_path(error);
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(wakeLock);
+		ShareMode previous = ShareMode::off;
+		while (running) {
+			wake.wait_for(lock, std::chrono::milliseconds(20));
+			if (!running) break;
+
+			ShareMode current = mode.load(std::memory_order_relaxed);
+			if (current != previous && current != ShareMode::off) reclaimDeadSlabs();
+			previous = current;
+
+			syncer.announceSlab(current == ShareMode::share ? ownSlab.load(std::memory_order_acquire) : 0);
+			if (current == ShareMode::follow) {
+				follow();
+			} else {
+				unfollow();
+			}
+
+			freeRetired();
+		}
+
+		syncer.announceSlab(0);
+		unfollow();
+		retired.clear();
+	}
+
+	// Map the slab another instance is sharing, if it isn't the one already followed.
+	void follow() {
+		uint32_t pid;
+		uint64_t fileNumber;
+		if (!syncer.findSharedSlab(pid, fileNumber)) {
+			unfollow();
+			return;
+		}
+		if (following != nullptr && following->pid == pid && following->fileNumber == fileNumber) return;
+
+		std::string path = (sharedFolder() / (filePrefix + std::to_string(pid))).string();
+		LoopMemory::Slab* slab = LoopMemory::view(LoopMemory::fileName(path, fileNumber));
+		if (slab == nullptr) return;	// already replaced, pick up the newer one next tick
+
+		auto next = std::make_unique<Followed>();
+		next->slab = slab;
+		next->pid = pid;
+		next->fileNumber = fileNumber;
+		latest.store(next.get(), std::memory_order_release);
+		retire(std::move(following));
+		following = std::move(next);
+	}
+
+	void unfollow() {
+		if (following == nullptr) return;
+		latest.store(nullptr, std::memory_order_release);
+		retire(std::move(following));
+	}
+
+	// The audio thread may still be playing a slab it picked up before the swap, so keep it for two more blocks.
+	void retire(std::unique_ptr<Followed> followed) {
+		if (followed == nullptr) return;
+		retired.push_back({ std::move(followed), audioEpoch.load(std::memory_order_acquire) + 2 });
+	}
+
+	void freeRetired() {
+		uint64_t epoch = audioEpoch.load(std::memory_order_acquire);
+		retired.erase(
+			std::remove_if(retired.begin(), retired.end(), [epoch](const Retired& r) { return r.epoch <= epoch; }),
+			retired.end()
+		);
+	}
+
+	// Remove the slabs sharing processes left behind when they crashed. Their names start with their PID.
+	static void reclaimDeadSlabs() {
+		namespace fs = std::filesystem;
+		std::string prefix = filePrefix;
+		std::error_code error;
+
+		std::vector<fs::path> dead;
+		for (const auto& entry : fs::directory_iterator(sharedFolder(), error)) {
+			std::string name = entry.path().filename().string();
+			if (name.compare(0, prefix.size(), prefix) != 0 || entry.path().extension() != ".loops") continue;
+
+			uint32_t pid = (uint32_t)std::strtoul(name.c_str() + prefix.size(), nullptr, 10);
+			if (pid != 0 && !LoopSyncer::isProcessAlive(pid)) dead.push_back(entry.path());
+		}
+		for (const auto& path : dead) fs::remove(path, error);
+	}
+
+	LoopSyncer& syncer;
+	const Loop<float>* const source;
+	const std::string sharedPath;
+	std::atomic<ShareMode> mode { ShareMode::off };
+	std::atomic<uint64_t> ownSlab { 0 };
+
+	std::atomic<Followed*> latest { nullptr };
+	Followed* playing = nullptr;	// audio thread: what this block plays from
+	std::atomic<uint64_t> audioEpoch { 0 };
+
+	// background thread only
+	std::unique_ptr<Followed> following;
+	std::vector<Retired> retired;
+
+	std::thread worker;
+	std::mutex wakeLock;
+	std::condition_variable wake;
+	bool running = true;
+};
\ No newline at end of file
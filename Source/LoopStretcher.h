@@ -0,0 +1,230 @@
+#pragma once
+
+#include "Loop.h"
+#include "LoopMemory.h"
+#include "TimeStretch.h"
+#include "ParallelFor.h"
+#include "Constants.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* Re-renders recorded loops at a new tempo in the background, so a tempo change keeps the loops instead of
+* clearing them.
+*
+* The audio thread asks for a length with request and keeps playing the loops it has. A background thread
+* builds a fresh LoopMemory slab holding every recorded loop stretched to the new length, fanning the work
+* out over loops and channels on short-lived worker threads. Once it's ready, the audio thread picks it up
+* with getResult, moves the loops onto it at a loop boundary and calls accept. Nothing on the audio thread
+* allocates or waits, and a result that went stale in the meantime (the tempo moved again or a take was
+* committed) is thrown away and rebuilt.
+*/
+class LoopStretcher {
+public:
+	// A slab holding every loop at the new length.
+	struct Result {
+		LoopMemory::Slab* slab = nullptr;
+		double samplesPerBeat = 0;
+		uint32_t takes = 0;			// takeCommitted count the source loops were read at
+		bool silent[maxLoops] = {};	// loops that had no take and so weren't stretched
+	};
+
+	/*
+	* @param memory Where the stretched loops' slab comes from.
+	* @param loops The loops to stretch, one for each loop the slab holds besides the copy loop. Only read
+	* while a request is pending; the audio thread mustn't move them to other storage until the result is
+	* accepted or cancel returns.
+	*/
+	LoopStretcher(LoopMemory& memory, const Loop<float>* loops) : memory(memory), source(loops) {
+		worker = std::thread([this] { run(); });
+	}
+
+	~LoopStretcher() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+		}
+		wake.notify_one();
+		worker.join();
+
+		discard(ready.exchange(nullptr));
+		discard(finished.exchange(nullptr));
+	}
+
+	/*
+	* Audio thread: ask for the loops at a new tempo, replacing any earlier request.
+	* @param samplesPerBeat Length of a beat to stretch to, or 0 to drop the request.
+	*/
+	void request(double samplesPerBeat) {
+		if (requested.load(std::memory_order_relaxed) == samplesPerBeat) return;
+		requested.store(samplesPerBeat, std::memory_order_relaxed);
+	}
+
+	// Audio thread: a take was just swapped into one of the loops, so anything stretched from before is stale.
+	void takeCommitted() {
+		takes.fetch_add(1, std::memory_order_release);
+	}
+
+	/*
+	* Audio thread: the finished loops for this tempo, if they're ready. Stale results are handed back to
+	* be freed. Call accept once the loops have moved onto the slab.
+	*/
+	const Result* getResult(double samplesPerBeat) {
+		Result* result = ready.load(std::memory_order_acquire);
+		if (result == nullptr) return nullptr;
+
+		if (result->samplesPerBeat != samplesPerBeat || result->takes != takes.load(std::memory_order_relaxed)) {
+			ready.store(nullptr, std::memory_order_relaxed);
+			handBack(result);
+			return nullptr;
+		}
+		return result;
+	}
+
+	// Audio thread: the slab from getResult now belongs to LoopMemory.
+	void accept() {
+		Result* result = ready.exchange(nullptr, std::memory_order_relaxed);
+		result->slab = nullptr;
+		requested.store(0, std::memory_order_relaxed);
+		handBack(result);
+	}
+
+	/*
+	* Drop any request and wait until the loops aren't being read, e.g. before prepareToPlay reallocates
+	* them. Never on the audio thread.
+	*/
+	void cancel() {
+		requested.store(0, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> guard(building);
+		discard(ready.exchange(nullptr));
+	}
+
+	/*
+	* How many of the loops to stretch. The slab's slots past them, such as the copy loop's, are left
+	* silent. Only between cancel and the next request.
+	*/
+	void setLoopCount(int count) {
+		loopCount.store(count, std::memory_order_relaxed);
+	}
+
+private:
+	// Audio thread: give a result back to the background thread to free.
+	void handBack(Result* result) {
+		// the background thread empties this every pass and only builds while it's empty, so it's free
+		finished.store(result, std::memory_order_release);
+	}
+
+	void discard(Result* result) {
+		if (result == nullptr) return;
+		if (result->slab != nullptr) memory.release(result->slab);
+		delete result;
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (running) {
+			wake.wait_for(guard, std::chrono::milliseconds(20));
+			if (!running) break;
+
+			discard(finished.exchange(nullptr, std::memory_order_acquire));
+
+			double samplesPerBeat = requested.load(std::memory_order_relaxed);
+			if (samplesPerBeat == 0 || ready.load(std::memory_order_relaxed) != nullptr) continue;
+
+			guard.unlock();
+			Result* result = build(samplesPerBeat);
+			guard.lock();
+
+			if (result != nullptr) ready.store(result, std::memory_order_release);
+		}
+	}
+
+	// Stretch every recorded loop into a new slab. Null if the request or the loops changed along the way.
+	Result* build(double samplesPerBeat) {
+		std::lock_guard<std::mutex> guard(building);
+		if (requested.load(std::memory_order_relaxed) != samplesPerBeat) return nullptr;
+
+		std::unique_ptr<Result> result(new Result);
+		result->samplesPerBeat = samplesPerBeat;
+		result->takes = takes.load(std::memory_order_acquire);
+
+		int beatsPerLoop = source[0].getBeatsPerLoop();
+		size_t length = (size_t)std::ceil(samplesPerBeat * beatsPerLoop);
+		result->slab = memory.create(length);
+		const LoopMemory::Slab& slab = *result->slab;
+		int loopCount = std::min(this->loopCount.load(std::memory_order_relaxed), slab.numLoops);
+
+		struct Job {
+			int loop;
+			int channel;
+		};
+		std::vector<Job> jobs;
+		for (int i = 0; i < loopCount; i++) {
+			result->silent[i] = source[i].isSilent() || source[i].getNumChannels() != slab.numChannels;
+			if (result->silent[i]) continue;
+			for (int channel = 0; channel < slab.numChannels; channel++) {
+				jobs.push_back({ i, channel });
+			}
+		}
+
+		// grain positions come from a mono mix, so every channel of a loop moves together
+		std::vector<TimeStretch::Plan> plans(loopCount);
+		auto cancelled = [&] { return requested.load(std::memory_order_relaxed) != samplesPerBeat; };
+
+		parallelFor(loopCount, [&](int i) {
+			if (result->silent[i] || cancelled()) return;
+			const Loop<float>& loop = source[i];
+			std::vector<float> mono(loop.getSize(), 0.f);
+			std::vector<float> scratch;
+			for (int channel = 0; channel < loop.getNumChannels(); channel++) {
+				const float* in = loop.readChannel(channel, scratch);
+				for (size_t n = 0; n < mono.size(); n++) mono[n] += in[n];
+			}
+			plans[i] = TimeStretch::plan(mono.data(), mono.size(), length);
+		});
+
+		parallelFor((int)jobs.size(), [&](int j) {
+			if (cancelled()) return;
+			const Job& job = jobs[j];
+			std::vector<float> scratch;
+			std::vector<float> out(length);
+			TimeStretch::render(plans[job.loop], source[job.loop].readChannel(job.channel, scratch), out.data());
+			size_t valueBytes = slab.valueBytes();
+			SampleConversion::encode(slab.format, out.data(), slab.getData(job.loop) + job.channel * length * valueBytes, length);
+
+			// the stretched loop wraps seamlessly, so its own tail is the right lead-in for the crossfade
+			size_t count = std::min(length, (size_t)MAX_FADE_SAMPLES);
+			uint8_t* preLoop = slab.getPreLoop(job.loop) + (job.channel * MAX_FADE_SAMPLES + MAX_FADE_SAMPLES - count) * valueBytes;
+			SampleConversion::encode(slab.format, out.data() + length - count, preLoop, count);
+		});
+
+		// a take landing mid-stretch may have been read half old, half new
+		if (cancelled() || takes.load(std::memory_order_acquire) != result->takes) {
+			discard(result.release());
+			return nullptr;
+		}
+		return result.release();
+	}
+
+	LoopMemory& memory;
+	const Loop<float>* const source;
+
+	std::atomic<double> requested { 0 };
+	std::atomic<uint32_t> takes { 0 };
+	std::atomic<int> loopCount { defaultLoopCount };
+	std::atomic<Result*> ready { nullptr };		// built, waiting for the audio thread
+	std::atomic<Result*> finished { nullptr };	// accepted or stale, waiting to be freed
+
+	std::mutex building;	// held while the source loops are being read
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread worker;
+	bool running = true;
+};
\ No newline at end of file
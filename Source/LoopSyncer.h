@@ -1,43 +1,135 @@
 #pragma once
 
 #include "Constants.h"
-#include <utility>
-#include <functional>
+#include "CommandMailbox.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
 
 #include <boost/interprocess/shared_memory_object.hpp>
-#include <boost/interprocess/managed_shared_memory.hpp>
-#include <boost/interprocess/allocators/allocator.hpp>
-#include <boost/interprocess/containers/map.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+	#include <intrin.h>
+#else
+	#include <signal.h>
+	#include <unistd.h>
+	#include <cerrno>
+	#ifdef __APPLE__
+		#include <sys/sysctl.h>
+	#endif
+#endif
 
 namespace bip = boost::interprocess;
 
-struct LooperUpdate {
-	LooperUpdate() {
-		std::fill_n(volume, nLoops, 1.f);
-	}
+/*
+* One message from an instance to the others. Trivially copyable so it can sit in shared memory.
+*/
+struct LooperCommand {
+	enum Type : uint8_t {
+		startRecord,
+		stopRecord,
+		loopVolume
+	};
+
+	Type type;
+	int8_t loopIndex;
+	float volume;
+};
+
+/*
+* Everything the instances share, mapped straight into every process. The memory is only ever touched
+* through atomics, so no lock is held across processes and a crash can't leave one stuck.
+*
+* Each instance claims a slot when it starts and only ever reads its own mailbox; every other instance
+* pushes into it. Claimed and active slots are tracked in bitmasks, so joining, leaving and finding the
+* instances to broadcast to never scan the table. Each slot records its owner's PID next to a generation
+* in one word, so slots left behind by a crashed host can be found and reclaimed with a single
+* compare-and-swap that can't take a slot from an instance that claimed it in the meantime. The slot also
+* keeps when the owner's process started, so a slot whose PID has since gone to another process is still
+* found to be dead.
+*
+* The latest volumes are kept alongside so a new instance, or one that had commands dropped, can catch up
+* without replaying history. Slots also announce the slab of loop memory their instance shares, see LoopSharer.
+*/
+struct LooperSharedState {
+	static constexpr uint32_t magic = 0x4c4f4f50;		// "LOOP"
+	static constexpr uint32_t layoutVersion = 7;		// bump whenever this struct changes
+	static constexpr int maxInstances = 64;
+	static constexpr uint32_t mailboxSize = 64;
+
+	struct Slot {
+		std::atomic<uint64_t> owner;		// generation << 32 | pid, with pid 0 while the slot is changing hands
+		std::atomic<uint64_t> started;		// the owner's processStartTime, written before it takes the slot
+		std::atomic<uint64_t> slab;		// file number of the slab the owner shares its loops from, 0 for none
+		CommandMailbox<LooperCommand, mailboxSize> mailbox;
+	};
+
+	enum InitState : uint32_t {
+		uninitialised,		// what a freshly created, zero filled segment reads as
+		initialising,
+		ready
+	};
+
+	std::atomic<uint32_t> initState;
+	uint32_t segmentMagic;
+	uint32_t segmentVersion;
+	uint32_t segmentSize;
 
-	LooperUpdate(const LooperUpdate& u) :
-		startRecord(u.startRecord), stopRecord(u.stopRecord), hasUpdate(u.hasUpdate) 
-	{
-		for (int i = 0; i < nLoops; i++) {
-			volume[i] = u.volume[i];
+	std::atomic<uint64_t> claimedMask;	// slots that have an owner, or are being set up for one
+	std::atomic<uint64_t> activeMask;	// slots whose mailbox is ready to receive
+	std::atomic<float> volumes[maxLoops];
+	Slot slots[maxInstances];
+
+	/*
+	* Set the segment up if nobody has yet, otherwise wait for whoever is doing it.
+	* @return False if the segment was laid out by an incompatible build.
+	*/
+	bool attach() {
+		static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory needs address-free atomics");
+
+		uint32_t expected = uninitialised;
+		if (initState.compare_exchange_strong(expected, initialising, std::memory_order_acquire)) {
+			initialise();
+		} else {
+			// the creator only stores a handful of fields, so if it hasn't finished by now it died part way
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+			while (initState.load(std::memory_order_acquire) != ready) {
+				if (std::chrono::steady_clock::now() > deadline) {
+					initialise();
+					break;
+				}
+				std::this_thread::yield();
+			}
 		}
-	}
 
-	float volume[nLoops];
-	int8_t startRecord = -1;
-	bool stopRecord = false;
-	bool hasUpdate = false;
+		return segmentMagic == magic && segmentVersion == layoutVersion && segmentSize == sizeof(LooperSharedState);
+	}
 
-	void clear() {
-		startRecord = -1;
-		stopRecord = false;
-		hasUpdate = false;
+private:
+	void initialise() {
+		segmentMagic = magic;
+		segmentVersion = layoutVersion;
+		segmentSize = sizeof(LooperSharedState);
+		claimedMask.store(0, std::memory_order_relaxed);
+		activeMask.store(0, std::memory_order_relaxed);
+		for (int i = 0; i < maxLoops; i++) {
+			volumes[i].store(1.f, std::memory_order_relaxed);
+		}
+		initState.store(ready, std::memory_order_release);
 	}
 };
-typedef std::pair<void* const, LooperUpdate> SharedMapEntry;
-typedef bip::allocator<SharedMapEntry, bip::managed_shared_memory::segment_manager> SharedAllocator;
-typedef bip::map<void*, LooperUpdate, std::less<void*>, SharedAllocator> SharedMap;
 
 class LoopSyncer {
 public:
@@ -49,77 +141,359 @@ public:
 		virtual void setLoopVolume(int loopIndex, float volume) = 0;
 	};
 
-	LoopSyncer(MessageListener* listener) : listener(listener), shm(bip::open_or_create, MEM_NAME, 8192) {
-		using namespace boost::interprocess;
+	LoopSyncer(MessageListener* listener) : listener(listener) {
+		std::string name = "LOOPER_SYNC_V" + std::to_string(LooperSharedState::layoutVersion);
+		AttachLock attaching(name);
+		memory = bip::shared_memory_object(bip::open_or_create, name.c_str(), bip::read_write);
 
-		sharedMap = shm.find_or_construct<SharedMap>("SHARED_MAP")(SharedAllocator(shm.get_segment_manager()));
-		
-		if (sharedMap->size() > 0) {
-			auto existingState = LooperUpdate(sharedMap->begin()->second);
-			sharedMap->emplace(this, existingState);
-			sharedMap->at(this).hasUpdate = true;
-			handleUpdates();
-		} else {
-			sharedMap->emplace(this, LooperUpdate());
+		bip::offset_t size = 0;
+		if (!memory.get_size(size) || size < (bip::offset_t)sizeof(LooperSharedState)) {
+			memory.truncate(sizeof(LooperSharedState));
+		}
+		region = bip::mapped_region(memory, bip::read_write);
+
+		// with an incompatible segment, or every slot taken, this instance still works, it just doesn't sync
+		auto* state = static_cast<LooperSharedState*>(region.get_address());
+		if (!state->attach()) return;
+		shared = state;
+
+		reclaimDeadSlots();
+		bool othersRunning = shared->activeMask.load(std::memory_order_acquire) != 0;
+		if (join() && othersRunning) {
+			applySharedVolumes();
 		}
 	}
 
 	~LoopSyncer() {
-		sharedMap->erase(this);
+		if (shared == nullptr) return;
 
-		if (sharedMap->size() == 0) {
-			bip::shared_memory_object::remove(MEM_NAME);
+		// an instance on its way in holds the lock until it has claimed a slot, so an empty table under
+		// the lock means nobody else is using the segment, crashed hosts' slots aside
+		AttachLock detaching(memory.get_name());
+		leave();
+		reclaimDeadSlots();
+		if (shared->claimedMask.load(std::memory_order_acquire) == 0) {
+			bip::shared_memory_object::remove(memory.get_name());
 		}
 	}
 
+	/*
+	* Apply every command other instances have sent since the last call, and show them the slab from
+	* announceSlab. Wait-free, so it's safe on the audio thread: it only touches this instance's own slot.
+	*/
 	void handleUpdates() {
-		LooperUpdate& entry = sharedMap->at(this);
-		if (!entry.hasUpdate) return;
+		if (shared == nullptr) return;
 
-		for (int i = 0; i < nLoops; i++) {
-			listener->setLoopVolume(i, entry.volume[i]);
+		// only a dead process's slot is ever reclaimed, but rejoin rather than trust a slot that changed hands
+		if (slotIndex == -1 || !ownsSlot()) {
+			slotIndex = -1;
+			if (!join()) return;
+			applySharedVolumes();
 		}
 
-		if (entry.startRecord != -1) {
-			listener->startRecordLoop(entry.startRecord);
-		}
+		auto& slot = shared->slots[slotIndex];
+		uint64_t slab = sharedSlab.load(std::memory_order_relaxed);
+		if (slot.slab.load(std::memory_order_relaxed) != slab) slot.slab.store(slab, std::memory_order_release);
 
-		if (entry.stopRecord) {
-			listener->stopRecordLoop();
+		// volumes are state rather than events, so if any command was dropped just catch up on all of them
+		uint32_t dropped = slot.mailbox.getDroppedCount();
+		if (dropped != seenDropped) {
+			seenDropped = dropped;
+			applySharedVolumes();
 		}
 
-		entry.clear();
+		LooperCommand command;
+		while (slot.mailbox.pop(command)) {
+			switch (command.type) {
+			case LooperCommand::startRecord:
+				listener->startRecordLoop(command.loopIndex);
+				break;
+			case LooperCommand::stopRecord:
+				listener->stopRecordLoop();
+				break;
+			case LooperCommand::loopVolume:
+				listener->setLoopVolume(command.loopIndex, command.volume);
+				break;
+			}
+		}
 	}
 
 	void broadcastStartRecord(int loopIndex) {
-		for (auto& [key, entry] : *sharedMap) {
-			if (key == this) continue;
+		broadcast({ LooperCommand::startRecord, (int8_t)loopIndex, 0.f });
+	}
+
+	void broadcastStopRecord() {
+		broadcast({ LooperCommand::stopRecord, -1, 0.f });
+	}
+
+	void broadcastLoopVolume(int loopIndex, float volume) {
+		if (shared != nullptr) shared->volumes[loopIndex].store(volume, std::memory_order_relaxed);
+		broadcast({ LooperCommand::loopVolume, (int8_t)loopIndex, volume });
+	}
+
+	/*
+	* Tell other instances which slab this one shares its loops from, see LoopMemory::fileName, or 0 to stop
+	* sharing. Any thread; the next handleUpdates puts it in this instance's slot, and keeps it across rejoins.
+	*/
+	void announceSlab(uint64_t fileNumber) {
+		sharedSlab.store(fileNumber, std::memory_order_relaxed);
+	}
 
-			entry.startRecord = loopIndex;
-			entry.hasUpdate = true;
+	/*
+	* Find the slab another instance is sharing its loops from. The first sharing instance wins.
+	* @param pid Set to the sharing instance's process.
+	* @param fileNumber Set to the slab's file number.
+	* @return False if no other instance is sharing.
+	*/
+	bool findSharedSlab(uint32_t& pid, uint64_t& fileNumber) const {
+		if (shared == nullptr) return false;
+
+		uint64_t active = shared->activeMask.load(std::memory_order_acquire);
+		if (slotIndex != -1) active &= ~bit(slotIndex);
+
+		while (active != 0) {
+			int index = lowestBit(active);
+			active &= active - 1;
+
+			auto& other = shared->slots[index];
+			fileNumber = other.slab.load(std::memory_order_acquire);
+			if (fileNumber == 0) continue;
+
+			pid = ownerPid(other.owner.load(std::memory_order_acquire));
+			return true;
 		}
+
+		return false;
 	}
 
-	void broadcastStopRecord() {
-		for (auto& [key, entry] : *sharedMap) {
-			if (key == this) continue;
+	int getSlotIndex() const {
+		return slotIndex;
+	}
+
+	static uint32_t currentProcessId() {
+#ifdef _WIN32
+		return (uint32_t)GetCurrentProcessId();
+#else
+		return (uint32_t)getpid();
+#endif
+	}
+
+	// Whether a process is still running.
+	static bool isProcessAlive(uint32_t pid) {
+		if (pid == currentProcessId()) return true;
+#ifdef _WIN32
+		HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+		if (process == nullptr) return false;
+		bool running = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+		CloseHandle(process);
+		return running;
+#else
+		return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+#endif
+	}
 
-			entry.stopRecord = true;
-			entry.hasUpdate = true;
+	/*
+	* When a process started, in the platform's own units, to tell it apart from a later process given the
+	* same PID. Reads the process table, so never on the audio thread.
+	* @return 0 if the process isn't running or can't be looked at.
+	*/
+	static uint64_t processStartTime(uint32_t pid) {
+#ifdef _WIN32
+		HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+		if (process == nullptr) return 0;
+		FILETIME created, exited, kernel, user;
+		bool known = GetProcessTimes(process, &created, &exited, &kernel, &user) != 0;
+		CloseHandle(process);
+		return known ? ((uint64_t)created.dwHighDateTime << 32) | created.dwLowDateTime : 0;
+#elif defined(__APPLE__)
+		int name[] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, (int)pid };
+		struct kinfo_proc info {};
+		size_t size = sizeof(info);
+		if (sysctl(name, 4, &info, &size, nullptr, 0) != 0 || size == 0) return 0;
+		return (uint64_t)info.kp_proc.p_starttime.tv_sec * 1000000 + (uint64_t)info.kp_proc.p_starttime.tv_usec;
+#else
+		// field 22 of /proc/pid/stat, counting on from the command name, which is in parentheses and may hold spaces
+		std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+		std::string line;
+		if (!std::getline(file, line)) return 0;
+		size_t name = line.rfind(')');
+		if (name == std::string::npos) return 0;
+		std::istringstream fields(line.substr(name + 1));
+		std::string skipped;
+		for (int field = 3; field < 22; field++) fields >> skipped;
+		uint64_t started = 0;
+		return fields >> started ? started : 0;
+#endif
+	}
+
+private:
+	/*
+	* Held while opening and attaching to the segment, or detaching and removing it, so the last instance
+	* out can't remove the segment from under one on its way in. A file lock, so a crashed process never
+	* leaves it held, plus a mutex because file locks don't keep out other threads of the same process.
+	*/
+	class AttachLock {
+	public:
+		AttachLock(const std::string& name) : guard(processLock()) {
+			try {
+				auto path = std::filesystem::temp_directory_path() / (name + ".lock");
+				std::ofstream(path, std::ios::app).close();		// file_lock needs the file to exist
+				lock = bip::file_lock(path.string().c_str());
+				lock.lock();
+				locked = true;
+			} catch (const std::exception&) {
+				// nowhere to put the lock file; carry on, as the only risk is losing sync
+			}
+		}
+
+		~AttachLock() {
+			if (locked) lock.unlock();
 		}
+
+	private:
+		static std::mutex& processLock() {
+			static std::mutex mutex;
+			return mutex;
+		}
+
+		std::lock_guard<std::mutex> guard;
+		bip::file_lock lock;
+		bool locked = false;
+	};
+
+	/*
+	* Claim the lowest free slot and open its mailbox. Lock-free and a bounded amount of work, so it's
+	* also used to rejoin from the audio thread.
+	* @return False if every slot is taken.
+	*/
+	bool join() {
+		uint64_t claimed = shared->claimedMask.load(std::memory_order_relaxed);
+		int index;
+		do {
+			if (~claimed == 0) return false;
+			index = lowestBit(~claimed);
+		} while (!shared->claimedMask.compare_exchange_weak(claimed, claimed | bit(index), std::memory_order_acquire));
+
+		// the new generation and PID go in together, so a reclaimDeadSlots that read the old owner can't take
+		// the slot from this one
+		auto& slot = shared->slots[index];
+		slot.started.store(startTime, std::memory_order_relaxed);
+		uint64_t owner = slot.owner.load(std::memory_order_relaxed);
+		do {
+			generation = ownerGeneration(owner) + 1;
+		} while (!slot.owner.compare_exchange_weak(owner, packOwner(generation, currentProcessId()), std::memory_order_acq_rel));
+		slot.mailbox.reset();
+		slot.slab.store(sharedSlab.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		seenDropped = 0;
+
+		shared->activeMask.fetch_or(bit(index), std::memory_order_release);
+		slotIndex = index;
+		return true;
 	}
 
-	void broadcastLoopVolume(int loopIndex, float volume) {
-		for (auto& [key, entry] : *sharedMap) {
-			entry.volume[loopIndex] = volume;
-			entry.hasUpdate = key != this;
+	void leave() {
+		if (slotIndex == -1 || !ownsSlot()) return;
+
+		// mark the slot as changing hands first, so reclaimDeadSlots leaves it alone until the bits are clear
+		uint64_t owner = packOwner(generation, currentProcessId());
+		if (!shared->slots[slotIndex].owner.compare_exchange_strong(owner, packOwner(generation, 0), std::memory_order_acq_rel)) return;
+
+		shared->activeMask.fetch_and(~bit(slotIndex), std::memory_order_release);
+		shared->claimedMask.fetch_and(~bit(slotIndex), std::memory_order_release);
+		slotIndex = -1;
+	}
+
+	bool ownsSlot() const {
+		auto& slot = shared->slots[slotIndex];
+		return (shared->activeMask.load(std::memory_order_acquire) & bit(slotIndex)) != 0
+			&& ownerGeneration(slot.owner.load(std::memory_order_acquire)) == generation;
+	}
+
+	/*
+	* Free the slots of instances whose process has gone, or whose PID now belongs to a process that started
+	* after the slot was claimed. A live process keeps its slots however long it goes without processing,
+	* e.g. while its track is suspended. A slot whose PID is 0 is being joined or left right now and is skipped.
+	* Where a process's start time can't be read, e.g. another user's on some systems, the PID alone decides,
+	* and a slot whose PID was reused stays claimed until that process exits too.
+	*/
+	void reclaimDeadSlots() {
+		uint64_t claimed = shared->claimedMask.load(std::memory_order_acquire);
+
+		while (claimed != 0) {
+			int index = lowestBit(claimed);
+			claimed &= claimed - 1;
+
+			auto& slot = shared->slots[index];
+			uint64_t owner = slot.owner.load(std::memory_order_acquire);
+			uint32_t pid = ownerPid(owner);
+			if (pid == 0 || isOwnerAlive(pid, slot.started.load(std::memory_order_relaxed))) continue;
+
+			// moving the generation on is what takes the slot: if it changed hands since it was read the CAS
+			// fails and the new owner keeps it, and of two instances reclaiming it only one goes on to free it
+			if (!slot.owner.compare_exchange_strong(owner, packOwner(ownerGeneration(owner) + 1, 0), std::memory_order_acq_rel)) continue;
+
+			shared->activeMask.fetch_and(~bit(index), std::memory_order_release);
+			shared->claimedMask.fetch_and(~bit(index), std::memory_order_release);
 		}
 	}
 
-private:
-	const char* MEM_NAME = "LOOPER_MEM";
+	static bool isOwnerAlive(uint32_t pid, uint64_t started) {
+		if (!isProcessAlive(pid)) return false;
+		uint64_t running = started != 0 ? processStartTime(pid) : 0;
+		return running == 0 || running == started;
+	}
+
+	// Push into every other active mailbox. Only visits slots that are in use.
+	void broadcast(const LooperCommand& command) {
+		if (shared == nullptr || slotIndex == -1) return;
+
+		uint64_t targets = shared->activeMask.load(std::memory_order_acquire) & ~bit(slotIndex);
+		while (targets != 0) {
+			int index = lowestBit(targets);
+			targets &= targets - 1;
+			shared->slots[index].mailbox.push(command);
+		}
+	}
+
+	void applySharedVolumes() {
+		for (int i = 0; i < maxLoops; i++) {
+			listener->setLoopVolume(i, shared->volumes[i].load(std::memory_order_relaxed));
+		}
+	}
+
+	static uint64_t packOwner(uint32_t generation, uint32_t pid) {
+		return ((uint64_t)generation << 32) | pid;
+	}
+
+	static uint32_t ownerGeneration(uint64_t owner) {
+		return (uint32_t)(owner >> 32);
+	}
+
+	static uint32_t ownerPid(uint64_t owner) {
+		return (uint32_t)owner;
+	}
+
+	static uint64_t bit(int index) {
+		return (uint64_t)1 << index;
+	}
+
+	static int lowestBit(uint64_t mask) {
+#ifdef _WIN32
+		unsigned long index;
+		_BitScanForward64(&index, mask);
+		return (int)index;
+#else
+		return __builtin_ctzll(mask);
+#endif
+	}
 
 	MessageListener* listener;
-	SharedMap* sharedMap;
-	bip::managed_shared_memory shm;
-};
+	bip::shared_memory_object memory;
+	bip::mapped_region region;
+	LooperSharedState* shared = nullptr;
+	int slotIndex = -1;
+	uint32_t generation = 0;
+	uint32_t seenDropped = 0;
+	const uint64_t startTime = processStartTime(currentProcessId());	// for join, which may run on the audio thread
+	std::atomic<uint64_t> sharedSlab { 0 };	// what announceSlab was last given
+};
\ No newline at end of file
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define LOOPER_SSE 1
+	#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define LOOPER_NEON 1
+	#include <arm_neon.h>
+#endif
+
+/*
+* Vectorized inner loops for mixing loop audio into an output buffer.
+* Gains ramp linearly across a call so volume changes between blocks don't zipper;
+* pass gainStep = 0 for a constant gain.
+* Overloads taking a Levels also meter the signal being mixed (before the ramp) in the same pass,
+* so the loop memory is only walked once per block.
+*/
+namespace MixKernel {
+
+	/*
+	* Running peak and sum of squares of a signal, accumulated across calls.
+	*/
+	struct Levels {
+		float sumOfSquares = 0.f;
+		float peak = 0.f;
+
+		void add(float value) {
+			sumOfSquares += value * value;
+			peak = std::max(peak, std::abs(value));
+		}
+	};
+
+	namespace detail {
+
+#if LOOPER_SSE
+		struct VectorLevels {
+			__m128 sums = _mm_setzero_ps();
+			__m128 peaks = _mm_setzero_ps();
+
+			void add(__m128 value) {
+				sums = _mm_add_ps(sums, _mm_mul_ps(value, value));
+				peaks = _mm_max_ps(peaks, _mm_andnot_ps(_mm_set1_ps(-0.f), value));
+			}
+
+			void reduceInto(Levels& levels) const {
+				float lanes[4];
+				_mm_storeu_ps(lanes, sums);
+				levels.sumOfSquares += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+				_mm_storeu_ps(lanes, peaks);
+				levels.peak = std::max({ levels.peak, lanes[0], lanes[1], lanes[2], lanes[3] });
+			}
+		};
+
+		inline __m128 rampStart(float gain, float gainStep) {
+			return _mm_add_ps(_mm_set1_ps(gain), _mm_mul_ps(_mm_set1_ps(gainStep), _mm_setr_ps(0.f, 1.f, 2.f, 3.f)));
+		}
+#elif LOOPER_NEON
+		struct VectorLevels {
+			float32x4_t sums = vdupq_n_f32(0.f);
+			float32x4_t peaks = vdupq_n_f32(0.f);
+
+			void add(float32x4_t value) {
+				sums = vmlaq_f32(sums, value, value);
+				peaks = vmaxq_f32(peaks, vabsq_f32(value));
+			}
+
+			void reduceInto(Levels& levels) const {
+				float lanes[4];
+				vst1q_f32(lanes, sums);
+				levels.sumOfSquares += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+				vst1q_f32(lanes, peaks);
+				levels.peak = std::max({ levels.peak, lanes[0], lanes[1], lanes[2], lanes[3] });
+			}
+		};
+
+		inline float32x4_t rampStart(float gain, float gainStep) {
+			const float offsets[4] = { 0.f, 1.f, 2.f, 3.f };
+			return vmlaq_n_f32(vdupq_n_f32(gain), vld1q_f32(offsets), gainStep);
+		}
+#endif
+
+		// Metered is a template parameter so the plain kernels carry no metering cost at all
+		template <bool Metered>
+		inline void addWithRamp(float* dest, const float* src, size_t count, float gain, float gainStep, Levels* levels) {
+			size_t i = 0;
+
+#if LOOPER_SSE
+			VectorLevels vectorLevels;
+			__m128 gains = rampStart(gain, gainStep);
+			const __m128 step = _mm_set1_ps(gainStep * 4.f);
+			for (; i + 4 <= count; i += 4) {
+				__m128 value = _mm_loadu_ps(src + i);
+				if (Metered) vectorLevels.add(value);
+				_mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i), _mm_mul_ps(gains, value)));
+				gains = _mm_add_ps(gains, step);
+			}
+			if (Metered) vectorLevels.reduceInto(*levels);
+#elif LOOPER_NEON
+			VectorLevels vectorLevels;
+			float32x4_t gains = rampStart(gain, gainStep);
+			const float32x4_t step = vdupq_n_f32(gainStep * 4.f);
+			for (; i + 4 <= count; i += 4) {
+				float32x4_t value = vld1q_f32(src + i);
+				if (Metered) vectorLevels.add(value);
+				vst1q_f32(dest + i, vmlaq_f32(vld1q_f32(dest + i), gains, value));
+				gains = vaddq_f32(gains, step);
+			}
+			if (Metered) vectorLevels.reduceInto(*levels);
+#endif
+
+			for (; i < count; i++) {
+				if (Metered) levels->add(src[i]);
+				dest[i] += (gain + i * gainStep) * src[i];
+			}
+		}
+
+		template <bool Metered>
+		inline void scaleWithRamp(float* dest, size_t count, float gain, float gainStep, Levels* levels) {
+			size_t i = 0;
+
+#if LOOPER_SSE
+			VectorLevels vectorLevels;
+			__m128 gains = rampStart(gain, gainStep);
+			const __m128 step = _mm_set1_ps(gainStep * 4.f);
+			for (; i + 4 <= count; i += 4) {
+				__m128 value = _mm_loadu_ps(dest + i);
+				if (Metered) vectorLevels.add(value);
+				_mm_storeu_ps(dest + i, _mm_mul_ps(gains, value));
+				gains = _mm_add_ps(gains, step);
+			}
+			if (Metered) vectorLevels.reduceInto(*levels);
+#elif LOOPER_NEON
+			VectorLevels vectorLevels;
+			float32x4_t gains = rampStart(gain, gainStep);
+			const float32x4_t step = vdupq_n_f32(gainStep * 4.f);
+			for (; i + 4 <= count; i += 4) {
+				float32x4_t value = vld1q_f32(dest + i);
+				if (Metered) vectorLevels.add(value);
+				vst1q_f32(dest + i, vmulq_f32(gains, value));
+				gains = vaddq_f32(gains, step);
+			}
+			if (Metered) vectorLevels.reduceInto(*levels);
+#endif
+
+			for (; i < count; i++) {
+				if (Metered) levels->add(dest[i]);
+				dest[i] *= gain + i * gainStep;
+			}
+		}
+
+		template <bool Metered>
+		inline void addCrossfadeWithRamp(float* dest, const float* a, const float* b, const float* gainA, const float* gainB, size_t count, float gain, float gainStep, Levels* levels) {
+			size_t i = 0;
+
+#if LOOPER_SSE
+			VectorLevels vectorLevels;
+			__m128 gains = rampStart(gain, gainStep);
+			const __m128 step = _mm_set1_ps(gainStep * 4.f);
+			for (; i + 4 <= count; i += 4) {
+				__m128 value = _mm_add_ps(
+					_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(gainA + i)),
+					_mm_mul_ps(_mm_loadu_ps(b + i), _mm_loadu_ps(gainB + i))
+				);
+				if (Metered) vectorLevels.add(value);
+				_mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i), _mm_mul_ps(gains, value)));
+				gains = _mm_add_ps(gains, step);
+			}
+			if (Metered) vectorLevels.reduceInto(*levels);
+#elif LOOPER_NEON
+			VectorLevels vectorLevels;
+			float32x4_t gains = rampStart(gain, gainStep);
+			const float32x4_t step = vdupq_n_f32(gainStep * 4.f);
+			for (; i + 4 <= count; i += 4) {
+				float32x4_t value = vmlaq_f32(vmulq_f32(vld1q_f32(a + i), vld1q_f32(gainA + i)), vld1q_f32(b + i), vld1q_f32(gainB + i));
+				if (Metered) vectorLevels.add(value);
+				vst1q_f32(dest + i, vmlaq_f32(vld1q_f32(dest + i), gains, value));
+				gains = vaddq_f32(gains, step);
+			}
+			if (Metered) vectorLevels.reduceInto(*levels);
+#endif
+
+			for (; i < count; i++) {
+				float value = a[i] * gainA[i] + b[i] * gainB[i];
+				if (Metered) levels->add(value);
+				dest[i] += (gain + i * gainStep) * value;
+			}
+		}
+
+	}
+
+	/*
+	* dest[i] += (gain + i * gainStep) * src[i]
+	* @param dest Buffer to accumulate into.
+	* @param src Values to add.
+	* @param count Number of values.
+	* @param gain Gain applied to the first value.
+	* @param gainStep Gain increment per value.
+	*/
+	inline void addWithRamp(float* dest, const float* src, size_t count, float gain, float gainStep) {
+		detail::addWithRamp<false>(dest, src, count, gain, gainStep, nullptr);
+	}
+
+	// As above, also metering src into levels.
+	inline void addWithRamp(float* dest, const float* src, size_t count, float gain, float gainStep, Levels& levels) {
+		detail::addWithRamp<true>(dest, src, count, gain, gainStep, &levels);
+	}
+
+	/*
+	* dest[i] *= (gain + i * gainStep)
+	* @param dest Buffer to scale in place.
+	* @param count Number of values.
+	* @param gain Gain applied to the first value.
+	* @param gainStep Gain increment per value.
+	*/
+	inline void scaleWithRamp(float* dest, size_t count, float gain, float gainStep) {
+		detail::scaleWithRamp<false>(dest, count, gain, gainStep, nullptr);
+	}
+
+	// As above, also metering dest into levels before it is scaled.
+	inline void scaleWithRamp(float* dest, size_t count, float gain, float gainStep, Levels& levels) {
+		detail::scaleWithRamp<true>(dest, count, gain, gainStep, &levels);
+	}
+
+	/*
+	* dest[i] = a[i] * gainA[i] + b[i] * gainB[i]
+	* @param dest Buffer to write into.
+	* @param a First source.
+	* @param b Second source.
+	* @param gainA Per-value gains for a, such as a fade table.
+	* @param gainB Per-value gains for b.
+	* @param count Number of values.
+	*/
+	inline void crossfade(float* dest, const float* a, const float* b, const float* gainA, const float* gainB, size_t count) {
+		size_t i = 0;
+
+#if LOOPER_SSE
+		for (; i + 4 <= count; i += 4) {
+			__m128 value = _mm_add_ps(
+				_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(gainA + i)),
+				_mm_mul_ps(_mm_loadu_ps(b + i), _mm_loadu_ps(gainB + i))
+			);
+			_mm_storeu_ps(dest + i, value);
+		}
+#elif LOOPER_NEON
+		for (; i + 4 <= count; i += 4) {
+			float32x4_t value = vmlaq_f32(vmulq_f32(vld1q_f32(a + i), vld1q_f32(gainA + i)), vld1q_f32(b + i), vld1q_f32(gainB + i));
+			vst1q_f32(dest + i, value);
+		}
+#endif
+
+		for (; i < count; i++) {
+			dest[i] = a[i] * gainA[i] + b[i] * gainB[i];
+		}
+	}
+
+	/*
+	* dest[i] += (gain + i * gainStep) * (a[i] * gainA[i] + b[i] * gainB[i])
+	* @param dest Buffer to accumulate into.
+	* @param a First source.
+	* @param b Second source.
+	* @param gainA Per-value gains for a, such as a fade table.
+	* @param gainB Per-value gains for b.
+	* @param count Number of values.
+	* @param gain Gain applied to the first value.
+	* @param gainStep Gain increment per value.
+	*/
+	inline void addCrossfadeWithRamp(float* dest, const float* a, const float* b, const float* gainA, const float* gainB, size_t count, float gain, float gainStep) {
+		detail::addCrossfadeWithRamp<false>(dest, a, b, gainA, gainB, count, gain, gainStep, nullptr);
+	}
+
+	// As above, also metering the crossfaded values into levels.
+	inline void addCrossfadeWithRamp(float* dest, const float* a, const float* b, const float* gainA, const float* gainB, size_t count, float gain, float gainStep, Levels& levels) {
+		detail::addCrossfadeWithRamp<true>(dest, a, b, gainA, gainB, count, gain, gainStep, &levels);
+	}
+
+	/*
+	* Meter a signal without writing anything.
+	* @param src Values to measure.
+	* @param count Number of values.
+	* @param levels Levels to accumulate into.
+	*/
+	inline void measure(const float* src, size_t count, Levels& levels) {
+		size_t i = 0;
+
+#if LOOPER_SSE || LOOPER_NEON
+		detail::VectorLevels vectorLevels;
+		for (; i + 4 <= count; i += 4) {
+	#if LOOPER_SSE
+			vectorLevels.add(_mm_loadu_ps(src + i));
+	#else
+			vectorLevels.add(vld1q_f32(src + i));
+	#endif
+		}
+		vectorLevels.reduceInto(levels);
+#endif
+
+		for (; i < count; i++) {
+			levels.add(src[i]);
+		}
+	}
+
+}
\ No newline at end of file
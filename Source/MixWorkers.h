@@ -0,0 +1,214 @@
+#pragma once
+
+#include "MixKernel.h"
+#include "Constants.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* A small pool of helper threads the audio thread can hand mixing work to, for sessions with enough loops
+* that one core can't keep up.
+*
+* run splits a chunk into jobs and the calling thread works through them alongside the helpers, so the
+* result never depends on a helper waking in time; a helper that's late simply finds nothing left to do.
+* The caller's jobs mix straight into its buffer and each helper's into a partial sum of its own, and the
+* partial sums are added in once every job is done.
+*
+* Jobs are claimed with a compare-and-swap on a single word that packs the dispatch generation, the job
+* count and the next job, so nothing takes a lock on the audio thread. Helpers spin for a short while
+* after each dispatch, since the next chunk usually follows within microseconds, and then park on a
+* condition variable. The audio thread only notifies it when a helper is parked, and a missed notify
+* just leaves that helper asleep until the next dispatch.
+*
+* The caller does wait for jobs a helper has already claimed, so helpers should not be starved of CPU by
+* lower priority work while audio is running.
+*/
+class MixWorkers {
+public:
+	~MixWorkers() {
+		stop();
+	}
+
+	/*
+	* Message thread, with the audio thread stopped: (re)start the pool.
+	* @param helperCount Threads besides the caller, capped at one less than the number of cores; 0 leaves
+	* the pool stopped.
+	* @param numChannels Channels in the buffers run mixes into.
+	* @param maxSamples The longest chunk run will be asked to mix.
+	*/
+	void start(int helperCount, int numChannels, int maxSamples) {
+		stop();
+
+		// more threads than cores would leave the caller waiting on helpers that were switched out mid-job
+		int cores = (int)std::thread::hardware_concurrency();
+		if (cores > 0) helperCount = std::min(helperCount, cores - 1);
+		if (helperCount <= 0) return;
+
+		channels = numChannels;
+		running = true;
+		for (int i = 0; i < helperCount; i++) {
+			auto helper = std::make_unique<Helper>();
+			helper->data.assign((size_t)numChannels * maxSamples, 0.f);
+			for (int channel = 0; channel < numChannels; channel++) {
+				helper->partial[channel] = helper->data.data() + (size_t)channel * maxSamples;
+			}
+			helpers.push_back(std::move(helper));
+		}
+		for (auto& helper : helpers) {
+			Helper* h = helper.get();
+			h->thread = std::thread([this, h] { work(*h); });
+		}
+	}
+
+	// Message thread, with the audio thread stopped.
+	void stop() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+		}
+		wake.notify_all();
+		for (auto& helper : helpers) helper->thread.join();
+		helpers.clear();
+	}
+
+	int getHelperCount() const {
+		return (int)helpers.size();
+	}
+
+	/*
+	* Audio thread: call mix(job, into) for every job and return once all of them are done, with their sum
+	* added into out. into is out itself for the jobs the caller takes and a cleared partial sum otherwise,
+	* so mix must only add to it. Jobs run concurrently and mustn't touch the same state.
+	* @param jobCount At most maxJobs.
+	* @param samples At most the maxSamples the pool was started with.
+	*/
+	template<typename Mix>
+	void run(int jobCount, float* const* out, int samples, Mix& mix) {
+		if (helpers.empty()) {
+			for (int job = 0; job < jobCount; job++) mix(job, out);
+			return;
+		}
+
+		context = &mix;
+		invoke = [](void* context, int job, float* const* into) { (*static_cast<Mix*>(context))(job, into); };
+		chunkSamples = samples;
+		if (++dispatched == 0) ++dispatched;	// 0 is what a helper that never ran holds
+		uint32_t generation = dispatched;
+		remaining.store(jobCount, std::memory_order_relaxed);
+		state.store(pack(generation, jobCount, 0), std::memory_order_seq_cst);
+		if (parked.load(std::memory_order_seq_cst) > 0) wake.notify_all();
+
+		int job;
+		while (claim(generation, job)) {
+			invoke(context, job, out);
+			remaining.fetch_sub(1, std::memory_order_acq_rel);
+		}
+		while (remaining.load(std::memory_order_acquire) != 0) pause();
+
+		for (auto& helper : helpers) {
+			if (helper->generation.load(std::memory_order_relaxed) != generation) continue;
+			for (int channel = 0; channel < channels; channel++) {
+				MixKernel::addWithRamp(out[channel], helper->partial[channel], (size_t)samples, 1.f, 0.f);
+			}
+		}
+	}
+
+	static constexpr int maxJobs = 0xffff;
+
+private:
+	struct Helper {
+		std::vector<float> data;
+		float* partial[maxChannels] = {};
+		std::atomic<uint32_t> generation { 0 };		// last dispatch this helper's partial sum holds
+		std::thread thread;
+	};
+
+	static uint64_t pack(uint32_t generation, int jobCount, int next) {
+		return ((uint64_t)generation << 32) | ((uint64_t)jobCount << 16) | (uint64_t)next;
+	}
+
+	static void pause() {
+#if LOOPER_SSE
+		_mm_pause();
+#endif
+	}
+
+	// Take the next job of a dispatch, if it's still the current one and has any left.
+	bool claim(uint32_t generation, int& job) {
+		uint64_t current = state.load(std::memory_order_acquire);
+		for (;;) {
+			int jobCount = (int)((current >> 16) & 0xffff);
+			int next = (int)(current & 0xffff);
+			if ((uint32_t)(current >> 32) != generation || next >= jobCount) return false;
+			if (state.compare_exchange_weak(current, current + 1, std::memory_order_acquire)) {
+				job = next;
+				return true;
+			}
+		}
+	}
+
+	void work(Helper& helper) {
+		uint32_t seen = 0;
+		auto spinUntil = std::chrono::steady_clock::now();
+
+		for (;;) {
+			uint32_t generation = (uint32_t)(state.load(std::memory_order_acquire) >> 32);
+			if (generation != seen) {
+				seen = generation;
+				int job;
+				while (claim(generation, job)) {
+					if (helper.generation.load(std::memory_order_relaxed) != generation) {
+						for (int channel = 0; channel < channels; channel++) {
+							std::fill_n(helper.partial[channel], chunkSamples, 0.f);
+						}
+						helper.generation.store(generation, std::memory_order_relaxed);
+					}
+					invoke(context, job, helper.partial);
+					remaining.fetch_sub(1, std::memory_order_acq_rel);
+				}
+				spinUntil = std::chrono::steady_clock::now() + spinTime;
+				continue;
+			}
+
+			if (std::chrono::steady_clock::now() < spinUntil) {
+				for (int i = 0; i < 64; i++) pause();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> guard(lock);
+			if (!running) return;
+			parked.fetch_add(1, std::memory_order_seq_cst);
+			if ((uint32_t)(state.load(std::memory_order_seq_cst) >> 32) == seen) {
+				wake.wait_for(guard, std::chrono::milliseconds(20));
+			}
+			parked.fetch_sub(1, std::memory_order_relaxed);
+			if (!running) return;
+		}
+	}
+
+	static constexpr std::chrono::microseconds spinTime { 200 };
+
+	std::vector<std::unique_ptr<Helper>> helpers;
+	int channels = 0;
+
+	// the current dispatch, written by the audio thread before it publishes state
+	void* context = nullptr;
+	void (*invoke)(void*, int, float* const*) = nullptr;
+	int chunkSamples = 0;
+	uint32_t dispatched = 0;
+
+	std::atomic<uint64_t> state { 0 };	// generation << 32 | job count << 16 | next job
+	std::atomic<int> remaining { 0 };	// jobs of the current dispatch not finished yet
+	std::atomic<int> parked { 0 };
+
+	std::mutex lock;
+	std::condition_variable wake;
+	bool running = false;
+};
\ No newline at end of file
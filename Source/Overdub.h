@@ -0,0 +1,140 @@
+#pragma once
+
+#include "Loop.h"
+#include "DirtyRanges.h"
+#include "MixKernel.h"
+#include <algorithm>
+#include <cassert>
+
+enum class RecordMode {
+	replace,	// takes record into the copy loop and replace the loop once a full pass is in
+	overdub		// takes are layered onto the loop in place
+};
+
+/*
+* Records on top of a loop in place. Every value the playhead passes while recording becomes
+* feedback * old + input, so takes build up in layers and older layers fade by feedback on each pass.
+* Unlike CopyLoop there's no second loop-sized buffer to swap in, and only the values actually recorded
+* over are touched; those are tracked in DirtyRanges.
+*
+* A silent loop has nothing to layer onto. Its values count as silence until they're written, and it
+* becomes audible once a full pass is in; stopping sooner leaves it silent, as stopping a CopyLoop take
+* before it commits does.
+*
+* The lead-in in the pre loop buffer gets the same treatment as the tail of the loop it mirrors, so the
+* crossfade at the wrap carries a new layer across instead of fading it out.
+*/
+template<typename T>
+class Overdub {
+public:
+	/*
+	* Audio thread: start layering onto a loop. Only touches the loop's audio if it's silent, and then
+	* only its lead-in and last value.
+	*/
+	void start(Loop<T>* target) {
+		this->target = target;
+		dirty.clear();
+		fresh = target->isSilent();
+		if (!fresh || target->getSize() == 0) return;
+
+		for (int channel = 0; channel < target->getNumChannels(); channel++) {
+			std::fill_n(target->getPreLoop(channel), MAX_FADE_SAMPLES, (T)0);
+			target->getChannel(channel)[target->getSize() - 1] = 0;	// passes a value short never write it
+		}
+	}
+
+	/*
+	* Audio thread: stop recording.
+	* @return Whether the loop now holds audio it didn't before.
+	*/
+	bool stop() {
+		bool changed = target != nullptr && !fresh && !dirty.isEmpty();
+		target = nullptr;
+		return changed;
+	}
+
+	bool isActive() const {
+		return target != nullptr;
+	}
+
+	/*
+	* Based on the current position of the playhead, layer the given buffer onto the loop.
+	* @param buffer One pointer per channel of values to record.
+	* @param position Location of the playhead within the loop.
+	* @param bufferSize Number of values to record per channel.
+	* @param feedback Gain applied to what the loop already held: 1 keeps every layer, 0 replaces them.
+	* @return Whether this block finished a pass over audio the loop already played, or made a silent
+	* loop audible.
+	*/
+	bool writeBuffer(const T* const* buffer, LoopPosition position, int bufferSize, T feedback) {
+		assert(target != nullptr);
+		assert((size_t)bufferSize <= position.length && position.length <= target->getSize());
+		size_t firstCount = std::min(position.length - position.sample, (size_t)bufferSize);
+
+		write(buffer, 0, position.sample, firstCount, position.length, feedback);
+		write(buffer, firstCount, 0, bufferSize - firstCount, position.length, feedback);
+
+		if (fresh && dirty.covers(0, target->getSize() - 1)) {
+			fresh = false;
+			target->setSilent(false);
+			return true;
+		}
+		return !fresh && position.sample + bufferSize >= position.length;
+	}
+
+	// What the current take has recorded over so far.
+	const DirtyRanges& getDirtyRanges() const {
+		return dirty;
+	}
+
+private:
+	// Layer count values, starting offset values into buffer, onto the loop from index on.
+	void write(const T* const* buffer, size_t offset, size_t index, size_t count, size_t length, T feedback) {
+		if (count == 0) return;
+
+		// the lead-in lines up with the last MAX_FADE_SAMPLES of the pass
+		size_t tailStart = length - std::min(length, (size_t)MAX_FADE_SAMPLES);
+		size_t preFrom = std::max(index, tailStart);
+
+		for (int channel = 0; channel < target->getNumChannels(); channel++) {
+			T* out = target->getChannel(channel);
+			const T* in = buffer[channel] + offset;
+
+			if (fresh) {
+				dirty.split(index, index + count, [&](size_t from, size_t to, bool written) {
+					if (written) {
+						layer(out + from, in + (from - index), to - from, feedback);
+					} else {
+						std::copy_n(in + (from - index), to - from, out + from);
+					}
+				});
+			} else {
+				layer(out + index, in, count, feedback);
+			}
+
+			// a fresh loop's lead-in was zeroed by start, so it can always be layered onto
+			if (preFrom < index + count) {
+				T* pre = target->getPreLoop(channel) + MAX_FADE_SAMPLES - (length - preFrom);
+				layer(pre, in + (preFrom - index), index + count - preFrom, feedback);
+			}
+		}
+
+		// joining ranges marks the gap between them as written; in a fresh take it holds whatever the loop's
+		// memory did, so make it the silence that written values are layered onto
+		dirty.add(index, index + count, [&](size_t from, size_t to) {
+			if (!fresh) return;
+			for (int channel = 0; channel < target->getNumChannels(); channel++) {
+				std::fill(target->getChannel(channel) + from, target->getChannel(channel) + to, (T)0);
+			}
+		});
+	}
+
+	static void layer(T* dest, const T* src, size_t count, T feedback) {
+		if (feedback != (T)1) MixKernel::scaleWithRamp(dest, count, feedback, (T)0);
+		MixKernel::addWithRamp(dest, src, count, (T)1, (T)0);
+	}
+
+	Loop<T>* target = nullptr;
+	DirtyRanges dirty;
+	bool fresh = false;		// the loop was silent when the take started and no full pass is in yet
+};
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/*
+* Run work(0) .. work(count - 1) across the machine's cores and wait for all of them. Spins up threads for
+* the call, so it's for one-off background jobs such as time stretching or loading, never the audio thread.
+*/
+template<typename Work>
+void parallelFor(int count, Work&& work) {
+	std::atomic<int> next { 0 };
+	auto drain = [&] {
+		for (int i = next++; i < count; i = next++) work(i);
+	};
+
+	int helpers = std::min(count, (int)std::thread::hardware_concurrency()) - 1;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < helpers; t++) threads.emplace_back(drain);
+	drain();
+	for (auto& thread : threads) thread.join();
+}
\ No newline at end of file
@@ -16,14 +16,11 @@ LooperAudioProcessorEditor::LooperAudioProcessorEditor (LooperAudioProcessor& p)
 
     using namespace juce;
 
-    for (int i = 0; i < nLoops; i++) {
-        setupSlider(
-            volumeSliders[i], monitorButtons[i], 
-            volumeSliderAttachments[i], monitorButtonAttachments[i], 
-            String(i + 1), labels[i]
-        );
-        addAndMakeVisible(meters[i]);
-    }
+    audioProcessor.addMeterViewer();
+
+    loopView.setViewedComponent(&loopStrip, false);
+    loopView.setScrollBarsShown(false, true);
+    addAndMakeVisible(loopView);
 
     addAndMakeVisible(inputMeter);
     muteInput.setButtonText("M");
@@ -40,19 +37,31 @@ LooperAudioProcessorEditor::LooperAudioProcessorEditor (LooperAudioProcessor& p)
         muteInput
     );
 
-    for (int i = 0; i < loopLenInBeats; i++) {
-        beatIndicators[i].setText("", dontSendNotification);
-        beatIndicators[i].setColour(Label::outlineColourId, Colours::whitesmoke);
-        addAndMakeVisible(beatIndicators[i]);
-    }
+    undoButton.setButtonText("Undo");
+    undoButton.onClick = [this] { audioProcessor.undo(); };
+    addAndMakeVisible(undoButton);
+    redoButton.setButtonText("Redo");
+    redoButton.onClick = [this] { audioProcessor.redo(); };
+    addAndMakeVisible(redoButton);
+    exportButton.setButtonText("Export");
+    exportButton.onClick = [this] { showExportMenu(); };
+    addAndMakeVisible(exportButton);
+    settingsButton.setButtonText("Setup");
+    settingsButton.onClick = [this] { showSettingsMenu(); };
+    addAndMakeVisible(settingsButton);
+
+    lastTick = Time::getMillisecondCounterHiRes();
+    startTimerHz(activeTimerHz);
 
-    startTimerHz(30);
 
+    setSize((defaultLoopCount-1)*loopWidth + 100 + 40 + loopsX, 410);
 
-    setSize((nLoops-1)*120 + 100 + 40 + loopsX, 410);
+    const auto& state = audioProcessor.getUIState();
+    setLoopLayout(state.loopCount, state.beatsPerLoop);
 }
 
 LooperAudioProcessorEditor::~LooperAudioProcessorEditor() {
+    audioProcessor.removeMeterViewer();
 }
 
 //==============================================================================
@@ -62,123 +71,359 @@ void LooperAudioProcessorEditor::paint (juce::Graphics& g) {
 }
 
 void LooperAudioProcessorEditor::resized() {
-    for (int i = 0; i < nLoops; i++) {
-        volumeSliders[i].setBounds(loopsX + 5 + 120 * i, 70, 100, 200);
-        labels[i].setBounds(loopsX + 40 + 120 * i, 20, 60, 40);
-        meters[i].setBounds(loopsX + 80 + 120 * i, 95, 15, 135);
-        monitorButtons[i].get()->setBounds(loopsX + 75 + 120 * i, 66, 25, 25);
+    loopView.setBounds(loopsX, 0, getWidth() - loopsX, 300);
+    loopStrip.setSize((int)loopControls.size() * loopWidth, loopView.getHeight() - 20);
+    for (int i = 0; i < (int)loopControls.size(); i++) {
+        auto& controls = *loopControls[i];
+        controls.volumeSlider.setBounds(5 + loopWidth * i, 70, 100, 200);
+        controls.label.setBounds(40 + loopWidth * i, 20, 60, 40);
+        controls.meter.setBounds(80 + loopWidth * i, 95, 15, 135);
+        controls.monitorButton->setBounds(75 + loopWidth * i, 66, 25, 25);
     }
 
     inputLabel.setBounds(10, 20, 60, 40);
     inputMeter.setBounds(32, 95, 15, 135);
     muteInput.setBounds(27, 66, 25, 25);
+    undoButton.setBounds(5, 236, 42, 20);
+    redoButton.setBounds(5, 258, 42, 20);
+    exportButton.setBounds(5, 280, 42, 20);
+    settingsButton.setBounds(5, 2, 42, 20);
+
+    if (beatIndicators.empty()) return;
+    int indSize = (getWidth() - 40) / (int)beatIndicators.size();
+    for (int i = 0; i < (int)beatIndicators.size(); i++) {
+        beatIndicators[i]->setBounds(20 + indSize * i, 310, indSize - 4, 80);
+    }
+}
+
+void LooperAudioProcessorEditor::setLoopLayout(int loopCount, int beatsPerLoop) {
+    using namespace juce;
 
-    int indSize = (getWidth() - 40) / loopLenInBeats;
-    for (int i = 0; i < loopLenInBeats; i++) {
-        beatIndicators[i].setBounds(20 + indSize * i, 310, indSize - 4, 80);
+    if (loopCount != (int)loopControls.size()) {
+        // the old columns go first so their attachments let go of the parameters
+        loopControls.clear();
+        for (int i = 0; i < loopCount; i++) {
+            loopControls.push_back(std::make_unique<LoopControls>());
+            setupLoopControls(*loopControls.back(), String(i + 1));
+        }
+        prevRecording = -1;
+        prevMonitoring = -1;
     }
+
+    if (beatsPerLoop != this->beatsPerLoop) {
+        this->beatsPerLoop = beatsPerLoop;
+        beatsPerIndicator = beatsPerLoop <= maxBeatIndicators ? 1 : beatsPerBar;
+
+        beatIndicators.clear();
+        for (int i = 0; i < (beatsPerLoop + beatsPerIndicator - 1) / beatsPerIndicator; i++) {
+            beatIndicators.push_back(std::make_unique<Label>());
+            beatIndicators.back()->setText("", dontSendNotification);
+            beatIndicators.back()->setColour(Label::outlineColourId, Colours::whitesmoke);
+            addAndMakeVisible(beatIndicators.back().get());
+        }
+        prevBeat = -1;
+    }
+
+    resized();
 }
 
-void LooperAudioProcessorEditor::setupSlider(
-    DecibelSlider& slider,
-    std::unique_ptr<HeadphonesButton>& monitorButton,
-    std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment>& attachment, 
-    std::unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment>& monitorAttachment,
-    const juce::String& paramNumber,
-    juce::Label& label
-) {
+void LooperAudioProcessorEditor::setupLoopControls(LoopControls& controls, const juce::String& paramNumber) {
     using namespace juce;
 
-    slider.setSliderStyle(Slider::SliderStyle::LinearVertical);
-    slider.setTextBoxStyle(Slider::TextBoxBelow, true, 60, 30);
-    addAndMakeVisible(slider);
+    controls.volumeSlider.setSliderStyle(Slider::SliderStyle::LinearVertical);
+    controls.volumeSlider.setTextBoxStyle(Slider::TextBoxBelow, true, 60, 30);
+    loopStrip.addAndMakeVisible(controls.volumeSlider);
 
-    label.setText("Loop " + paramNumber, dontSendNotification);
-    label.setJustificationType(Justification::centred);
-    addAndMakeVisible(label);
+    controls.label.setText("Loop " + paramNumber, dontSendNotification);
+    controls.label.setJustificationType(Justification::centred);
+    loopStrip.addAndMakeVisible(controls.label);
 
-    attachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment>(
+    controls.volumeSliderAttachment = std::make_unique<AudioProcessorValueTreeState::SliderAttachment>(
         audioProcessor.valueTree,
         "VOLUME" + paramNumber,
-        slider
+        controls.volumeSlider
     );
 
-    monitorButton = std::make_unique<HeadphonesButton>("MONITOR" + paramNumber);
-    addAndMakeVisible(monitorButton.get());
-    monitorAttachment = std::make_unique<AudioProcessorValueTreeState::ButtonAttachment>(
+    controls.monitorButton = std::make_unique<HeadphonesButton>("MONITOR" + paramNumber);
+    loopStrip.addAndMakeVisible(controls.monitorButton.get());
+    controls.monitorButtonAttachment = std::make_unique<AudioProcessorValueTreeState::ButtonAttachment>(
         audioProcessor.valueTree,
         "MONITOR" + paramNumber,
-        *monitorButton.get()
+        *controls.monitorButton
     );
+
+    loopStrip.addAndMakeVisible(controls.meter);
 }
 
 void LooperAudioProcessorEditor::timerCallback() {
-    drawRecording();
-    drawBeat();
-    drawMeters();
-    clearMonitoring();
+    const auto& state = audioProcessor.getUIState();
+    bool changed = state.version != lastVersion;
+    lastVersion = state.version;
+
+    if (changed) {
+        if (state.loopCount != (int)loopControls.size() || state.beatsPerLoop != beatsPerLoop) {
+            setLoopLayout(state.loopCount, state.beatsPerLoop);
+        }
+        drawRecording(state);
+        drawBeat(state);
+        clearMonitoring(state);
+        drawHistory(state);
+    }
+    exportButton.setEnabled(!audioProcessor.isExporting());
+
+    double now = juce::Time::getMillisecondCounterHiRes();
+    double elapsedSeconds = (now - lastTick) / 1000.0;
+    lastTick = now;
+
+    // meters keep falling for a while after the levels stop changing
+    if (changed || metersMoving) {
+        metersMoving = drawMeters(state, elapsedSeconds);
+    }
+
+    // with nothing to animate, check back less often until the processor publishes something new
+    bool active = changed || metersMoving;
+    if (active != timerActive) {
+        timerActive = active;
+        startTimerHz(active ? activeTimerHz : idleTimerHz);
+    }
 }
 
-void LooperAudioProcessorEditor::drawRecording() {
-    if (prevRecording == audioProcessor.recordingIndex) return;
+void LooperAudioProcessorEditor::drawRecording(const LooperAudioProcessor::UIState& state) {
+    if (prevRecording == state.recordingIndex) return;
 
-    if (audioProcessor.recordingIndex == -1) {
-        for (int i = 0; i < nLoops; i++) {
-            labels[i].setColour(juce::Label::backgroundColourId, juce::Colours::transparentBlack);
+    if (state.recordingIndex == -1) {
+        for (auto& controls : loopControls) {
+            controls->label.setColour(juce::Label::backgroundColourId, juce::Colours::transparentBlack);
         }
     } else {
-        if (prevRecording != -1) labels[prevRecording].setColour(juce::Label::backgroundColourId, juce::Colours::transparentBlack);
-        labels[audioProcessor.recordingIndex].setColour(juce::Label::backgroundColourId, juce::Colours::palevioletred);
+        if (prevRecording != -1) loopControls[prevRecording]->label.setColour(juce::Label::backgroundColourId, juce::Colours::transparentBlack);
+        loopControls[state.recordingIndex]->label.setColour(juce::Label::backgroundColourId, juce::Colours::palevioletred);
     }
 
-    prevRecording = audioProcessor.recordingIndex;
+    prevRecording = state.recordingIndex;
 }
 
-void LooperAudioProcessorEditor::drawBeat() {
-    if (prevBeat == audioProcessor.beat) return;
+void LooperAudioProcessorEditor::drawBeat(const LooperAudioProcessor::UIState& state) {
+    int indicator = state.beat == -1 ? -1 : state.beat / beatsPerIndicator;
+    if (prevBeat == indicator) return;
 
-    if (audioProcessor.beat == -1) {
-        for (int i = 0; i < loopLenInBeats; i++) {
-            beatIndicators[i].setColour(juce::Label::backgroundColourId, juce::Colours::transparentBlack);
+    if (indicator == -1) {
+        for (auto& beatIndicator : beatIndicators) {
+            beatIndicator->setColour(juce::Label::backgroundColourId, juce::Colours::transparentBlack);
         }
     } else {
-        if (prevBeat != -1) beatIndicators[prevBeat].setColour(juce::Label::backgroundColourId, juce::Colours::transparentBlack);
-        beatIndicators[audioProcessor.beat].setColour(juce::Label::backgroundColourId, juce::Colours::whitesmoke);
+        if (prevBeat != -1) beatIndicators[prevBeat]->setColour(juce::Label::backgroundColourId, juce::Colours::transparentBlack);
+        beatIndicators[indicator]->setColour(juce::Label::backgroundColourId, juce::Colours::whitesmoke);
     }
 
-    prevBeat = audioProcessor.beat;
+    prevBeat = indicator;
 }
 
-void LooperAudioProcessorEditor::drawMeters() {
-    for (int i = 0; i < nLoops; i++) {
-        VerticalMeter& meter = meters[i];
-        float rms = audioProcessor.getRMS(i);
-        float levelInDb = juce::Decibels::gainToDecibels(rms, meter.MIN_LEVEL);
-        if (levelInDb < meter.MIN_LEVEL + 1) levelInDb = meter.MIN_LEVEL;
+bool LooperAudioProcessorEditor::drawMeters(const LooperAudioProcessor::UIState& state, double elapsedSeconds) {
+    bool moving = false;
 
-        meter.setLevel(levelInDb);
-        meter.repaint();
+    for (int i = 0; i < (int)loopControls.size(); i++) {
+        moving |= drawMeter(loopControls[i]->meter, state.loopRMS[i], elapsedSeconds);
     }
+    moving |= drawMeter(inputMeter, state.inputRMS, elapsedSeconds);
+
+    return moving;
+}
 
-    VerticalMeter& meter = inputMeter;
-    float rms = audioProcessor.getInputRMS();
+// The meter repaints whatever moved itself; this only says whether it's still falling.
+bool LooperAudioProcessorEditor::drawMeter(VerticalMeter& meter, float rms, double elapsedSeconds) {
     float levelInDb = juce::Decibels::gainToDecibels(rms, meter.MIN_LEVEL);
     if (levelInDb < meter.MIN_LEVEL + 1) levelInDb = meter.MIN_LEVEL;
 
-    meter.setLevel(levelInDb);
-    meter.repaint();
+    return meter.setLevel(levelInDb, elapsedSeconds);
 }
 
-void LooperAudioProcessorEditor::clearMonitoring() {
-    if (prevMonitoring == audioProcessor.monitorIndex || audioProcessor.monitorIndex == -1 || prevMonitoring == -1) {
-        prevMonitoring = audioProcessor.monitorIndex;
+void LooperAudioProcessorEditor::clearMonitoring(const LooperAudioProcessor::UIState& state) {
+    if (prevMonitoring == state.monitorIndex || state.monitorIndex == -1 || prevMonitoring == -1) {
+        prevMonitoring = state.monitorIndex;
         return;
     }
 
-    auto& prevButton = *monitorButtons[prevMonitoring].get();
+    auto& prevButton = *loopControls[prevMonitoring]->monitorButton;
     if (prevButton.getToggleState()) {
         prevButton.setToggleState(false, juce::NotificationType::sendNotification);
     }
 
-    prevMonitoring = audioProcessor.monitorIndex;
+    prevMonitoring = state.monitorIndex;
+}
+
+void LooperAudioProcessorEditor::drawHistory(const LooperAudioProcessor::UIState& state) {
+    undoButton.setEnabled(state.undoSteps > 0);
+    redoButton.setEnabled(state.redoSteps > 0);
+}
+
+void LooperAudioProcessorEditor::showExportMenu() {
+    using Mode = LoopExporter::Mode;
+    using Format = LoopExporter::Format;
+
+    juce::PopupMenu menu;
+    menu.addItem(1, "Loops as WAV");
+    menu.addItem(2, "Loops as FLAC");
+    menu.addItem(3, "Stems as WAV");
+    menu.addItem(4, "Stems as FLAC");
+    menu.addItem(5, "Mix as WAV");
+    menu.addItem(6, "Mix as FLAC");
+    menu.showMenuAsync(juce::PopupMenu::Options().withTargetComponent(&exportButton), [this](int item) {
+        if (item == 0) return;
+        Mode modes[] = { Mode::loops, Mode::stems, Mode::mix };
+        chooseExportDestination(modes[(item - 1) / 2], item % 2 == 0 ? Format::flac : Format::wav);
+    });
+}
+
+// A mix goes to a file, loops and stems to a folder with a file per loop.
+void LooperAudioProcessorEditor::chooseExportDestination(LoopExporter::Mode mode, LoopExporter::Format format) {
+    using namespace juce;
+
+    bool mix = mode == LoopExporter::Mode::mix;
+    String pattern = format == LoopExporter::Format::flac ? "*.flac" : "*.wav";
+    exportChooser = std::make_unique<FileChooser>(mix ? "Export mix" : "Export loops to folder",
+        File::getSpecialLocation(File::userDocumentsDirectory), mix ? pattern : String());
+    int flags = FileBrowserComponent::saveMode | (mix ? FileBrowserComponent::canSelectFiles : FileBrowserComponent::canSelectDirectories);
+    exportChooser->launchAsync(flags, [this, mode, format](const FileChooser& chooser) {
+        File destination = chooser.getResult();
+        if (destination == File()) return;
+        audioProcessor.exportLoops(destination, -1, mode, format);
+    });
+}
+
+/*
+* Every option the processor keeps outside its automatable parameters, ticked where it stands. Those that
+* wait for prepareToPlay are applied straight away; the layout and record mode start over with empty loops.
+*/
+void LooperAudioProcessorEditor::showSettingsMenu() {
+    using namespace juce;
+
+    const auto settings = audioProcessor.getSettings();
+    LooperAudioProcessor& processor = audioProcessor;
+    auto prepared = [&processor](std::function<void()> change) {
+        return [&processor, change] {
+            change();
+            processor.applySettings();
+        };
+    };
+
+    PopupMenu loopCounts;
+    for (int count : { 1, 2, 4, 6, 8, 12, 16, 24, 32, 48, 64 }) {
+        loopCounts.addItem(String(count), true, count == settings.loopCount,
+            prepared([&processor, count, settings] { processor.setLoopLayout(count, settings.loopBars); }));
+    }
+    PopupMenu loopBars;
+    for (int bars : { 1, 2, 4, 8, 16, 32, 64 }) {
+        loopBars.addItem(String(bars), true, bars == settings.loopBars,
+            prepared([&processor, bars, settings] { processor.setLoopLayout(settings.loopCount, bars); }));
+    }
+
+    // the fade and feedback apply on the next block, no need to prepare again
+    PopupMenu fade;
+    for (int length : { 64, 200, 512, 1024, 2048, 4096, 8192, MAX_FADE_SAMPLES }) {
+        fade.addItem(String(length) + " samples", true, length == settings.fadeLength,
+            [&processor, length, settings] { processor.setFade(length, settings.fadeCurve); });
+    }
+    fade.addSeparator();
+    fade.addItem("Linear", true, settings.fadeCurve == FadeCurve::linear,
+        [&processor, settings] { processor.setFade(settings.fadeLength, FadeCurve::linear); });
+    fade.addItem("Equal power", true, settings.fadeCurve == FadeCurve::equalPower,
+        [&processor, settings] { processor.setFade(settings.fadeLength, FadeCurve::equalPower); });
+
+    PopupMenu recording;
+    recording.addItem("Replace", true, settings.recordMode == RecordMode::replace,
+        prepared([&processor, settings] { processor.setRecordMode(RecordMode::replace, settings.feedback); }));
+    recording.addItem("Overdub", true, settings.recordMode == RecordMode::overdub,
+        prepared([&processor, settings] { processor.setRecordMode(RecordMode::overdub, settings.feedback); }));
+    recording.addSectionHeader("Overdub feedback");
+    for (int percent : { 100, 95, 90, 75, 50, 25, 0 }) {
+        float feedback = percent / 100.f;
+        recording.addItem(String(percent) + "%", true, std::abs(feedback - settings.feedback) < 0.005f,
+            [&processor, feedback, settings] { processor.setRecordMode(settings.recordMode, feedback); });
+    }
+
+    // sample formats in the order they lose precision
+    struct FormatName {
+        SampleFormat format;
+        const char* name;
+    };
+    const FormatName formats[] = {
+        { SampleFormat::float32, "32-bit float" },
+        { SampleFormat::int24, "24-bit" },
+        { SampleFormat::int16, "16-bit" },
+        { SampleFormat::half, "16-bit float" }
+    };
+    PopupMenu loopFormat;
+    for (const auto& format : formats) {
+        SampleFormat chosen = format.format;
+        loopFormat.addItem(format.name, true, chosen == settings.loopFormat,
+            prepared([&processor, chosen] { processor.setLoopFormat(chosen); }));
+    }
+
+    PopupMenu memory;
+    memory.addSectionHeader("Room for tempos down to");
+    for (int bpm : { 30, 40, 60, 80, 100, 120 }) {
+        memory.addItem(String(bpm) + " BPM", true, bpm == (int)settings.minBpm,
+            prepared([&processor, bpm, settings] { processor.setLoopMemoryOptions(bpm, settings.lockLoopMemory); }));
+    }
+    memory.addSeparator();
+    memory.addItem("Lock in RAM", true, settings.lockLoopMemory,
+        prepared([&processor, settings] { processor.setLoopMemoryOptions(settings.minBpm, !settings.lockLoopMemory); }));
+    memory.addSeparator();
+    memory.addItem("Keep loops in RAM", true, settings.loopFileFolder.isEmpty(),
+        prepared([&processor] { processor.setLoopFileFolder({}); }));
+    memory.addItem(settings.loopFileFolder.isEmpty() ? String("Keep loops in files...") : "Keep loops in " + settings.loopFileFolder + "...",
+        true, !settings.loopFileFolder.isEmpty(), [this] { chooseLoopFileFolder(); });
+
+    PopupMenu history;
+    for (int megabytes : { 0, 16, 64, 256, 1024, LooperAudioProcessor::maxHistoryMegabytes }) {
+        history.addItem(megabytes == 0 ? String("Off") : String(megabytes) + " MB", true, megabytes == settings.historyMegabytes,
+            prepared([&processor, megabytes] { processor.setHistoryBudget(megabytes); }));
+    }
+    history.addSeparator();
+    for (const auto& format : formats) {
+        SampleFormat chosen = format.format;
+        history.addItem(format.name, true, chosen == settings.historyFormat,
+            prepared([&processor, chosen] { processor.setHistoryFormat(chosen); }));
+    }
+
+    PopupMenu mixThreads;
+    for (int threads = 0; threads <= LooperAudioProcessor::maxMixThreads; threads++) {
+        mixThreads.addItem(threads == 0 ? String("Audio thread only") : String(threads), true, threads == settings.mixThreads,
+            prepared([&processor, threads] { processor.setMixThreads(threads); }));
+    }
+
+    PopupMenu sharing;
+    sharing.addItem("Play own loops", true, settings.shareMode == ShareMode::off,
+        prepared([&processor] { processor.setShareMode(ShareMode::off); }));
+    sharing.addItem("Share loops", true, settings.shareMode == ShareMode::share,
+        prepared([&processor] { processor.setShareMode(ShareMode::share); }));
+    sharing.addItem("Follow shared loops", true, settings.shareMode == ShareMode::follow,
+        prepared([&processor] { processor.setShareMode(ShareMode::follow); }));
+
+    PopupMenu menu;
+    menu.addSubMenu("Loops", loopCounts);
+    menu.addSubMenu("Bars per loop", loopBars);
+    menu.addSubMenu("Crossfade", fade);
+    menu.addSubMenu("Recording", recording);
+    menu.addSubMenu("Loop format (replace)", loopFormat);
+    menu.addSeparator();
+    menu.addSubMenu("Loop memory", memory);
+    menu.addSubMenu("Undo history", history);
+    menu.addSubMenu("Mix threads", mixThreads);
+    menu.addSubMenu("Sharing", sharing);
+    menu.showMenuAsync(PopupMenu::Options().withTargetComponent(&settingsButton));
+}
+
+void LooperAudioProcessorEditor::chooseLoopFileFolder() {
+    using namespace juce;
+
+    folderChooser = std::make_unique<FileChooser>("Keep loops in folder", File::getSpecialLocation(File::userDocumentsDirectory));
+    int flags = FileBrowserComponent::openMode | FileBrowserComponent::canSelectDirectories;
+    folderChooser->launchAsync(flags, [this](const FileChooser& chooser) {
+        File folder = chooser.getResult();
+        if (folder == File()) return;
+        audioProcessor.setLoopFileFolder(folder.getFullPathName());
+        audioProcessor.applySettings();
+    });
 }
\ No newline at end of file
@@ -33,19 +33,29 @@ public:
     void timerCallback() override;
 
 private:
-    void setupSlider(
-        DecibelSlider& slider, 
-        std::unique_ptr<HeadphonesButton>& monitorButton,
-        std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment>& attachment, 
-        std::unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment>& monitorAttachment,
-        const juce::String& paramNumber,
-        juce::Label& label
-    );
-
-    void drawRecording();
-    void drawBeat();
-    void drawMeters();
-    void clearMonitoring();
+    // Everything one loop's column shows.
+    struct LoopControls {
+        juce::Label label;
+        DecibelSlider volumeSlider;
+        std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment> volumeSliderAttachment;
+        VerticalMeter meter;
+        std::unique_ptr<HeadphonesButton> monitorButton;
+        std::unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment> monitorButtonAttachment;
+    };
+
+    void setupLoopControls(LoopControls& controls, const juce::String& paramNumber);
+    void setLoopLayout(int loopCount, int beatsPerLoop);
+
+    void drawRecording(const LooperAudioProcessor::UIState& state);
+    void drawBeat(const LooperAudioProcessor::UIState& state);
+    bool drawMeters(const LooperAudioProcessor::UIState& state, double elapsedSeconds);
+    bool drawMeter(VerticalMeter& meter, float rms, double elapsedSeconds);
+    void clearMonitoring(const LooperAudioProcessor::UIState& state);
+    void drawHistory(const LooperAudioProcessor::UIState& state);
+    void showExportMenu();
+    void chooseExportDestination(LoopExporter::Mode mode, LoopExporter::Format format);
+    void showSettingsMenu();
+    void chooseLoopFileFolder();
 
     LooperAudioProcessor& audioProcessor;
 
@@ -54,19 +64,35 @@ private:
     juce::Label inputLabel;
     std::unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment> muteInputAttachment;
 
-    juce::Label labels[nLoops];
-    DecibelSlider volumeSliders[nLoops];
-    std::unique_ptr<juce::AudioProcessorValueTreeState::SliderAttachment> volumeSliderAttachments[nLoops];
-    VerticalMeter meters[nLoops];
-    std::unique_ptr<HeadphonesButton> monitorButtons[nLoops];
-    std::unique_ptr<juce::AudioProcessorValueTreeState::ButtonAttachment> monitorButtonAttachments[nLoops];
+    juce::TextButton undoButton;
+    juce::TextButton redoButton;
+    juce::TextButton exportButton;
+    std::unique_ptr<juce::FileChooser> exportChooser;
+    juce::TextButton settingsButton;
+    std::unique_ptr<juce::FileChooser> folderChooser;
 
-    juce::Label beatIndicators[loopLenInBeats];
+    // the loop columns live in a strip that scrolls sideways once there are more than fit
+    juce::Viewport loopView;
+    juce::Component loopStrip;
+    std::vector<std::unique_ptr<LoopControls>> loopControls;
+
+    // one indicator per beat, or per bar when the loops are too long for that to be readable
+    std::vector<std::unique_ptr<juce::Label>> beatIndicators;
+    int beatsPerIndicator = 1;
+    int beatsPerLoop = 0;
 
     int prevRecording = -1;
     int prevBeat = -1;
     int prevMonitoring = -1;
-    const float loopsX = 50;
+    uint32_t lastVersion = 0;
+    bool metersMoving = false;
+    bool timerActive = true;
+    double lastTick = 0;    // ms, for meters to fall at the same speed whatever the timer rate
+    const int activeTimerHz = 30;
+    const int idleTimerHz = 10;     // while nothing changes, only to notice when something does
+    const int loopsX = 50;
+    const int loopWidth = 120;
+    const int maxBeatIndicators = 16;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (LooperAudioProcessorEditor)
 };
@@ -23,14 +23,19 @@ LooperAudioProcessor::LooperAudioProcessor()
                      #endif
                        ), 
     valueTree(*this, nullptr, "Parameters", createParameters()),
-    loopSyncer(this), bufferStack(4), nSamples(1024)
+    nSamples(1024), loopSyncer(this), loopSharer(loopSyncer, loops),
+    loopStretcher(loopMemory, loops), loopArchive(loopReaders, loops), loopExporter(loopArchive)
 #endif
 {
-    for (int i = 0; i < nLoops; i++) {
+    for (int i = 0; i < maxLoops; i++) {
         loopDown[i] = false;
         loopVolumes[i] = 1.f;
+        loopGains[i] = 1.f;
     }
 
+    loopFileId = juce::Uuid().toString();
+    valueTree.state.setProperty("loopFileId", loopFileId, nullptr);
+
     setupParameterListeners();
 }
 
@@ -90,12 +95,80 @@ void LooperAudioProcessor::changeProgramName (int index, const juce::String& new
 
 //==============================================================================
 void LooperAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock) {
-    setupTempBuffers(samplesPerBlock);
+    int channels = juce::jmax(1, getMainBusNumInputChannels());
+    int beats = requestedLoopBars * beatsPerBar;
+    ShareMode requestedShareMode = loopSharer.getMode();
+    auto* slab = loopMemory.getCurrent();
+    bool layoutChanged = requestedLoopCount != loopCount || beats != beatsPerLoop || requestedRecordMode != recordMode
+        || (requestedShareMode == ShareMode::follow) != (shareMode == ShareMode::follow);
+
+    // a follower plays another instance's loops, so it keeps no loop memory of its own
+    bool following = requestedShareMode == ShareMode::follow;
+    size_t capacity = following ? 0 : (size_t)std::ceil(std::ceil(sampleRate * 60.0 / minBpm) * beats);
+
+    // overdubbing layers onto the loops pass after pass, so only replaced takes can be kept rounded
+    SampleFormat format = requestedRecordMode == RecordMode::replace && !following ? loopFormat : SampleFormat::float32;
+
+    // a new sample rate keeps the loops, resampled, unless they're about to be cleared anyway
+    bool resampled = false;
+    if (slab != nullptr && preparedSampleRate != 0 && sampleRate != preparedSampleRate && !layoutChanged && channels == numChannels) {
+        resampled = resampleLoops(preparedSampleRate, sampleRate, capacity);
+        slab = loopMemory.getCurrent();
+    }
+    preparedSampleRate = sampleRate;
+
+    // all loop memory is allocated here so tempo changes on the audio thread never have to
+    bool reallocate = slab == nullptr || layoutChanged || channels != numChannels || slab->capacity < capacity || slab->locked != lockLoopMemory
+        || slab->path != loopFilePath(requestedShareMode) || slab->format != format;
+    if (reallocate) {
+        // loops that only move to other memory, e.g. into shared memory to share them, come along through
+        // the archive's copy of them, the way saved loops are restored
+        if (!layoutChanged && channels == numChannels && pendingLoops.empty() && hasTakes()) {
+            pendingLoops = loopArchive.getSnapshot();
+        }
+        shareMode = requestedShareMode;
+        numChannels = channels;
+        loopStretcher.cancel();
+        loopReaders.beginResize(true);
+        if (layoutChanged) {
+            loopCount = requestedLoopCount;
+            beatsPerLoop = beats;
+            recordMode = requestedRecordMode;
+            overdub.stop();
+            recordingIndex = -1;
+            std::fill_n(loopDown, maxLoops, false);
+            loopStretcher.setLoopCount(loopCount);
+            loopArchive.setLoopCount(loopCount);
+        }
+        int copySlots = recordMode == RecordMode::replace ? 1 : 0;
+        int slabLoops = following ? 0 : loopCount + copySlots;
+        loopMemory.setBacking(loopFilePath(shareMode), (size_t)(sampleRate * loopFileReadAheadSeconds));
+        const auto& allocated = loopMemory.allocate(capacity, following ? 0 : MAX_FADE_SAMPLES, numChannels, slabLoops, format,
+            lockLoopMemory);
+        assignLoopMemory(allocated);
+        samplesPerBeat = 0;     // the loops get their length on the next block
+        if (allocated.recovered) recoverLoops(allocated);
+        restartTake();
+        loopReaders.endResize();
+    }
+
+    // saved pages belong to the loops they came from, so new loop memory starts a new history
+    size_t historyBytes = following ? 0 : (size_t)historyMegabytes << 20;
+    if (reallocate || resampled || historyBytes != history.getBudget() || historyFormat != history.getFormat()) {
+        history.prepare(historyBytes, numChannels, loopMemory.getCurrent()->capacity, historyFormat);
+    }
+    restorePendingLoops();
+
+    nSamples = samplesPerBlock;
+    mixWorkers.start(mixThreads, numChannels, chunkSize);
+    scratch.allocate(scratchSpansPerChannel * (ScratchArena::bytesFor<float*>(numChannels)
+        + numChannels * ScratchArena::bytesFor<float>(chunkSize)));
 }
 
 void LooperAudioProcessor::releaseResources() {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
+    mixWorkers.stop();
 }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -104,12 +177,14 @@ bool LooperAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) c
     juce::ignoreUnused (layouts);
     return true;
   #else
-    // This is the place where you check if the layout is supported.
-    // In this template code we only support mono or stereo.
-    // Some plugin hosts, such as certain GarageBand versions, will only
-    // load plugins that support stereo bus layouts.
-    if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::mono()
-     && layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
+    // Loops store however many channels the main bus has, so any layout up to maxChannels works
+    auto mainOutput = layouts.getMainOutputChannelSet();
+    if (mainOutput.isDisabled() || mainOutput.size() > maxChannels)
+        return false;
+
+    // The monitor bus plays a single loop, so it must match the main bus if it's enabled
+    auto monitorOutput = layouts.getChannelSet(false, 1);
+    if (!monitorOutput.isDisabled() && monitorOutput != mainOutput)
         return false;
 
     // This checks if the input layout matches the output layout
@@ -124,12 +199,12 @@ bool LooperAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) c
 #endif
 
 void LooperAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages) {
-    setupTempBuffers(buffer.getNumSamples());
+    nSamples = buffer.getNumSamples();
+    scratch.reset();
 
     midiMessages.clear();
-    if (buffer.getNumChannels() > 2) {
-        std::fill_n(buffer.getWritePointer(2), buffer.getNumSamples(), 0.f);
-        std::fill_n(buffer.getWritePointer(3), buffer.getNumSamples(), 0.f);
+    if (getChannelCountOfBus(false, 1) > 0) {
+        getBusBuffer(buffer, false, 1).clear();
     }
 
     auto playhead = getPlayHead();
@@ -143,119 +218,488 @@ void LooperAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce:
 
     loopSyncer.handleUpdates();
 
-    inputRMS = (calculateRMS(buffer.getReadPointer(0), nSamples) + calculateRMS(buffer.getReadPointer(1), nSamples)) / 2.f;
-
     if (!playing) {
-        for (int i = 0; i < nLoops; i++) {
+        for (int i = 0; i < loopCount; i++) {
             loopDown[i] = false;
-            setRMS(i, 0);
+            levelMeter.clear(i);
+        }
+
+        if (levelMeter.isActive()) {
+            MixKernel::Levels inputLevels;
+            for (int channel = 0; channel < numChannels; channel++) {
+                MixKernel::measure(buffer.getReadPointer(channel), nSamples, inputLevels);
+            }
+            levelMeter.publish(inputMeter, inputLevels, nSamples * numChannels);
         }
 
-        recordingIndex = -1;
+        setRecordingLoop(-1);
         beat = -1;
+        publishUIState();
         return;
     }
 
     doLooping(buffer, info);
+    publishUIState();
 }
 
 void LooperAudioProcessor::doLooping(juce::AudioBuffer<float>& buffer, juce::Optional<juce::AudioPlayHead::PositionInfo> info) {
     auto bpm = info->getBpm().orFallback(120);
     auto sampleRate = getSampleRate();
-    size_t samplesPerBeat = ceil(sampleRate * 60.0 / bpm);
-    if (samplesPerBeat != this->samplesPerBeat) {
+    cursor.setTempo(sampleRate, bpm, beatsPerLoop);
+    cursor.moveTo(info->getTimeInSamples().orFallback(0));
+    double samplesPerBeat = cursor.getSamplesPerBeat();
+
+    // recorded loops keep playing at the old tempo until their stretched versions are ready
+    if (samplesPerBeat == this->samplesPerBeat) {
+        loopStretcher.request(0);
+    } else if (this->samplesPerBeat != 0 && hasTakes()) {
+        loopStretcher.request(samplesPerBeat);
+        adoptStretchedLoops(samplesPerBeat);
+    } else {
         setupLoops(samplesPerBeat);
     }
+    if (this->samplesPerBeat == 0) return;  // no room for the loops yet, a bigger slab is on its way
+    LoopPosition top = cursor.at(0);
+    loopMemory.setPlayhead(top.sample, top.length, cursor.getSample());
+    loopSharer.beginBlock(loopCount);
+    applyHistoryMoves();
 
-    for (int i = 0; i < nLoops; i++) {
+    for (int i = 0; i < loopCount; i++) {
         if (!loopDown[i]) continue;
         loopDown[i] = false;
 
-        if (recordingIndex == i) {
-            recordingIndex = -1;
+        // a follower has no loop memory to record into
+        if (shareMode != ShareMode::follow) setRecordingLoop(recordingIndex == i ? -1 : i);
+    }
+
+    beat = cursor.getBeat();
+
+    float targetGains[maxLoops];
+    for (int i = 0; i < loopCount; i++) {
+        float decibles = (loopVolumes[i] - 1) * -minLoopDb;
+        targetGains[i] = juce::Decibels::decibelsToGain(decibles, minLoopDb);
+    }
+
+    // the block is worked through in fixed-size chunks, so no host block size can outgrow what the loops,
+    // kernels and scratch memory were set up for; metering adds up over the chunks and publishes once
+    bool metering = levelMeter.isActive();
+    MixKernel::Levels levels[maxLoops + 1];
+    float* const* blockChannels = buffer.getArrayOfWritePointers();
+    float* chunkChannels[maxChannels];
+
+    int monitor = monitorIndex.load();
+    bool monitoring = monitor != -1 && monitor < loopCount && getChannelCountOfBus(false, 1) >= numChannels;
+    float* const* monitorChannels = monitoring ? blockChannels + getChannelIndexInProcessBlockBuffer(false, 1, 0) : nullptr;
+    float* monitorChunk[maxChannels];
+
+    for (int offset = 0; offset < nSamples; offset += chunkSize) {
+        int count = std::min(chunkSize, nSamples - offset);
+
+        float chunkGains[maxLoops];
+        LoopMixer::rampChunk(loopGains, targetGains, loopCount, count, nSamples - offset, chunkGains);
+
+        for (int channel = 0; channel < numChannels; channel++) {
+            chunkChannels[channel] = blockChannels[channel] + offset;
+        }
+        readWriteLoops(offset, chunkChannels, count, chunkGains, metering ? levels : nullptr);
+        std::copy_n(chunkGains, loopCount, loopGains);
+
+        // the monitor bus is the one consumer that needs its own copy, so read straight into it
+        if (monitoring) {
+            for (int channel = 0; channel < numChannels; channel++) {
+                monitorChunk[channel] = monitorChannels[channel] + offset;
+            }
+            const Loop<float>& loop = loopSharer.getPlaybackLoop(monitor, loops[monitor]);
+            if (loop.isSilent()) {
+                for (int channel = 0; channel < numChannels; channel++) std::fill_n(monitorChunk[channel], count, 0.f);
+            } else {
+                loop.readBuffer(monitorChunk, positionFor(loop, offset), count);
+            }
+        }
+    }
+
+    if (metering) {
+        int values = nSamples * numChannels;
+        int replaced = replacedLoop();
+        for (int i = 0; i < loopCount; i++) {
+            if (i != replaced) levelMeter.publish(i, levels[i], values);
+        }
+        levelMeter.publish(inputMeter, levels[inputMeter], values);
+        if (replaced != -1) levelMeter.publish(replaced, levels[inputMeter], values);
+    }
+
+    // a loop file keeps where each loop is and how long it is, to pick the loops up after a crash
+    for (int i = 0; i < loopCount; i++) {
+        loopMemory.recordLoop(i, loops[i].getStorage(), loops[i].isSilent(), loops[i].getSamplesPerBeat(), loops[i].getBeatsPerLoop());
+    }
+    loopSharer.endBlock();
+}
+
+void LooperAudioProcessor::readWriteLoops(int offset, float* const* channels, int count, const float* targetGains, MixKernel::Levels* levels) {
+    // channels hold the input on entry and the mix on return
+    float inputGain = muteInput ? 0.f : 1.f;
+    float inputTarget = inputGain;
+
+    // an overdub is layered on after the loops are mixed, so the loop plays what it held before this chunk
+    float** dubInput = nullptr;
+    ScratchArena::Scope scope(scratch);
+
+    if (recordingIndex != -1) {
+        if (recordMode == RecordMode::overdub) {
+            dubInput = scratch.getChannels<float>(numChannels, count);
+            for (int channel = 0; dubInput != nullptr && channel < numChannels; channel++) {
+                std::copy_n(channels[channel], count, dubInput[channel]);
+            }
         } else {
-            recordingIndex = i;
-            nextLoopL.setupCopy(loopsL + recordingIndex);
-            nextLoopR.setupCopy(loopsR + recordingIndex);
+            LoopPosition position = positionFor(nextLoop, offset);
+            history.beforeCopy(loops, recordingIndex, nextLoop, position, count);
+            if (nextLoop.writeBuffer(channels, position, count)) {
+                loopStretcher.takeCommitted();
+                loopArchive.takeCommitted(recordingIndex);
+            }
         }
+
+        // the loop being recorded plays the input instead, so fold its gain into the input's
+        inputGain += loopGains[recordingIndex];
+        inputTarget += targetGains[recordingIndex];
     }
 
-    auto samples = info->getTimeInSamples().orFallback(0);
-    beat = (samples / samplesPerBeat) % loopLenInBeats;
-    BufferStack<float>::Buffer tempBuffer(bufferStack);
+    LoopMixer::Chunk chunk { channels, numChannels, count, loopCount, loopGains, targetGains, levels };
+    LoopMixer::mix(mixWorkers, chunk, inputGain, inputTarget, replacedLoop(),
+        [&](int j) -> const Loop<float>& { return loopSharer.getPlaybackLoop(j, loops[j]); },
+        [&](const Loop<float>& loop) { return positionFor(loop, offset); });
+
+    if (dubInput != nullptr) {
+        Loop<float>& loop = loops[recordingIndex];
+        LoopPosition position = positionFor(loop, offset);
+        history.beforeOverdub(loops, recordingIndex, position, count);
+        if (overdub.writeBuffer(dubInput, position, count, feedback.load(std::memory_order_relaxed))) {
+            loopArchive.takeCommitted(recordingIndex);
+        }
+        history.afterOverdub(loop);
+        // the loop changed under any stretch in progress
+        loopStretcher.takeCommitted();
+    }
+}
 
-    readWriteLoops(loopsL, nextLoopL, samples, buffer.getReadPointer(0), tempBuffer.get());
-    std::memcpy(buffer.getWritePointer(0), tempBuffer.get(), nSamples * sizeof(float));
+void LooperAudioProcessor::publishUIState() {
+    UIState state;
+    state.version = lastUIState.version;
+    state.recordingIndex = recordingIndex;
+    state.beat = beat;
+    state.monitorIndex = monitorIndex.load();
+    state.loopCount = loopCount;
+    state.beatsPerLoop = beatsPerLoop;
+    for (int i = 0; i < loopCount; i++) {
+        state.loopRMS[i] = levelMeter.getRMS(i);
+        state.loopPeak[i] = levelMeter.getPeak(i);
+    }
+    state.inputRMS = levelMeter.getRMS(inputMeter);
+    state.inputPeak = levelMeter.getPeak(inputMeter);
+    state.undoSteps = history.getUndoSteps();
+    state.redoSteps = history.getRedoSteps();
+
+    // UIState is all 4 byte fields, so there's no padding to throw the comparison off
+    if (std::memcmp(&state, &lastUIState, sizeof(UIState)) == 0) return;
+
+    state.version++;
+    lastUIState = state;
+    uiStates.getWriteBuffer() = state;
+    uiStates.publish();
+}
+
+const LooperAudioProcessor::UIState& LooperAudioProcessor::getUIState() {
+    uiStates.update();
+    return uiStates.read();
+}
 
-    readWriteLoops(loopsR, nextLoopR, samples, buffer.getReadPointer(1), tempBuffer.get());
-    std::memcpy(buffer.getWritePointer(1), tempBuffer.get(), nSamples * sizeof(float));
+void LooperAudioProcessor::setupLoops(double samplesPerBeat) {
+    // a follower's own loops have no memory and stay silent, so only the tempo changes
+    if (shareMode == ShareMode::follow) {
+        this->samplesPerBeat = samplesPerBeat;
+        return;
+    }
 
-    for (int i = 0; i < nLoops; i++) {
-        float monoRMS = (calculateRMS(loopsL[i], samples, nSamples) + calculateRMS(loopsR[i], samples, nSamples)) / 2.f;
-        setRMS(i, monoRMS);
+    // the archive may be copying a loop out; if so, keep the old length and try again next block
+    if (!loopReaders.beginResize()) return;
+
+    size_t length = (size_t)std::ceil(samplesPerBeat * beatsPerLoop);
+    if (const auto* grown = loopMemory.grow(length)) {
+        assignLoopMemory(*grown);
     }
 
-    if (monitorIndex != -1 && buffer.getNumChannels() > 2) {
-        loopsL[monitorIndex].readBuffer(tempBuffer.get(), samples, nSamples);
-        std::memcpy(buffer.getWritePointer(2), tempBuffer.get(), nSamples * sizeof(float));
+    // slower than the slab was sized for; keep the old length until the bigger one is ready
+    if (length > loopMemory.getCurrent()->capacity) {
+        loopReaders.endResize();
+        return;
+    }
 
-        loopsR[monitorIndex].readBuffer(tempBuffer.get(), samples, nSamples);
-        std::memcpy(buffer.getWritePointer(3), tempBuffer.get(), nSamples * sizeof(float));
+    this->samplesPerBeat = samplesPerBeat;
+    for (int i = 0; i < loopCount; i++) {
+        loops[i].resize(samplesPerBeat, beatsPerLoop);
+        loopArchive.takeCommitted(i);
     }
+    if (recordMode == RecordMode::replace) nextLoop.resize(samplesPerBeat, beatsPerLoop);
+    history.clear();
+    restartTake();
+
+    loopReaders.endResize();
 }
 
-void LooperAudioProcessor::readWriteLoops(Loop<float> loops[], CopyLoop<float>& tempLoop, size_t currentSample, const float* readBuffer, float* outBuffer) {
-    if (muteInput) {
-        std::fill_n(outBuffer, nSamples, 0.f);
-    } else {
-        std::memcpy(outBuffer, readBuffer, nSamples * sizeof(float));
+bool LooperAudioProcessor::hasTakes() const {
+    for (int i = 0; i < loopCount; i++) {
+        if (!loops[i].isSilent()) return true;
     }
+    return false;
+}
 
-    BufferStack<float>::Buffer tempBuffer(bufferStack);
-    
-    for (int j = 0; j < nLoops; j++) {
-        if (recordingIndex == j) {
-            tempLoop.writeBuffer(readBuffer, currentSample, nSamples);
-            std::memcpy(tempBuffer.get(), readBuffer, nSamples * sizeof(float));
-        } else {
-            loops[j].readBuffer(tempBuffer.get(), currentSample, nSamples);
+void LooperAudioProcessor::adoptStretchedLoops(double samplesPerBeat) {
+    const auto* result = loopStretcher.getResult(samplesPerBeat);
+    if (result == nullptr) return;
+
+    // switch at the top of a loop at the new tempo, so the stretched loops come in from their start
+    if (cursor.at(0).sample >= (size_t)nSamples) return;
+    if (!loopReaders.beginResize()) return;
+
+    if (loopMemory.adopt(result->slab)) {
+        assignLoopMemory(*loopMemory.getCurrent());
+        this->samplesPerBeat = samplesPerBeat;
+        for (int i = 0; i < loopCount; i++) {
+            loops[i].resize(samplesPerBeat, beatsPerLoop);
+            loops[i].setSilent(result->silent[i]);
+            loopArchive.takeCommitted(i);
+        }
+        if (recordMode == RecordMode::replace) nextLoop.resize(samplesPerBeat, beatsPerLoop);
+        history.clear();
+
+        // a take in progress was recorded at the old tempo, so start it again at the new one
+        restartTake();
+    }
+    loopStretcher.accept();
+    loopReaders.endResize();
+}
+
+/*
+* Resample every recorded loop to a new sample rate, on all cores, into a slab with room for capacity. Not on
+* the audio thread; prepareToPlay waits for it, so the loops are ready when processing resumes. Returns
+* whether the loops moved to a new slab.
+*/
+bool LooperAudioProcessor::resampleLoops(double fromRate, double toRate, size_t capacity) {
+    if (samplesPerBeat == 0 || !hasTakes()) return false;     // empty loops just take their length on the next block
+
+    loopStretcher.cancel();
+    loopReaders.beginResize(true);
+
+    // loops at the host's tempo land exactly on it at the new rate; any at another tempo keep theirs
+    double ratio = toRate / fromRate;
+    bool onCursor = samplesPerBeat == cursor.getSamplesPerBeat();
+    double atNewRate = onCursor ? cursor.getSamplesPerBeatAt(toRate) : samplesPerBeat * ratio;
+    double loopSamplesPerBeat[maxLoops];
+    size_t lengths[maxLoops];
+    bool silent[maxLoops];
+    for (int i = 0; i < loopCount; i++) {
+        double current = loops[i].getSamplesPerBeat();
+        silent[i] = loops[i].isSilent();
+        loopSamplesPerBeat[i] = silent[i] || current == samplesPerBeat ? atNewRate : current * ratio;
+        lengths[i] = (size_t)std::ceil(loopSamplesPerBeat[i] * beatsPerLoop);
+        capacity = std::max(capacity, lengths[i]);
+    }
+    LoopMemory::Slab* slab = loopMemory.create(capacity);
+
+    // each channel is split into parts, so even a single long loop keeps every core busy
+    struct Job {
+        int loop;
+        int channel;
+        size_t first;
+        size_t count;
+    };
+    const size_t partLength = (size_t)1 << 16;
+    std::vector<Job> jobs;
+    for (int i = 0; i < loopCount; i++) {
+        if (silent[i]) continue;
+        for (int channel = 0; channel < numChannels; channel++) {
+            for (size_t first = 0; first < lengths[i]; first += partLength) {
+                jobs.push_back({ i, channel, first, std::min(partLength, lengths[i] - first) });
+            }
         }
+    }
 
-        float loopVal = loopVolumes[j];
-        float decibles = (loopVal - 1) * -minLoopDb;
-        float gain = juce::Decibels::decibelsToGain(decibles, minLoopDb);
-        for (int i = 0; i < nSamples; i++) {
-            outBuffer[i] += gain * tempBuffer.get()[i];
+    // loops kept in a smaller format are resampled as floats and converted back a part at a time
+    bool converted = slab->format != SampleFormat::float32;
+    std::vector<const float*> inputs(loopCount * numChannels, nullptr);
+    std::vector<std::vector<float>> decoded(loopCount * numChannels);
+    std::vector<std::vector<float>> rendered(loopCount * numChannels);
+    for (int i = 0; i < loopCount; i++) {
+        if (silent[i]) continue;
+        for (int channel = 0; channel < numChannels; channel++) {
+            int k = i * numChannels + channel;
+            inputs[k] = loops[i].readChannel(channel, decoded[k]);
+            if (converted) rendered[k].resize(lengths[i]);
         }
-    }    
+    }
+
+    Resample::Filter filter = Resample::design(ratio);
+    parallelFor((int)jobs.size(), [&](int j) {
+        const Job& job = jobs[j];
+        int k = job.loop * numChannels + job.channel;
+        size_t valueBytes = slab->valueBytes();
+        uint8_t* out = slab->getData(job.loop) + job.channel * lengths[job.loop] * valueBytes;
+        float* values = converted ? rendered[k].data() : reinterpret_cast<float*>(out);
+        Resample::render(filter, inputs[k], loops[job.loop].getSize(), values, lengths[job.loop], job.first, job.count);
+        if (converted) SampleConversion::encode(slab->format, values + job.first, out + job.first * valueBytes, job.count);
+    });
+
+    if (!loopMemory.adopt(slab)) {
+        loopReaders.endResize();
+        return false;
+    }
+    assignLoopMemory(*loopMemory.getCurrent());
+    for (int i = 0; i < loopCount; i++) {
+        loops[i].resize(loopSamplesPerBeat[i], beatsPerLoop);
+        loops[i].setSilent(silent[i]);
+        // the resampled loop wraps seamlessly, so its own tail is the right lead-in for the crossfade
+        if (!silent[i]) loops[i].copyPreLoop(lengths[i]);
+        loopArchive.takeCommitted(i);
+    }
+    loopStretcher.takeCommitted();
+    samplesPerBeat = atNewRate;
+    if (recordMode == RecordMode::replace) nextLoop.resize(samplesPerBeat, beatsPerLoop);
+    history.clear();
+
+    // a take in progress was recorded at the old rate, so start it again at the new one
+    restartTake();
+    loopReaders.endResize();
+    return true;
+}
+
+LoopPosition LooperAudioProcessor::positionFor(const Loop<float>& loop, int offset) const {
+    // loops at another tempo (waiting to be stretched, or followed from another instance) keep their own grid
+    if (loop.getSamplesPerBeat() == cursor.getSamplesPerBeat()) return cursor.at(offset);
+    return loop.getPosition((size_t)std::max<int64_t>(0, cursor.getSample()) + offset);
 }
 
-float LooperAudioProcessor::calculateRMS(const Loop<float>& loop, size_t currentSample, int nSamples) {
-    BufferStack<float>::Buffer tempBuffer(bufferStack);
-    loop.readBuffer(tempBuffer.get(), currentSample, nSamples);
-    return calculateRMS(tempBuffer.get(), nSamples);
+void LooperAudioProcessor::assignLoopMemory(const LoopMemory::Slab& slab) {
+    for (int i = 0; i < loopCount; i++) {
+        loops[i].setStorage(slab.getData(i), slab.getPreLoop(i), slab.capacity, slab.numChannels, slab.format);
+    }
+    if (slab.numLoops > loopCount) {
+        nextLoop.setStorage(slab.getData(loopCount), slab.getPreLoop(loopCount), slab.capacity, slab.numChannels, slab.format);
+    }
+    loopSharer.setSlab(slab);
 }
 
-float LooperAudioProcessor::calculateRMS(const float* buffer, int nSamples) const {
-    float meanSquared = 0.f;
-    for (int i = 0; i < nSamples; i++) {
-        meanSquared += buffer[i] * buffer[i];
+// Start or stop recording. A finished overdub has changed its loop in place, so it counts as a new take.
+void LooperAudioProcessor::setRecordingLoop(int loopIndex) {
+    if (overdub.stop()) {
+        loopStretcher.takeCommitted();
+        loopArchive.takeCommitted(recordingIndex);
+    }
+    history.endStep();
+    // a new take may record over what a redo would bring back
+    if (loopIndex != -1) history.dropRedo();
+    recordingIndex = loopIndex;
+    restartTake();
+}
+
+// Decode the loops from setStateInformation once the loops are laid out as they were saved. Not on the audio thread.
+void LooperAudioProcessor::restorePendingLoops() {
+    if (pendingLoops.empty() || loopMemory.getCurrent() == nullptr) return;
+    if (requestedLoopCount != loopCount || requestedLoopBars * beatsPerBar != beatsPerLoop || requestedRecordMode != recordMode) return;
+    if (loopMemory.getCurrent()->path != loopFilePath(shareMode)) return;
+
+    loopStretcher.cancel();
+    loopReaders.beginResize(true);
+    overdub.stop();
+    recordingIndex = -1;
+
+    double restored = LoopArchive::restore(pendingLoops.data(), pendingLoops.size(), loops, loopCount, beatsPerLoop);
+    if (restored > 0) {
+        samplesPerBeat = restored;
+        if (recordMode == RecordMode::replace) nextLoop.resize(samplesPerBeat, beatsPerLoop);
+        history.clear();
+        for (int i = 0; i < loopCount; i++) {
+            loopArchive.takeCommitted(i);
+        }
+        loopStretcher.takeCommitted();
+    }
+    loopReaders.endResize();
+    pendingLoops.clear();
+}
+
+// Put the loops back as a session that crashed left them in its loop file. Only while the audio thread isn't running.
+void LooperAudioProcessor::recoverLoops(const LoopMemory::Slab& slab) {
+    // takes are swapped between slots as they land, so each loop says which slot it ended up in
+    std::vector<bool> taken(slab.numLoops, false);
+    for (int i = 0; i < loopCount; i++) {
+        uint32_t slot = slab.header->loops[i].slot;
+        if (slot >= (uint32_t)slab.numLoops || taken[slot]) return;
+        taken[slot] = true;
+    }
+
+    double recovered = 0;
+    for (int i = 0; i < loopCount; i++) {
+        const auto& record = slab.header->loops[i];
+        if (!record.silent && (int)record.beatsPerLoop == beatsPerLoop) {
+            recovered = record.samplesPerBeat;
+            break;
+        }
+    }
+    if (recovered <= 0 || (size_t)std::ceil(recovered * beatsPerLoop) > slab.capacity) return;
+
+    for (int i = 0; i < loopCount; i++) {
+        const auto& record = slab.header->loops[i];
+        loops[i].setStorage(slab.getData(record.slot), slab.getPreLoop(record.slot), slab.capacity, slab.numChannels, slab.format);
+        loops[i].resize(recovered, beatsPerLoop);
+        loops[i].setSilent(record.silent || record.samplesPerBeat != recovered || (int)record.beatsPerLoop != beatsPerLoop);
+        loopArchive.takeCommitted(i);
+    }
+    if (slab.numLoops > loopCount) {
+        int spare = (int)(std::find(taken.begin(), taken.end(), false) - taken.begin());
+        nextLoop.setStorage(slab.getData(spare), slab.getPreLoop(spare), slab.capacity, slab.numChannels, slab.format);
+        nextLoop.resize(recovered, beatsPerLoop);
     }
-    meanSquared /= static_cast<float>(nSamples);
+    samplesPerBeat = recovered;
 
-    return std::sqrt(meanSquared);
+    // what was recorded up to the crash is newer than the last saved state
+    pendingLoops.clear();
 }
 
-void LooperAudioProcessor::setupLoops(size_t samplesPerBeat) {
-    this->samplesPerBeat = samplesPerBeat;
+// Where this instance's loop memory goes in a share mode: shared memory when sharing, otherwise its loop files, or
+// empty to keep loop memory in RAM.
+std::string LooperAudioProcessor::loopFilePath(ShareMode mode) const {
+    if (mode == ShareMode::share) return loopSharer.getSharedPath();
+    if (mode == ShareMode::follow || loopFileFolder.isEmpty()) return {};
+    return juce::File(loopFileFolder).getChildFile("Looper-" + loopFileId).getFullPathName().toStdString();
+}
+
+// Undo and redo wait for the top of the loop, like stretched loops, so the loop switches over from its start.
+void LooperAudioProcessor::applyHistoryMoves() {
+    if (historyMoves.load(std::memory_order_relaxed) == 0) return;
+    if (cursor.at(0).sample >= (size_t)nSamples) return;
 
-    for (int i = 0; i < nLoops; i++) {
-        loopsL[i].setLength(samplesPerBeat, loopLenInBeats, 0.f);
-        loopsR[i].setLength(samplesPerBeat, loopLenInBeats, 0.f);
+    int moves = historyMoves.exchange(0);
+    setRecordingLoop(-1);
+    for (; moves != 0; moves += moves < 0 ? 1 : -1) {
+        int changed = moves < 0 ? history.undo(loops, nextLoop) : history.redo(loops, nextLoop);
+        if (changed == -1) break;
+        loopStretcher.takeCommitted();
+        loopArchive.takeCommitted(changed);
     }
+}
 
-    nextLoopL.setLength(samplesPerBeat, loopLenInBeats, 0.f);
-    nextLoopR.setLength(samplesPerBeat, loopLenInBeats, 0.f);
+// Begin the take for recordingIndex from scratch, e.g. after the loops were moved or resized.
+void LooperAudioProcessor::restartTake() {
+    if (recordingIndex == -1) return;
+    if (recordMode == RecordMode::replace) {
+        nextLoop.setupCopy(loops + recordingIndex);
+    } else {
+        overdub.start(loops + recordingIndex);
+    }
+}
+
+// The loop whose playback the input stands in for while it records, if any. An overdubbed loop keeps playing.
+int LooperAudioProcessor::replacedLoop() const {
+    return recordMode == RecordMode::replace ? recordingIndex.load(std::memory_order_relaxed) : -1;
 }
 
 //==============================================================================
@@ -271,13 +715,68 @@ juce::AudioProcessorEditor* LooperAudioProcessor::createEditor() {
 void LooperAudioProcessor::getStateInformation (juce::MemoryBlock& destData) {
     using namespace juce;
     MemoryOutputStream stream;
-    valueTree.copyState().writeToStream(stream);
+    // the archive keeps the loops encoded as they're recorded, so saving only joins what's there
+    ValueTree state = valueTree.copyState();
+    std::vector<uint8_t> loopAudio = loopArchive.getSnapshot();
+    state.setProperty("loopAudio", var(MemoryBlock(loopAudio.data(), loopAudio.size())), nullptr);
+    state.writeToStream(stream);
     destData.replaceAll(stream.getData(), stream.getDataSize());
 }
 
 void LooperAudioProcessor::setStateInformation (const void* data, int sizeInBytes) {
     using namespace juce;
-    valueTree.replaceState(ValueTree::readFromData(data, sizeInBytes));
+    ValueTree state = ValueTree::readFromData(data, sizeInBytes);
+    // the loop audio isn't a setting, so it stays out of the live state
+    if (const MemoryBlock* loopAudio = state.getProperty("loopAudio").getBinaryData()) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(loopAudio->getData());
+        pendingLoops.assign(bytes, bytes + loopAudio->getSize());
+    } else {
+        pendingLoops.clear();
+    }
+    state.removeProperty("loopAudio", nullptr);
+    valueTree.replaceState(state);
+
+    int fadeLength = valueTree.state.getProperty("fadeLength", DEFAULT_FADE_SAMPLES);
+    int fadeCurve = valueTree.state.getProperty("fadeCurve", (int)FadeCurve::linear);
+    setFade(fadeLength, (FadeCurve)fadeCurve);
+
+    int shareMode = valueTree.state.getProperty("shareMode", (int)ShareMode::off);
+    setShareMode((ShareMode)shareMode);
+
+    double minBpm = valueTree.state.getProperty("minBpm", defaultMinBpm);
+    bool lockPages = valueTree.state.getProperty("lockLoopMemory", false);
+    setLoopMemoryOptions(minBpm, lockPages);
+
+    loopFileId = valueTree.state.getProperty("loopFileId", loopFileId);
+    valueTree.state.setProperty("loopFileId", loopFileId, nullptr);
+    juce::String loopFileFolder = valueTree.state.getProperty("loopFileFolder", juce::String());
+    setLoopFileFolder(loopFileFolder);
+
+    int loopCount = valueTree.state.getProperty("loopCount", defaultLoopCount);
+    int loopBars = valueTree.state.getProperty("loopBars", defaultLoopBars);
+    setLoopLayout(loopCount, loopBars);
+
+    int recordMode = valueTree.state.getProperty("recordMode", (int)RecordMode::replace);
+    float feedback = valueTree.state.getProperty("feedback", 1.f);
+    setRecordMode((RecordMode)recordMode, feedback);
+
+    int mixThreads = valueTree.state.getProperty("mixThreads", 0);
+    setMixThreads(mixThreads);
+
+    int historyMegabytes = valueTree.state.getProperty("historyMegabytes", defaultHistoryMegabytes);
+    setHistoryBudget(historyMegabytes);
+
+    int historyFormat = valueTree.state.getProperty("historyFormat", (int)SampleFormat::float32);
+    setHistoryFormat((SampleFormat)historyFormat);
+
+    int loopFormat = valueTree.state.getProperty("loopFormat", (int)SampleFormat::float32);
+    setLoopFormat((SampleFormat)loopFormat);
+
+    // the loops can only go back in now if they're laid out as saved, otherwise prepareToPlay does it
+    bool wasSuspended = isSuspended();
+    suspendProcessing(true);
+    restorePendingLoops();
+    if (!wasSuspended) suspendProcessing(false);
 }
 
 //==============================================================================
@@ -287,6 +786,7 @@ juce::AudioProcessor* JUCE_CALLTYPE createPluginFilter() {
 }
 
 void LooperAudioProcessor::startRecordLoop(int loopIndex) {
+    if (loopIndex >= loopCount) return; // loops past the current layout don't exist
     if (recordingIndex == loopIndex) return; // if we're already recording loopIndex, do nothing
     loopDown[loopIndex] = true;
 }
@@ -297,42 +797,163 @@ void LooperAudioProcessor::stopRecordLoop() {
 }
 
 void LooperAudioProcessor::setLoopVolume(int loopIndex, float volume) {
+    // catching up on every shared volume at once mostly finds them unchanged, and those needn't reach the host
+    if (loopVolumes[loopIndex] == volume) return;
     loopVolumes[loopIndex] = volume;
-    valueTree.getParameter("VOLUME" + juce::String(loopIndex + 1))->setValueNotifyingHost(volume);
+    volumeParameters[loopIndex]->setValueNotifyingHost(volume);
 }
 
-juce::AudioProcessorValueTreeState::ParameterLayout LooperAudioProcessor::createParameters() {
-    std::vector<std::unique_ptr<juce::RangedAudioParameter>> params;
+void LooperAudioProcessor::setFade(int lengthInSamples, FadeCurve curve) {
+    lengthInSamples = juce::jlimit(1, MAX_FADE_SAMPLES, lengthInSamples);
+    const FadeTable& table = FadeTable::get(lengthInSamples, curve);
 
-    for (int i = 0; i < nLoops; i++) {
-        const juce::String number(i + 1);
-        params.push_back(std::make_unique<juce::AudioParameterBool>("LOOP" + number, "Loop" + number, false));
+    for (int i = 0; i < maxLoops; i++) {
+        loops[i].setFade(table);
     }
+    nextLoop.setFade(table);
 
-    for (int i = 0; i < nLoops; i++) {
-        const juce::String number(i + 1);
-        params.push_back(std::make_unique<juce::AudioParameterFloat>("VOLUME" + number, "Volume" + number, minLoopDb, 0.f, 0.f));
-    }
+    valueTree.state.setProperty("fadeLength", lengthInSamples, nullptr);
+    valueTree.state.setProperty("fadeCurve", (int)curve, nullptr);
+}
 
-    for (int i = 0; i < nLoops; i++) {
-        const juce::String number(i + 1);
-        params.push_back(std::make_unique<juce::AudioParameterBool>("MONITOR" + number, "Monitor" + number, false));
+void LooperAudioProcessor::setLoopMemoryOptions(double minBpm, bool lockPages) {
+    this->minBpm = juce::jlimit(10.0, 300.0, minBpm);
+    lockLoopMemory = lockPages;
+
+    valueTree.state.setProperty("minBpm", this->minBpm, nullptr);
+    valueTree.state.setProperty("lockLoopMemory", lockPages, nullptr);
+}
+
+void LooperAudioProcessor::setLoopFileFolder(const juce::String& folder) {
+    loopFileFolder = folder;
+    valueTree.state.setProperty("loopFileFolder", folder, nullptr);
+}
+
+void LooperAudioProcessor::setLoopLayout(int loopCount, int bars) {
+    requestedLoopCount = juce::jlimit(1, maxLoops, loopCount);
+    requestedLoopBars = juce::jlimit(1, maxLoopBars, bars);
+
+    valueTree.state.setProperty("loopCount", requestedLoopCount, nullptr);
+    valueTree.state.setProperty("loopBars", requestedLoopBars, nullptr);
+}
+
+void LooperAudioProcessor::setMixThreads(int threads) {
+    mixThreads = juce::jlimit(0, maxMixThreads, threads);
+    valueTree.state.setProperty("mixThreads", mixThreads, nullptr);
+}
+
+void LooperAudioProcessor::undo() {
+    historyMoves--;
+}
+
+void LooperAudioProcessor::redo() {
+    historyMoves++;
+}
+
+void LooperAudioProcessor::exportLoops(const juce::File& destination, int loopIndex, LoopExporter::Mode mode, LoopExporter::Format format) {
+    if (loopIndex >= loopCount) return;
+
+    LoopExporter::Request request;
+    request.destination = destination;
+    request.loopIndex = loopIndex;
+    request.loopCount = loopCount;
+    request.mode = mode;
+    request.format = format;
+    request.sampleRate = getSampleRate();
+    for (int i = 0; i < loopCount; i++) {
+        float decibles = (loopVolumes[i] - 1) * -minLoopDb;
+        request.gains[i] = juce::Decibels::decibelsToGain(decibles, minLoopDb);
     }
+    loopExporter.request(request);
+}
+
+bool LooperAudioProcessor::isExporting() const {
+    return loopExporter.isBusy();
+}
+
+void LooperAudioProcessor::setHistoryBudget(int megabytes) {
+    historyMegabytes = juce::jlimit(0, maxHistoryMegabytes, megabytes);
+    valueTree.state.setProperty("historyMegabytes", historyMegabytes, nullptr);
+}
+
+void LooperAudioProcessor::setHistoryFormat(SampleFormat format) {
+    historyFormat = format;
+    valueTree.state.setProperty("historyFormat", (int)format, nullptr);
+}
+
+void LooperAudioProcessor::setLoopFormat(SampleFormat format) {
+    loopFormat = format;
+    valueTree.state.setProperty("loopFormat", (int)format, nullptr);
+}
+
+LooperAudioProcessor::Settings LooperAudioProcessor::getSettings() const {
+    const FadeTable& fade = nextLoop.getFade();
+    return { fade.getLength(), fade.getCurve(), loopSharer.getMode(), minBpm, lockLoopMemory, loopFileFolder,
+        requestedLoopCount, requestedLoopBars, requestedRecordMode, feedback.load(), mixThreads, historyMegabytes,
+        historyFormat, loopFormat };
+}
+
+void LooperAudioProcessor::applySettings() {
+    if (preparedSampleRate == 0) return;    // the host's first prepareToPlay will pick them up
 
+    bool wasSuspended = isSuspended();
+    suspendProcessing(true);
+    prepareToPlay(getSampleRate(), getBlockSize());
+    if (!wasSuspended) suspendProcessing(false);
+}
+
+void LooperAudioProcessor::setRecordMode(RecordMode mode, float feedback) {
+    requestedRecordMode = mode;
+    this->feedback = juce::jlimit(0.f, 1.f, feedback);
+
+    valueTree.state.setProperty("recordMode", (int)mode, nullptr);
+    valueTree.state.setProperty("feedback", this->feedback.load(), nullptr);
+}
+
+void LooperAudioProcessor::setShareMode(ShareMode mode) {
+    loopSharer.setMode(mode);
+    valueTree.state.setProperty("shareMode", (int)mode, nullptr);
+}
+
+juce::AudioProcessorValueTreeState::ParameterLayout LooperAudioProcessor::createParameters() {
+    std::vector<std::unique_ptr<juce::RangedAudioParameter>> params;
+
+    // hosts address parameters by index, so the first defaultLoopCount loops keep the order they always had
+    // and the rest are appended after MUTEINPUT
+    auto addLoopParameters = [&params](int from, int to) {
+        for (int i = from; i < to; i++) {
+            const juce::String number(i + 1);
+            params.push_back(std::make_unique<juce::AudioParameterBool>("LOOP" + number, "Loop" + number, false));
+        }
+
+        for (int i = from; i < to; i++) {
+            const juce::String number(i + 1);
+            params.push_back(std::make_unique<juce::AudioParameterFloat>("VOLUME" + number, "Volume" + number, minLoopDb, 0.f, 0.f));
+        }
+
+        for (int i = from; i < to; i++) {
+            const juce::String number(i + 1);
+            params.push_back(std::make_unique<juce::AudioParameterBool>("MONITOR" + number, "Monitor" + number, false));
+        }
+    };
+
+    addLoopParameters(0, defaultLoopCount);
     params.push_back(std::make_unique<juce::AudioParameterBool>("MUTEINPUT", "muteinput", false));
+    addLoopParameters(defaultLoopCount, maxLoops);
 
     return { params.begin(), params.end() };
 }
 
 void LooperAudioProcessor::setupParameterListeners() {
-    for (int i = 0; i < nLoops; i++) {
+    for (int i = 0; i < maxLoops; i++) {
         const juce::String number(i + 1);
 
         listeners.push_back(std::make_unique<ButtonListener>(loopDown[i], i, *this));
         valueTree.getParameter("LOOP" + number)->addListener(listeners.back().get());
 
+        volumeParameters[i] = valueTree.getParameter("VOLUME" + number);
         listeners.push_back(std::make_unique<VolumeListener>(loopVolumes[i], i, *this));
-        valueTree.getParameter("VOLUME" + number)->addListener(listeners.back().get());
+        volumeParameters[i]->addListener(listeners.back().get());
 
         listeners.push_back(std::make_unique<ToggleButtonListener>(i, *this));
         valueTree.getParameter("MONITOR" + number)->addListener(listeners.back().get());
@@ -342,19 +963,10 @@ void LooperAudioProcessor::setupParameterListeners() {
     valueTree.getParameter("MUTEINPUT")->addListener(listeners.back().get());
 }
 
-void LooperAudioProcessor::setupTempBuffers(int len) {
-    nSamples = len;
-    bufferStack.setupBuffersIfNeeded(len, 0.f);
-}
-
-float LooperAudioProcessor::getRMS(int loopIndex) const {
-    return loopRMSs[loopIndex];
-}
-
-void LooperAudioProcessor::setRMS(int loopIndex, float value) {
-    loopRMSs[loopIndex] = value;
+void LooperAudioProcessor::addMeterViewer() {
+    levelMeter.addViewer();
 }
 
-float LooperAudioProcessor::getInputRMS() const {
-    return inputRMS;
+void LooperAudioProcessor::removeMeterViewer() {
+    levelMeter.removeViewer();
 }
\ No newline at end of file
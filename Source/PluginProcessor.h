@@ -10,9 +10,24 @@
 
 #include <JuceHeader.h>
 #include "CopyLoop.h"
+#include "Overdub.h"
+#include "LoopHistory.h"
 #include "LoopSyncer.h"
+#include "LoopSharer.h"
+#include "LoopMemory.h"
+#include "LoopStretcher.h"
+#include "Resample.h"
+#include "ParallelFor.h"
+#include "LoopArchive.h"
+#include "LoopExporter.h"
+#include "LoopReaders.h"
+#include "LevelMeter.h"
+#include "LoopMixer.h"
+#include "MixWorkers.h"
+#include "ScratchArena.h"
+#include "TripleBuffer.h"
+#include "TransportCursor.h"
 #include "Constants.h"
-#include "BufferStack.h"
 
 //==============================================================================
 /**
@@ -64,42 +79,241 @@ public:
     void stopRecordLoop() override;
     void setLoopVolume(int loopIndex, float volume) override;
 
+    /*
+    * Set the crossfade applied where every loop wraps. Builds the fade table if needed, so call
+    * this from the message thread; the audio thread picks the new table up on its next block.
+    * @param lengthInSamples Fade length, clamped to 1..MAX_FADE_SAMPLES.
+    * @param curve Shape of the fade.
+    */
+    void setFade(int lengthInSamples, FadeCurve curve);
+
+    /*
+    * Choose whether this instance plays its own loops, shares them with linked instances,
+    * or plays the loops another instance is sharing. Following starts right away, but loop memory
+    * moves on the next prepareToPlay: a sharing instance keeps its loops in shared memory instead of
+    * any loop file folder, and a following one keeps none and doesn't record. Message thread.
+    */
+    void setShareMode(ShareMode mode);
+
+    /*
+    * Loop memory is allocated up front for tempos down to minBpm, and optionally locked into RAM.
+    * Slower tempos still work, the memory just grows in the background first. Takes effect on the
+    * next prepareToPlay. Message thread.
+    */
+    void setLoopMemoryOptions(double minBpm, bool lockPages);
+
+    /*
+    * Keep loop memory in files in the given folder instead of RAM, or in RAM again for an empty folder.
+    * Only the loops around the playhead stay in RAM, and if the host crashes the loops are picked up from
+    * the files the next time this instance's state is loaded. Takes effect on the next prepareToPlay.
+    * Message thread.
+    */
+    void setLoopFileFolder(const juce::String& folder);
+
+    /*
+    * How many loops this instance has and how many bars each one lasts. Changing either starts over with
+    * empty loops, so like the memory options it takes effect on the next prepareToPlay. Message thread.
+    * @param loopCount Clamped to 1..maxLoops.
+    * @param bars Clamped to 1..maxLoopBars, of beatsPerBar beats each.
+    */
+    void setLoopLayout(int loopCount, int bars);
+
+    /*
+    * Whether takes replace a loop or are layered onto it in place. Overdubbing needs no copy loop, so
+    * switching reallocates loop memory: like the layout, it takes effect on the next prepareToPlay and
+    * starts over with empty loops. Feedback applies right away. Message thread.
+    * @param feedback Gain an overdub applies to what the loop already held, clamped to 0..1.
+    */
+    void setRecordMode(RecordMode mode, float feedback);
+
+    /*
+    * Helper threads that share the loop mixing with the audio thread once there are at least
+    * LoopMixer::parallelLoopThreshold loops; below that, waking them would cost more than it saves.
+    * Takes effect on the next prepareToPlay. Message thread.
+    * @param threads Clamped to 0..maxMixThreads, where 0 mixes everything on the audio thread.
+    */
+    void setMixThreads(int threads);
+    static constexpr int maxMixThreads = 15;
+
+    /*
+    * Undo or redo the last take or overdub pass. Any recording stops, and the change lands at the top of
+    * the loop so the loop switches over from its start. Message thread.
+    */
+    void undo();
+    void redo();
+
+    /*
+    * Memory set aside for undo history. Older steps are dropped to stay within it. Takes effect on the next
+    * prepareToPlay. Message thread.
+    * @param megabytes Clamped to 0..maxHistoryMegabytes, where 0 turns undo off.
+    */
+    void setHistoryBudget(int megabytes);
+    static constexpr int maxHistoryMegabytes = 4096;
+
+    /*
+    * How undo history keeps the audio it saved. int16 and half fit twice as many steps into the budget as
+    * float32, at the cost of precision in whatever is undone or redone; int16 and int24 also clip a layered
+    * loop that went past full scale. Takes effect on the next prepareToPlay, which starts the history over.
+    * Message thread.
+    */
+    void setHistoryFormat(SampleFormat format);
+
+    /*
+    * How loops keep their audio while recording replaces takes. int16 and half halve the loop memory and
+    * what the mix reads from it every block, at the precision set out in SampleFormat; overdubbing always
+    * keeps float32, as rounding every pass would add up. Takes effect on the next prepareToPlay, which
+    * converts the loops. Message thread.
+    */
+    void setLoopFormat(SampleFormat format);
+
+    // What the setters above were last given, e.g. for the editor's settings menu. Message thread.
+    struct Settings {
+        int fadeLength;
+        FadeCurve fadeCurve;
+        ShareMode shareMode;
+        double minBpm;
+        bool lockLoopMemory;
+        juce::String loopFileFolder;
+        int loopCount;
+        int loopBars;
+        RecordMode recordMode;
+        float feedback;
+        int mixThreads;
+        int historyMegabytes;
+        SampleFormat historyFormat;
+        SampleFormat loopFormat;
+    };
+    Settings getSettings() const;
+
+    /*
+    * Apply the settings that wait for prepareToPlay straight away, instead of whenever the host next calls
+    * it, by suspending processing and preparing again at the same rate and block size. Does nothing before
+    * the host first prepares the plugin. Message thread.
+    */
+    void applySettings();
+
+    /*
+    * Write loops to audio files in the background, as they were at the end of the last pass. Stems and
+    * mixes use the loops' current volumes. Message thread.
+    * @param destination The file for one loop or a mix, otherwise the folder to write each loop into.
+    * @param loopIndex A loop, or -1 for every loop.
+    */
+    void exportLoops(const juce::File& destination, int loopIndex, LoopExporter::Mode mode, LoopExporter::Format format);
+    bool isExporting() const;
+
     juce::AudioProcessorValueTreeState valueTree;
 
-    int recordingIndex = -1;
-    int beat = -1;
-    int monitorIndex = -1;
-    float getRMS(int loopIndex) const;
-    float getInputRMS() const;
+    /*
+    * Everything the editor shows, published by the audio thread at the end of each block.
+    * version only moves when something else in the snapshot changed, so readers can skip unchanged frames.
+    */
+    struct UIState {
+        uint32_t version = 0;
+        int recordingIndex = -1;
+        int beat = -1;
+        int monitorIndex = -1;
+        int loopCount = defaultLoopCount;
+        int beatsPerLoop = defaultLoopBars * beatsPerBar;
+        float loopRMS[maxLoops] = {};   // only the first loopCount are used
+        float loopPeak[maxLoops] = {};
+        float inputRMS = 0.f;
+        float inputPeak = 0.f;
+        int undoSteps = 0;
+        int redoSteps = 0;
+    };
+
+    // Pick up the newest snapshot. Never blocks, but only one reader (the editor) may call it.
+    const UIState& getUIState();
+
+    // Levels are only measured while at least one viewer, such as an open editor, is registered.
+    void addMeterViewer();
+    void removeMeterViewer();
 
 private:
     juce::AudioProcessorValueTreeState::ParameterLayout createParameters();
     void setupParameterListeners();
-    void setupTempBuffers(int len);
-    void readWriteLoops(Loop<float> loops[], CopyLoop<float>& tempLoop, size_t currentSample, const float* readBuffer, float* outBuffer);
-    float calculateRMS(const Loop<float>& loop, size_t currentSample, int nSamples);
-    float calculateRMS(const float* buffer, int nSamples) const;
-    void setupLoops(size_t samplesPerBeat);
-    void setRMS(int loopIndex, float value);
+    void readWriteLoops(int offset, float* const* channels, int count, const float* targetGains, MixKernel::Levels* levels);
+    void setupLoops(double samplesPerBeat);
+    void assignLoopMemory(const LoopMemory::Slab& slab);
+    bool hasTakes() const;
+    void adoptStretchedLoops(double samplesPerBeat);
+    bool resampleLoops(double fromRate, double toRate, size_t capacity);
+    void applyHistoryMoves();
+    void restorePendingLoops();
+    void recoverLoops(const LoopMemory::Slab& slab);
+    std::string loopFilePath(ShareMode mode) const;
+    void setRecordingLoop(int loopIndex);
+    void restartTake();
+    int replacedLoop() const;
+    LoopPosition positionFor(const Loop<float>& loop, int offset) const;
+    void publishUIState();
     
-    bool loopDown[nLoops];
-    float loopVolumes[nLoops];
-    float loopRMSs[nLoops];
-    float inputRMS = 0.f;
+    std::atomic<int> recordingIndex { -1 };   // written on the audio thread, read by parameter listeners
+    int beat = -1;
+    std::atomic<int> monitorIndex { -1 };     // written by parameter listeners, read on the audio thread
+
+    // every per-loop array is sized for maxLoops up front; only the first loopCount entries are live
+    int loopCount = defaultLoopCount;
+    int beatsPerLoop = defaultLoopBars * beatsPerBar;
+    int requestedLoopCount = defaultLoopCount;  // from setLoopLayout, applied in prepareToPlay
+    int requestedLoopBars = defaultLoopBars;
+    RecordMode recordMode = RecordMode::replace;
+    RecordMode requestedRecordMode = RecordMode::replace;
+    ShareMode shareMode = ShareMode::off;   // as of the last prepareToPlay; the sharer has the one asked for
+    std::atomic<float> feedback { 1.f };
+
+    static constexpr int defaultHistoryMegabytes = 64;
+    int historyMegabytes = defaultHistoryMegabytes;
+    SampleFormat historyFormat = SampleFormat::float32;
+    SampleFormat loopFormat = SampleFormat::float32;   // for replace mode, applied in prepareToPlay
+    std::atomic<int> historyMoves { 0 };    // redos less undos asked for, applied at the top of the loop
+
+    bool loopDown[maxLoops];
+    float loopVolumes[maxLoops];
+    juce::RangedAudioParameter* volumeParameters[maxLoops];    // looked up once, as syncing sets them on the audio thread
+    float loopGains[maxLoops];  // gain applied at the end of the last block, where the next block's ramp starts
     bool muteInput = false;
 
-    size_t samplesPerBeat = 0;
-    Loop<float> loopsL[nLoops];
-    Loop<float> loopsR[nLoops];
-    size_t readIndex[nLoops];
-    BufferStack<float> bufferStack;
+    double samplesPerBeat = 0;   // tempo the loops are at, which lags the host's while they're being stretched
+    double preparedSampleRate = 0;  // the rate the loops were recorded at, from the last prepareToPlay
+    TransportCursor cursor;
+    int numChannels = 2;
+    static constexpr double defaultMinBpm = 60.0;
+    double minBpm = defaultMinBpm;
+    bool lockLoopMemory = false;
+    static constexpr double loopFileReadAheadSeconds = 2.0;
+    juce::String loopFileFolder;
+    juce::String loopFileId;    // names this instance's loop files, kept in the state so a crash can be recovered from
+    LoopMemory loopMemory;  // declared before the loops so it outlives everything that points into it
+
+    Loop<float> loops[maxLoops];
     int nSamples;
 
-    CopyLoop<float> nextLoopL;
-    CopyLoop<float> nextLoopR;
+    static constexpr int chunkSize = 256;   // host blocks are processed in chunks of at most this many samples
+    static constexpr int scratchSpansPerChannel = 4;    // chunk-sized spans the audio thread may hold at once
+    ScratchArena scratch;   // sized in prepareToPlay, emptied at the start of every block
+
+    int mixThreads = 0;
+    MixWorkers mixWorkers;  // started in prepareToPlay, stopped in releaseResources
+
+    static constexpr int inputMeter = maxLoops; // loops use meters 0..maxLoops-1, the input comes after them
+    LevelMeter<maxLoops + 1> levelMeter;
+
+    UIState lastUIState;    // audio thread's copy of what it last published
+    TripleBuffer<UIState> uiStates;
+
+    CopyLoop<float> nextLoop;   // only has memory in RecordMode::replace
+    Overdub<float> overdub;
+    LoopHistory history;    // prepared along with the loop memory it keeps pages of
 
     std::vector<std::unique_ptr<juce::AudioProcessorParameter::Listener>> listeners;
     LoopSyncer loopSyncer;
+    LoopReaders loopReaders;    // background threads that read the loops: the archive
+    LoopSharer loopSharer;
+    LoopStretcher loopStretcher;
+    LoopArchive loopArchive;
+    LoopExporter loopExporter;
+    std::vector<uint8_t> pendingLoops;  // loop audio from setStateInformation, waiting for the layout it was saved in
 
     struct ButtonListener : public juce::AudioProcessorParameter::Listener {
 
@@ -154,9 +368,11 @@ private:
 
         void parameterValueChanged(int parameterIndex, float newValue) override {
             if (newValue > 0.5f) {
-                looper.monitorIndex = loopIndex;
-            } else if (looper.monitorIndex == loopIndex) {
-                looper.monitorIndex = -1;
+                looper.monitorIndex.store(loopIndex);
+            } else {
+                // only clear it if another loop hasn't been picked in the meantime
+                int expected = loopIndex;
+                looper.monitorIndex.compare_exchange_strong(expected, -1);
             }
         }
 
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+/*
+* Sample rate conversion for loops: changes the length of a loop by resampling it, so it plays at the same
+* pitch and tempo at a new sample rate.
+*
+* Each output value is a windowed sinc interpolation of the input around where it falls. The sinc is
+* tabulated at a fixed number of fractional offsets (the phases of a polyphase filter) and interpolated
+* linearly between them, so any ratio works, not only small rational ones. Going down in rate, the cutoff
+* moves down with it so nothing folds back below the new Nyquist frequency. Like TimeStretch, the input is
+* taken as circular, so a loop that wraps seamlessly still does once resampled.
+*/
+namespace Resample {
+
+	constexpr int zeroCrossings = 32;	// on each side of the centre, at a cutoff of the input's Nyquist
+	constexpr int phases = 256;			// fractional offsets tabulated
+	constexpr double rolloff = 0.95;	// cutoff as a fraction of the lower of the two Nyquist frequencies
+	constexpr double kaiserBeta = 9.0;	// stopband around -90 dB
+
+	// Filter taps for every phase, plus one more row so the last phase has a neighbour to interpolate with.
+	struct Filter {
+		int taps = 0;
+		std::vector<float> coefficients;	// (phases + 1) rows of taps
+
+		const float* row(int phase) const {
+			return coefficients.data() + (size_t)phase * taps;
+		}
+	};
+
+	namespace detail {
+		// Zeroth order modified Bessel function of the first kind, for the Kaiser window.
+		inline double besselI0(double x) {
+			double sum = 1.0, term = 1.0;
+			for (int k = 1; k < 50 && term > sum * 1e-12; k++) {
+				term *= (x / (2.0 * k)) * (x / (2.0 * k));
+				sum += term;
+			}
+			return sum;
+		}
+
+		inline float dot(const float* a, const float* b, int count) {
+			// four running sums, so the compiler can keep them in one vector register
+			float sums[4] = {};
+			for (int i = 0; i < count; i += 4) {
+				for (int lane = 0; lane < 4; lane++) sums[lane] += a[i + lane] * b[i + lane];
+			}
+			return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+		}
+	}
+
+	/*
+	* Build the filter for a change of rate. It only depends on the ratio, so one filter serves every loop
+	* and channel going between the same two rates.
+	* @param ratio New sample rate over the old one.
+	*/
+	inline Filter design(double ratio) {
+		double cutoff = rolloff * std::min(1.0, ratio);		// relative to the input's Nyquist frequency
+		double halfWidth = zeroCrossings / cutoff;
+		Filter filter;
+		filter.taps = ((int)std::ceil(halfWidth) + 4) / 4 * 8;	// both halves past the window, in fours for detail::dot
+		filter.coefficients.resize((size_t)(phases + 1) * filter.taps);
+
+		const double pi = 3.14159265358979323846;
+		int centre = filter.taps / 2 - 1;	// the tap on the input value just before the output's position
+		double windowScale = 1.0 / detail::besselI0(kaiserBeta);
+		for (int phase = 0; phase <= phases; phase++) {
+			float* row = filter.coefficients.data() + (size_t)phase * filter.taps;
+			double sum = 0;
+			for (int tap = 0; tap < filter.taps; tap++) {
+				double x = tap - centre - (double)phase / phases;	// distance in input values
+				double t = x / halfWidth;
+				double window = std::abs(t) < 1.0 ? detail::besselI0(kaiserBeta * std::sqrt(1.0 - t * t)) * windowScale : 0.0;
+				double sinc = x == 0.0 ? 1.0 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+				row[tap] = (float)(cutoff * sinc * window);
+				sum += row[tap];
+			}
+			// unity gain at DC for every phase, so a constant stays constant however it lines up
+			for (int tap = 0; tap < filter.taps; tap++) row[tap] = (float)(row[tap] / sum);
+		}
+		return filter;
+	}
+
+	/*
+	* Resample part of one channel of a loop, wrapping around its ends. Parts can be rendered separately, e.g.
+	* to spread one long loop over several threads.
+	* @param input The loop at the old rate.
+	* @param inputLength Length of the loop now.
+	* @param output Where the loop at the new rate goes; outputLength values.
+	* @param outputLength Length to resample to. The whole input is spread over it, so the loop keeps its period.
+	* @param first The first output value to render.
+	* @param count How many output values to render.
+	*/
+	inline void render(const Filter& filter, const float* input, size_t inputLength, float* output, size_t outputLength,
+		size_t first, size_t count) {
+		if (inputLength == 0) return;
+
+		int centre = filter.taps / 2 - 1;
+		long length = (long)inputLength;
+		std::vector<float> taps(filter.taps);
+		std::vector<float> wrapped(filter.taps);
+		double step = (double)inputLength / outputLength;
+		for (size_t n = first; n < first + count; n++) {
+			double position = n * step;
+			size_t index = (size_t)position;
+			double offset = (position - index) * phases;
+			int phase = std::min((int)offset, phases - 1);
+			float blend = (float)(offset - phase);
+
+			const float* below = filter.row(phase);
+			const float* above = filter.row(phase + 1);
+			for (int tap = 0; tap < filter.taps; tap++) taps[tap] = below[tap] + blend * (above[tap] - below[tap]);
+
+			// only the taps near either end of the loop need wrapping around
+			long start = (long)index - centre;
+			const float* values = input + start;
+			if (start < 0 || start + filter.taps > length) {
+				for (int tap = 0; tap < filter.taps; tap++) wrapped[tap] = input[((start + tap) % length + length) % length];
+				values = wrapped.data();
+			}
+			output[n] = detail::dot(values, taps.data(), filter.taps);
+		}
+	}
+}
\ No newline at end of file
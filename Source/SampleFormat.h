@@ -0,0 +1,257 @@
+#pragma once
+
+#include "MixKernel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+* Formats for keeping audio in less memory than a float per value, and the loops that convert to and from
+* them. Fixed point formats clip anything beyond full scale (±1); half float keeps the range and loses
+* precision instead, relative to the signal. Measured on a full scale sine:
+*
+*   float32   4 bytes   lossless
+*   int24     3 bytes   ~145 dB SNR, relative to full scale
+*   int16     2 bytes   ~98 dB SNR, relative to full scale
+*   half      2 bytes   ~73 dB SNR, relative to the signal at any level above about -80 dBFS
+*
+* int16 conversion is vectorized for SSE2 and NEON, and decoding it costs about what copying floats does.
+* int24 and half are scalar and several times slower, which is fine off the mix path; of the smaller
+* formats, int16 is the one to keep loops in, since the mix decodes every loop every block.
+*/
+enum class SampleFormat {
+	float32,
+	int24,
+	int16,
+	half
+};
+
+namespace SampleConversion {
+
+	inline size_t bytesPerValue(SampleFormat format) {
+		switch (format) {
+			case SampleFormat::int24: return 3;
+			case SampleFormat::int16:
+			case SampleFormat::half: return 2;
+			default: return sizeof(float);
+		}
+	}
+
+	namespace detail {
+
+		inline uint32_t bitsOf(float value) {
+			uint32_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+			return bits;
+		}
+
+		inline float fromBits(uint32_t bits) {
+			float value;
+			std::memcpy(&value, &bits, sizeof(value));
+			return value;
+		}
+
+		// Round to nearest even, with overflow to infinity and NaN kept a NaN.
+		inline uint16_t toHalf(float value) {
+			uint32_t bits = bitsOf(value);
+			uint32_t sign = bits & 0x80000000u;
+			bits ^= sign;
+
+			uint32_t half;
+			if (bits >= (127u + 16u) << 23) {
+				half = bits > 0x7f800000u ? 0x7e00u : 0x7c00u;
+			} else if (bits < (127u - 14u) << 23) {
+				// too small for a normal half: let the float adder shift and round the mantissa for us
+				const float magic = fromBits(((127u - 15u) + (23u - 10u) + 1u) << 23);
+				half = bitsOf(fromBits(bits) + magic) - bitsOf(magic);
+			} else {
+				uint32_t odd = (bits >> 13) & 1u;
+				bits += ((uint32_t)(15 - 127) << 23) + 0xfffu + odd;
+				half = bits >> 13;
+			}
+			return (uint16_t)(half | (sign >> 16));
+		}
+
+		inline float fromHalf(uint16_t half) {
+			const uint32_t exponent = 0x7c00u << 13;
+			uint32_t bits = ((uint32_t)half & 0x7fffu) << 13;
+			uint32_t shifted = bits & exponent;
+			bits += (uint32_t)(127 - 15) << 23;
+			if (shifted == exponent) {
+				bits += (uint32_t)(128 - 16) << 23;	// infinity or NaN
+			} else if (shifted == 0) {
+				bits += 1u << 23;	// subnormal: renormalize through the float unit
+				bits = bitsOf(fromBits(bits) - fromBits(113u << 23));
+			}
+			return fromBits(bits | (((uint32_t)half & 0x8000u) << 16));
+		}
+
+		constexpr float int16Scale = 32767.f;
+		constexpr float int24Scale = 8388607.f;
+
+		inline int32_t quantize(float value, float scale) {
+			return (int32_t)std::lrint(std::min(std::max(value, -1.f), 1.f) * scale);
+		}
+
+		inline void encodeInt16(const float* src, int16_t* dest, size_t count) {
+			size_t i = 0;
+#if LOOPER_SSE
+			// the conversion rounds to nearest and the pack saturates, which together clip at full scale
+			const __m128 scale = _mm_set1_ps(int16Scale);
+			for (; i + 8 <= count; i += 8) {
+				__m128i low = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), scale));
+				__m128i high = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_packs_epi32(low, high));
+			}
+#elif LOOPER_NEON
+			const float32x4_t scale = vdupq_n_f32(int16Scale);
+			for (; i + 8 <= count; i += 8) {
+				int32x4_t low = vcvtnq_s32_f32(vmulq_f32(vld1q_f32(src + i), scale));
+				int32x4_t high = vcvtnq_s32_f32(vmulq_f32(vld1q_f32(src + i + 4), scale));
+				vst1q_s16(dest + i, vcombine_s16(vqmovn_s32(low), vqmovn_s32(high)));
+			}
+#endif
+			for (; i < count; i++) dest[i] = (int16_t)quantize(src[i], int16Scale);
+		}
+
+		/*
+		* Convert int16 values back to float and add them into dest with a gain ramp; gain 1, step 0 and
+		* an empty dest make it a plain decode.
+		*/
+		template<bool Add>
+		inline void decodeInt16(const int16_t* src, float* dest, size_t count, float gain, float gainStep) {
+			size_t i = 0;
+			gain /= int16Scale;
+			gainStep /= int16Scale;
+#if LOOPER_SSE
+			__m128 gains = MixKernel::detail::rampStart(gain, gainStep);
+			const __m128 step = _mm_set1_ps(gainStep * 4.f);
+			for (; i + 8 <= count; i += 8) {
+				__m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+				// sign extend by placing each value in the top half of a 32 bit lane and shifting it down
+				__m128 low = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16));
+				__m128 high = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(packed, packed), 16));
+				__m128 lowGains = gains;
+				__m128 highGains = _mm_add_ps(gains, step);
+				gains = _mm_add_ps(highGains, step);
+				if (Add) {
+					_mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i), _mm_mul_ps(low, lowGains)));
+					_mm_storeu_ps(dest + i + 4, _mm_add_ps(_mm_loadu_ps(dest + i + 4), _mm_mul_ps(high, highGains)));
+				} else {
+					_mm_storeu_ps(dest + i, _mm_mul_ps(low, lowGains));
+					_mm_storeu_ps(dest + i + 4, _mm_mul_ps(high, highGains));
+				}
+			}
+#elif LOOPER_NEON
+			float32x4_t gains = MixKernel::detail::rampStart(gain, gainStep);
+			const float32x4_t step = vdupq_n_f32(gainStep * 4.f);
+			for (; i + 8 <= count; i += 8) {
+				int16x8_t packed = vld1q_s16(src + i);
+				float32x4_t low = vcvtq_f32_s32(vmovl_s16(vget_low_s16(packed)));
+				float32x4_t high = vcvtq_f32_s32(vmovl_s16(vget_high_s16(packed)));
+				float32x4_t lowGains = gains;
+				float32x4_t highGains = vaddq_f32(gains, step);
+				gains = vaddq_f32(highGains, step);
+				if (Add) {
+					vst1q_f32(dest + i, vmlaq_f32(vld1q_f32(dest + i), low, lowGains));
+					vst1q_f32(dest + i + 4, vmlaq_f32(vld1q_f32(dest + i + 4), high, highGains));
+				} else {
+					vst1q_f32(dest + i, vmulq_f32(low, lowGains));
+					vst1q_f32(dest + i + 4, vmulq_f32(high, highGains));
+				}
+			}
+#endif
+			for (; i < count; i++) {
+				float value = (float)src[i] * (gain + gainStep * (float)i);
+				dest[i] = Add ? dest[i] + value : value;
+			}
+		}
+
+		template<bool Add>
+		inline void decodeInt24(const uint8_t* src, float* dest, size_t count, float gain, float gainStep) {
+			gain /= int24Scale;
+			gainStep /= int24Scale;
+			for (size_t i = 0; i < count; i++) {
+				const uint8_t* bytes = src + 3 * i;
+				int32_t value = (int32_t)(((uint32_t)bytes[0] << 8) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 24)) >> 8;
+				float scaled = (float)value * (gain + gainStep * (float)i);
+				dest[i] = Add ? dest[i] + scaled : scaled;
+			}
+		}
+
+		template<bool Add>
+		inline void decodeHalf(const uint16_t* src, float* dest, size_t count, float gain, float gainStep) {
+			for (size_t i = 0; i < count; i++) {
+				float scaled = fromHalf(src[i]) * (gain + gainStep * (float)i);
+				dest[i] = Add ? dest[i] + scaled : scaled;
+			}
+		}
+
+		template<bool Add>
+		inline void decode(SampleFormat format, const void* src, float* dest, size_t count, float gain, float gainStep) {
+			switch (format) {
+				case SampleFormat::int24:
+					decodeInt24<Add>(static_cast<const uint8_t*>(src), dest, count, gain, gainStep);
+					break;
+				case SampleFormat::int16:
+					decodeInt16<Add>(static_cast<const int16_t*>(src), dest, count, gain, gainStep);
+					break;
+				case SampleFormat::half:
+					decodeHalf<Add>(static_cast<const uint16_t*>(src), dest, count, gain, gainStep);
+					break;
+				default:
+					if (Add) {
+						MixKernel::addWithRamp(dest, static_cast<const float*>(src), count, gain, gainStep);
+					} else if (gain == 1.f && gainStep == 0.f) {
+						std::memcpy(dest, src, count * sizeof(float));
+					} else {
+						std::copy_n(static_cast<const float*>(src), count, dest);
+						MixKernel::scaleWithRamp(dest, count, gain, gainStep);
+					}
+					break;
+			}
+		}
+	}
+
+	// Store count floats in the given format at dest, which holds count * bytesPerValue(format) bytes.
+	inline void encode(SampleFormat format, const float* src, void* dest, size_t count) {
+		switch (format) {
+			case SampleFormat::int24: {
+				uint8_t* bytes = static_cast<uint8_t*>(dest);
+				for (size_t i = 0; i < count; i++) {
+					int32_t value = detail::quantize(src[i], detail::int24Scale);
+					bytes[3 * i] = (uint8_t)value;
+					bytes[3 * i + 1] = (uint8_t)(value >> 8);
+					bytes[3 * i + 2] = (uint8_t)(value >> 16);
+				}
+				break;
+			}
+			case SampleFormat::int16:
+				detail::encodeInt16(src, static_cast<int16_t*>(dest), count);
+				break;
+			case SampleFormat::half: {
+				uint16_t* halves = static_cast<uint16_t*>(dest);
+				for (size_t i = 0; i < count; i++) halves[i] = detail::toHalf(src[i]);
+				break;
+			}
+			default:
+				std::memcpy(dest, src, count * sizeof(float));
+				break;
+		}
+	}
+
+	// Convert count stored values back to floats.
+	inline void decode(SampleFormat format, const void* src, float* dest, size_t count) {
+		detail::decode<false>(format, src, dest, count, 1.f, 0.f);
+	}
+
+	/*
+	* Convert count stored values and add them into dest in the same pass, with a gain that ramps from gain
+	* by gainStep per value, like MixKernel::addWithRamp.
+	*/
+	inline void decodeAdd(SampleFormat format, const void* src, float* dest, size_t count, float gain, float gainStep) {
+		detail::decode<true>(format, src, dest, count, gain, gainStep);
+	}
+}
\ No newline at end of file
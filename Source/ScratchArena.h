@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <new>
+
+/*
+* Per-block scratch memory for the audio thread. Spans are bumped off one 64 byte aligned block sized in
+* prepareToPlay, so taking one never allocates and there's no limit on how many a block takes, only on
+* their total size. Everything is given back at once by reset at the end of the block; nested users can
+* give back just their own spans with a Scope.
+*/
+class ScratchArena {
+public:
+	static constexpr size_t alignment = 64;
+
+	// Gives back every span taken while it was alive.
+	class Scope {
+	public:
+		explicit Scope(ScratchArena& arena) : arena(arena), mark(arena.used) {}
+		~Scope() {
+			arena.used = mark;
+		}
+
+	private:
+		ScratchArena& arena;
+		const size_t mark;
+	};
+
+	~ScratchArena() {
+		release();
+	}
+
+	// Bytes one span of count values takes up, alignment included. Handy for sizing allocate.
+	template<typename T>
+	static constexpr size_t bytesFor(size_t count) {
+		return (sizeof(T) * count + alignment - 1) / alignment * alignment;
+	}
+
+	/*
+	* Set aside the arena's memory, touching every page so the audio thread never faults on it. Allocates,
+	* so only call this while the audio thread isn't running, e.g. from prepareToPlay.
+	* @param bytes Most the audio thread will hold at once; see bytesFor.
+	*/
+	void allocate(size_t bytes) {
+		bytes = bytesFor<char>(bytes);
+		if (bytes != capacity) {
+			release();
+			memory = static_cast<char*>(::operator new(bytes, std::align_val_t(alignment)));
+			capacity = bytes;
+		}
+		std::memset(memory, 0, capacity);
+		used = 0;
+		highWater.store(0, std::memory_order_relaxed);
+	}
+
+	/*
+	* Audio thread: take an uninitialised, 64 byte aligned span.
+	* @return Null if the arena is out of room, which means allocate was sized too small.
+	*/
+	template<typename T>
+	T* get(size_t count) {
+		size_t bytes = bytesFor<T>(count);
+		if (bytes > capacity - used) {
+			assert(false && "ScratchArena too small, see allocate");
+			return nullptr;
+		}
+
+		char* span = memory + used;
+		used += bytes;
+		if (used > highWater.load(std::memory_order_relaxed)) highWater.store(used, std::memory_order_relaxed);
+		return reinterpret_cast<T*>(span);
+	}
+
+	/*
+	* Audio thread: take one span per channel, plus the array of pointers to them.
+	* @return Null if the arena is out of room.
+	*/
+	template<typename T>
+	T** getChannels(int numChannels, size_t count) {
+		T** channels = get<T*>(numChannels);
+		if (channels == nullptr) return nullptr;
+		for (int channel = 0; channel < numChannels; channel++) {
+			channels[channel] = get<T>(count);
+			if (channels[channel] == nullptr) return nullptr;
+		}
+		return channels;
+	}
+
+	// Audio thread: give back every span at once, at the end of the block.
+	void reset() {
+		used = 0;
+	}
+
+	// Most bytes ever held at once since allocate. Safe from any thread, for tuning the size.
+	size_t getHighWater() const {
+		return highWater.load(std::memory_order_relaxed);
+	}
+
+	size_t getCapacity() const {
+		return capacity;
+	}
+
+private:
+	void release() {
+		if (memory == nullptr) return;
+		::operator delete(memory, std::align_val_t(alignment));
+		memory = nullptr;
+		capacity = 0;
+	}
+
+	char* memory = nullptr;
+	size_t capacity = 0;
+	size_t used = 0;
+	std::atomic<size_t> highWater { 0 };
+};
\ No newline at end of file
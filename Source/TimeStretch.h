@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+/*
+* WSOLA time stretching for loops: changes the length of a loop without changing its pitch.
+*
+* The output is built from overlapping Hann windowed grains of the input. Each grain is taken from roughly
+* where it should come from in time, nudged by up to a few milliseconds to the spot that lines up best with
+* the grain before it, so the grains add together without phasing. Loops are circular, so reading past
+* the end of the input wraps to its start and the output wraps the same way, keeping the result seamless.
+*
+* Grain positions are found once per loop, on a mono mix, and then every channel is rendered from the same
+* positions. That keeps the stereo image intact and lets channels render in parallel.
+*/
+namespace TimeStretch {
+
+	constexpr int hop = 512;			// output samples between grains
+	constexpr int grainLength = 2 * hop;	// Hann grains at 50% overlap
+	constexpr int tolerance = 256;		// furthest a grain may be nudged, in samples
+	constexpr int correlationStride = 2;	// only every other sample is compared while searching
+	constexpr int coarseStep = 4;		// offsets tried in the first pass of the search
+
+	// Where each grain starts in the output and in the input, both before wrapping.
+	struct Plan {
+		size_t inputLength = 0;
+		size_t outputLength = 0;
+		std::vector<long> outputStarts;
+		std::vector<long> inputStarts;
+	};
+
+	namespace detail {
+		// Circular copy of signal starting at start, so callers can index without wrapping.
+		inline std::vector<float> unwrap(const float* signal, size_t length, long start, size_t count) {
+			std::vector<float> out(count);
+			long n = (long)length;
+			long index = ((start % n) + n) % n;
+			for (size_t i = 0; i < count; i++) {
+				out[i] = signal[index];
+				if (++index == n) index = 0;
+			}
+			return out;
+		}
+
+		inline float correlate(const float* a, const float* b, int count) {
+			float sum = 0.f;
+			for (int i = 0; i < count; i += correlationStride) {
+				sum += a[i] * b[i];
+			}
+			return sum;
+		}
+	}
+
+	/*
+	* Work out where every grain comes from.
+	* @param mono The loop mixed down to one channel.
+	* @param inputLength Length of the loop now.
+	* @param outputLength Length it should have.
+	*/
+	inline Plan plan(const float* mono, size_t inputLength, size_t outputLength) {
+		Plan plan;
+		plan.inputLength = inputLength;
+		plan.outputLength = outputLength;
+
+		size_t grains = std::max<size_t>(1, (size_t)std::lround((double)outputLength / hop));
+		double outputHop = (double)outputLength / grains;
+		double inputHop = (double)inputLength / grains;
+
+		// the input is read with a margin either side so every candidate is a plain slice
+		long margin = hop + tolerance;
+		std::vector<float> input = detail::unwrap(mono, inputLength, -margin, inputLength + 2 * margin + grainLength);
+		auto at = [&](long position) { return input.data() + margin + position; };
+
+		long previous = 0;
+		for (size_t k = 0; k < grains; k++) {
+			long outputCentre = std::lround(k * outputHop);
+			long nominal = std::lround(k * inputHop);
+			long best = nominal;
+
+			if (k > 0) {
+				// compare the lead-in of the grain that would naturally follow the previous one
+				// with the lead-in of each candidate around the nominal spot
+				long natural = previous + (outputCentre - plan.outputStarts.back() - hop);
+				const float* target = at(natural - hop);
+				float bestScore = -1e30f;
+
+				// coarse pass over the whole range, then every offset around the best coarse one
+				auto search = [&](long from, long to, long step) {
+					for (long candidate = from; candidate <= to; candidate += step) {
+						float score = detail::correlate(target, at(candidate - hop), hop);
+						if (score > bestScore) {
+							bestScore = score;
+							best = candidate;
+						}
+					}
+				};
+				search(nominal - tolerance, nominal + tolerance, coarseStep);
+				long centre = best;
+				search(std::max(nominal - tolerance, centre - coarseStep + 1), std::min(nominal + tolerance, centre + coarseStep - 1), 1);
+			}
+
+			plan.outputStarts.push_back(outputCentre - hop);
+			plan.inputStarts.push_back(best - hop);
+			previous = best;
+		}
+
+		return plan;
+	}
+
+	/*
+	* Render one channel of the stretched loop.
+	* @param input The channel at its current length.
+	* @param output Room for plan.outputLength values.
+	*/
+	inline void render(const Plan& plan, const float* input, float* output) {
+		long outputLength = (long)plan.outputLength;
+		std::vector<float> weights(plan.outputLength, 0.f);
+		std::fill_n(output, plan.outputLength, 0.f);
+
+		std::vector<float> window(grainLength);
+		for (int n = 0; n < grainLength; n++) {
+			window[n] = 0.5f - 0.5f * (float)std::cos(2.0 * 3.14159265358979323846 * n / grainLength);
+		}
+
+		for (size_t k = 0; k < plan.outputStarts.size(); k++) {
+			std::vector<float> grain = detail::unwrap(input, plan.inputLength, plan.inputStarts[k], grainLength);
+			long index = ((plan.outputStarts[k] % outputLength) + outputLength) % outputLength;
+
+			for (int n = 0; n < grainLength; n++) {
+				output[index] += window[n] * grain[n];
+				weights[index] += window[n];
+				if (++index == outputLength) index = 0;
+			}
+		}
+
+		// grain spacing isn't a whole number of samples, so the windows don't quite sum to one
+		for (size_t i = 0; i < plan.outputLength; i++) {
+			if (weights[i] > 1e-3f) output[i] /= weights[i];
+		}
+	}
+
+}
\ No newline at end of file
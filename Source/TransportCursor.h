@@ -0,0 +1,129 @@
+#pragma once
+
+#include "Loop.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+
+/*
+* Where the host's playhead is within the loop, worked out once per block and handed to every loop.
+*
+* A loop at the host tempo is rarely a whole number of samples long, so the loop length is kept as an
+* exact fraction of samples and loop k starts at floor(k * length). Each pass of the loop is then one sample
+* longer or shorter than the next as needed to stay on the host's bar lines, and the position never drifts,
+* however long the session runs. Everything is integer arithmetic.
+*/
+class TransportCursor {
+public:
+	/*
+	* Set the tempo. Cheap when nothing changed, so it can be called every block.
+	* @param sampleRate Host sample rate.
+	* @param bpm Host tempo. Resolved to a thousandth of a beat per minute.
+	* @param beatsPerLoop Beats in one pass of the loop.
+	*/
+	void setTempo(double sampleRate, double bpm, int beatsPerLoop) {
+		int64_t rate = std::max<int64_t>(1, std::llround(sampleRate));
+		int64_t milliBpm = std::max<int64_t>(1, std::llround(bpm * 1000));
+		if (rate == this->rate && milliBpm == this->milliBpm && beatsPerLoop == this->beatsPerLoop) return;
+
+		this->rate = rate;
+		this->milliBpm = milliBpm;
+		this->beatsPerLoop = beatsPerLoop;
+
+		// a beat is 60000 * rate / milliBpm samples
+		beatNumerator = 60000 * rate;
+		beatDenominator = milliBpm;
+		int64_t divisor = std::gcd(beatNumerator, beatDenominator);
+		beatNumerator /= divisor;
+		beatDenominator /= divisor;
+
+		samplesPerBeat = (double)beatNumerator / beatDenominator;
+		loopSize = (size_t)std::ceil(samplesPerBeat * beatsPerLoop);	// the same sum Loop::resize does
+		moveTo(sample);
+	}
+
+	/*
+	* Move to the start of a block.
+	* @param sample Host position in samples. Negative positions, as in a pre-roll, count back from loop 0.
+	*/
+	void moveTo(int64_t sample) {
+		this->sample = sample;
+		if (beatNumerator == 0) return;
+
+		int64_t loopNumerator = beatNumerator * beatsPerLoop;
+		loop = floorDivide(sample * beatDenominator, loopNumerator);
+		loopStart = startOf(loop);
+		nextStart = startOf(loop + 1);
+		beat = (int)(floorDivide(sample * beatDenominator, beatNumerator) - loop * beatsPerLoop);
+	}
+
+	/*
+	* The position a given number of samples into the block, for loops at the cursor's tempo.
+	* @param offset At most one loop length into the block.
+	*/
+	LoopPosition at(int offset) const {
+		int64_t position = sample + offset;
+		if (position >= nextStart) return clamp(position - nextStart, startOf(loop + 2) - nextStart);
+		return clamp(position - loopStart, nextStart - loopStart);
+	}
+
+	// Samples per beat at the tempo, not rounded. Loops at the cursor's tempo are resized with this.
+	double getSamplesPerBeat() const {
+		return samplesPerBeat;
+	}
+
+	/*
+	* Samples per beat at the same tempo and another sample rate, exactly as setTempo would work it out
+	* (division rounds the exact quotient, so reducing the fraction first makes no difference).
+	*/
+	double getSamplesPerBeatAt(double sampleRate) const {
+		int64_t rate = std::max<int64_t>(1, std::llround(sampleRate));
+		return (double)(60000 * rate) / milliBpm;
+	}
+
+	// Values a loop at this tempo holds; the longest pass it can have.
+	size_t getLoopSize() const {
+		return loopSize;
+	}
+
+	// Host position at the start of the block.
+	int64_t getSample() const {
+		return sample;
+	}
+
+	// Beat within the loop at the start of the block, 0 .. beatsPerLoop - 1.
+	int getBeat() const {
+		return beat;
+	}
+
+private:
+	static int64_t floorDivide(int64_t numerator, int64_t denominator) {
+		int64_t quotient = numerator / denominator;
+		return (numerator % denominator != 0 && numerator < 0) ? quotient - 1 : quotient;
+	}
+
+	int64_t startOf(int64_t loop) const {
+		return floorDivide(loop * beatNumerator * beatsPerLoop, beatDenominator);
+	}
+
+	// Guards against a pass coming out a sample longer than loopSize through rounding in getSamplesPerBeat.
+	LoopPosition clamp(int64_t position, int64_t length) const {
+		size_t end = std::min((size_t)length, loopSize);
+		return { std::min((size_t)position, end - 1), end };
+	}
+
+	int64_t rate = 0;
+	int64_t milliBpm = 0;
+	int beatsPerLoop = 0;
+	int64_t beatNumerator = 0;
+	int64_t beatDenominator = 1;
+	double samplesPerBeat = 0;
+	size_t loopSize = 0;
+
+	int64_t sample = 0;
+	int64_t loop = 0;
+	int64_t loopStart = 0;
+	int64_t nextStart = 0;
+	int beat = 0;
+};
\ No newline at end of file
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+
+/*
+* Hands a value from one writer thread to one reader thread without either side ever waiting.
+* There are three copies: the writer fills its back copy and publishes it by swapping it with the middle one,
+* and the reader picks up the middle copy by swapping it with its front one. Neither side ever sees
+* the other's copy, so reads are never torn, and the reader always gets the newest complete value.
+*/
+template<typename T>
+class TripleBuffer {
+public:
+	// The copy the writer may fill in. Its contents are whatever was there before, so overwrite all of it.
+	T& getWriteBuffer() {
+		return buffers[back];
+	}
+
+	// Make the write buffer visible to the reader. Writer thread only.
+	void publish() {
+		back = middle.exchange(back | freshBit, std::memory_order_acq_rel) & indexMask;
+	}
+
+	/*
+	* Pick up the newest published value, if there is one. Reader thread only.
+	* @return Whether read() now returns something new.
+	*/
+	bool update() {
+		if ((middle.load(std::memory_order_relaxed) & freshBit) == 0) return false;
+		front = middle.exchange(front, std::memory_order_acq_rel) & indexMask;
+		return true;
+	}
+
+	// The value the reader last picked up with update().
+	const T& read() const {
+		return buffers[front];
+	}
+
+private:
+	static constexpr int indexMask = 3;
+	static constexpr int freshBit = 4;
+
+	T buffers[3] {};
+	int front = 0;					// reader only
+	int back = 1;					// writer only
+	std::atomic<int> middle { 2 };	// index of the shared copy, plus freshBit if the reader hasn't taken it yet
+};
\ No newline at end of file
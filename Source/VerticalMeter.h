@@ -2,33 +2,86 @@
 
 #include <JuceHeader.h>
 
+/*
+* A level meter bar. The track and the bar are rendered once per size into cached images, and a level change
+* only repaints the strip the top of the bar moved across, and only once it moves by a whole pixel.
+*/
 class VerticalMeter : public juce::Component {
 public:
-	
+
 	void paint(juce::Graphics& g) override {
 		using namespace juce;
-		
-		const float cornerSize = 3.f;
-		auto bounds = getLocalBounds().toFloat();
 
-		g.setColour(Colours::white.withBrightness(0.4f));
-		g.fillRoundedRectangle(bounds, cornerSize);
+		float scale = g.getInternalContext().getPhysicalPixelScaleFactor();
+		if (track.isNull() || scale != imageScale) renderImages(scale);
+
+		auto bounds = getLocalBounds().toFloat();
+		g.drawImage(track, bounds);
+		if (drawnTop < getHeight()) {
+			g.reduceClipRegion(getLocalBounds().withTop(drawnTop));
+			g.drawImage(bar, bounds);
+		}
+	}
 
-		g.setColour(Colours::white);
-		float scaledY = jmap(level, MIN_LEVEL, 0.f, 0.f, static_cast<float>(getHeight()));
-		g.fillRoundedRectangle(bounds.removeFromBottom(scaledY), cornerSize);
+	void resized() override {
+		// rendered again at the next paint
+		track = {};
+		bar = {};
+		drawnTop = topFor(level);
 	}
 
-	void setLevel(float value) {
+	/*
+	* Move towards a new level: straight up to a peak, and back down with a time constant of releaseSeconds,
+	* however often this is called.
+	* @param value Level in dB.
+	* @param elapsedSeconds Time since the last call.
+	* @return Whether the bar is still falling towards value.
+	*/
+	bool setLevel(float value, double elapsedSeconds) {
 		if (value >= level) {
 			level = value;
 		} else {
-			level = level + (value - level) * 0.1;
+			level += (value - level) * (float)(1.0 - std::exp(-elapsedSeconds / releaseSeconds));
+		}
+
+		int top = topFor(level);
+		if (top != drawnTop) {
+			repaint(0, std::min(top, drawnTop), getWidth(), std::abs(top - drawnTop));
+			drawnTop = top;
 		}
+		return top != topFor(value);
 	}
 
 	const float MIN_LEVEL = -45.f;
 
 private:
+	static constexpr float cornerSize = 3.f;
+	static constexpr double releaseSeconds = 0.3;
+
+	int topFor(float value) const {
+		return juce::roundToInt(juce::jmap(value, MIN_LEVEL, 0.f, (float)getHeight(), 0.f));
+	}
+
+	// Both images at the display's pixel density, so they stay sharp on high DPI screens.
+	void renderImages(float scale) {
+		imageScale = scale;
+		int width = juce::jmax(1, juce::roundToInt(getWidth() * scale));
+		int height = juce::jmax(1, juce::roundToInt(getHeight() * scale));
+		track = renderBar(width, height, cornerSize * scale, juce::Colours::white.withBrightness(0.4f));
+		bar = renderBar(width, height, cornerSize * scale, juce::Colours::white);
+	}
+
+	static juce::Image renderBar(int width, int height, float corner, juce::Colour colour) {
+		juce::Image image(juce::Image::ARGB, width, height, true);
+		juce::Graphics g(image);
+		g.setColour(colour);
+		g.fillRoundedRectangle(juce::Rectangle<float>(0.f, 0.f, (float)width, (float)height), corner);
+		return image;
+	}
+
 	float level = MIN_LEVEL;
+	int drawnTop = 0;		// top of the bar as last painted, in pixels from the top
+	juce::Image track;
+	juce::Image bar;
+	float imageScale = 0.f;
 };
\ No newline at end of file